@@ -0,0 +1,139 @@
+/**************************************************************************
+ **
+ ** sngrep - SIP callflow viewer using ngrep
+ **
+ ** Copyright (C) 2013 Ivan Alonso (Kaian)
+ ** Copyright (C) 2013 Irontec SL. All rights reserved.
+ **
+ ** This program is free software: you can redistribute it and/or modify
+ ** it under the terms of the GNU General Public License as published by
+ ** the Free Software Foundation, either version 3 of the License, or
+ ** (at your option) any later version.
+ **
+ ** This program is distributed in the hope that it will be useful,
+ ** but WITHOUT ANY WARRANTY; without even the implied warranty of
+ ** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ ** GNU General Public License for more details.
+ **
+ ** You should have received a copy of the GNU General Public License
+ ** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ **
+ ****************************************************************************/
+/**
+ * @file arena.c
+ * @author Ivan Alonso [aka Kaian] <kaian@irontec.com>
+ *
+ * @brief Source of functions defined in arena.h
+ *
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "arena.h"
+
+//! First chunk size of an arena
+#define ARENA_MIN_CHUNK 512
+//! Chunks stop growing at this size
+#define ARENA_MAX_CHUNK 65536
+//! Blocks alignment
+#define ARENA_ALIGN(size) (((size) + sizeof(void *) - 1) & ~(sizeof(void *) - 1))
+
+void *
+arena_alloc(arena_t *arena, size_t size)
+{
+    arena_chunk_t *chunk = arena->chunks;
+    size_t csize;
+    void *block;
+
+    size = ARENA_ALIGN(size);
+
+    // Add a new chunk, twice bigger than the current one
+    if (!chunk || chunk->used + size > chunk->size) {
+        csize = (chunk) ? chunk->size * 2 : ARENA_MIN_CHUNK;
+        if (csize > ARENA_MAX_CHUNK) csize = ARENA_MAX_CHUNK;
+        if (csize < size) csize = size;
+        if (!(chunk = malloc(ARENA_ALIGN(sizeof(arena_chunk_t)) + csize))) return NULL;
+        chunk->size = csize;
+        chunk->used = 0;
+        chunk->next = arena->chunks;
+        arena->chunks = chunk;
+    }
+
+    block = (char *) chunk + ARENA_ALIGN(sizeof(arena_chunk_t)) + chunk->used;
+    chunk->used += size;
+    return block;
+}
+
+char *
+arena_strndup(arena_t *arena, const char *str, size_t len)
+{
+    char *copy;
+
+    if (!(copy = arena_alloc(arena, len + 1))) return NULL;
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+void
+arena_join(arena_t *dst, arena_t *src)
+{
+    arena_chunk_t *last;
+
+    if (!src->chunks) return;
+
+    // Keep destination current chunk first
+    if (dst->chunks) {
+        for (last = dst->chunks; last->next; last = last->next)
+            ;
+        last->next = src->chunks;
+    } else {
+        dst->chunks = src->chunks;
+    }
+    src->chunks = NULL;
+}
+
+void
+arena_free(arena_t *arena)
+{
+    arena_chunk_t *chunk, *next;
+
+    for (chunk = arena->chunks; chunk; chunk = next) {
+        next = chunk->next;
+        free(chunk);
+    }
+    arena->chunks = NULL;
+}
+
+void *
+slab_alloc(slab_t *slab)
+{
+    char *block;
+    void *obj;
+    int i;
+
+    pthread_mutex_lock(&slab->lock);
+    // Allocate a new block of objects
+    if (!slab->unused) {
+        if (!(block = malloc(slab->size * slab->count))) {
+            pthread_mutex_unlock(&slab->lock);
+            return NULL;
+        }
+        for (i = 0; i < slab->count; i++) {
+            *(void **) (block + i * slab->size) = slab->unused;
+            slab->unused = block + i * slab->size;
+        }
+    }
+    obj = slab->unused;
+    slab->unused = *(void **) obj;
+    pthread_mutex_unlock(&slab->lock);
+    return obj;
+}
+
+void
+slab_free(slab_t *slab, void *obj)
+{
+    pthread_mutex_lock(&slab->lock);
+    *(void **) obj = slab->unused;
+    slab->unused = obj;
+    pthread_mutex_unlock(&slab->lock);
+}
@@ -0,0 +1,158 @@
+/**************************************************************************
+ **
+ ** sngrep - SIP callflow viewer using ngrep
+ **
+ ** Copyright (C) 2013 Ivan Alonso (Kaian)
+ ** Copyright (C) 2013 Irontec SL. All rights reserved.
+ **
+ ** This program is free software: you can redistribute it and/or modify
+ ** it under the terms of the GNU General Public License as published by
+ ** the Free Software Foundation, either version 3 of the License, or
+ ** (at your option) any later version.
+ **
+ ** This program is distributed in the hope that it will be useful,
+ ** but WITHOUT ANY WARRANTY; without even the implied warranty of
+ ** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ ** GNU General Public License for more details.
+ **
+ ** You should have received a copy of the GNU General Public License
+ ** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ **
+ ****************************************************************************/
+/**
+ * @file arena.h
+ * @author Ivan Alonso [aka Kaian] <kaian@irontec.com>
+ *
+ * @brief Functions to manage arenas and slabs of memory
+ *
+ * An arena is a list of memory chunks where small blocks are allocated
+ * one after another. Blocks can not be released, all the arena memory is
+ * released at once. Each call uses its own arena for its messages and
+ * their data (payload, lines index and attributes).
+ *
+ * A slab is a pool of objects of the same size, allocated in big blocks
+ * and reused once released. Calls structures are allocated from slabs.
+ *
+ * Arenas are not thread-safe, callers must lock them. Slabs are.
+ */
+#ifndef __SNGREP_ARENA_H
+#define __SNGREP_ARENA_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+//! Shorter declaration of arena structure
+typedef struct arena arena_t;
+//! Shorter declaration of arena_chunk structure
+typedef struct arena_chunk arena_chunk_t;
+//! Shorter declaration of slab structure
+typedef struct slab slab_t;
+
+/**
+ * @brief Memory chunk of an arena
+ *
+ * Chunk data is stored after this header.
+ */
+struct arena_chunk
+{
+    //! Next chunk of the arena
+    arena_chunk_t *next;
+    //! Chunk data size
+    size_t size;
+    //! Used bytes of chunk data
+    size_t used;
+};
+
+/**
+ * @brief List of memory chunks
+ *
+ * An empty arena is all zeros.
+ */
+struct arena
+{
+    //! Chunks of the arena (current one first)
+    arena_chunk_t *chunks;
+};
+
+/**
+ * @brief Pool of fixed size objects
+ */
+struct slab
+{
+    //! Object size
+    size_t size;
+    //! Objects allocated in each block
+    int count;
+    //! Unused objects list
+    void *unused;
+    //! Slab lock
+    pthread_mutex_t lock;
+};
+
+//! Static initializer of a slab of objects with the given size
+#define SLAB_INITIALIZER(size, count) { (size), (count), NULL, PTHREAD_MUTEX_INITIALIZER }
+
+/**
+ * @brief Allocate a memory block in an arena
+ *
+ * Blocks are aligned to pointer size. Chunks grow from ARENA_MIN_CHUNK
+ * up to ARENA_MAX_CHUNK (bigger blocks get their own chunk).
+ *
+ * @param arena Arena structure
+ * @param size Block size
+ * @return allocated block or NULL
+ */
+extern void *
+arena_alloc(arena_t *arena, size_t size);
+
+/**
+ * @brief Copy a string in an arena
+ *
+ * @param arena Arena structure
+ * @param str String to copy (not null terminated)
+ * @param len String length
+ * @return null terminated copy or NULL
+ */
+extern char *
+arena_strndup(arena_t *arena, const char *str, size_t len);
+
+/**
+ * @brief Move all chunks of an arena to another one
+ *
+ * Source arena is empty after this.
+ *
+ * @param dst Arena that will own the chunks
+ * @param src Arena whose chunks are moved
+ */
+extern void
+arena_join(arena_t *dst, arena_t *src);
+
+/**
+ * @brief Release all memory of an arena
+ *
+ * @param arena Arena structure
+ */
+extern void
+arena_free(arena_t *arena);
+
+/**
+ * @brief Get an object from a slab
+ *
+ * @param slab Slab structure
+ * @return object (not initialized) or NULL
+ */
+extern void *
+slab_alloc(slab_t *slab);
+
+/**
+ * @brief Return an object to its slab
+ *
+ * Slab memory is never released to the system, objects are reused.
+ *
+ * @param slab Slab structure
+ * @param obj Object returned by slab_alloc
+ */
+extern void
+slab_free(slab_t *slab, void *obj);
+
+#endif
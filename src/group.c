@@ -28,8 +28,12 @@
  */
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include "group.h"
 
+//! Initial size of group arrays
+#define GROUP_MIN_SIZE 16
+
 sip_call_group_t *
 call_group_create()
 {
@@ -42,82 +46,428 @@ call_group_create()
     return group;
 }
 
+void
+call_group_destroy(sip_call_group_t *group)
+{
+    if (!group) return;
+    free(group->calls);
+    free(group->members);
+    free(group->msgs);
+    free(group->merged);
+    free(group->mergedcnt);
+    free(group);
+}
+
+/**
+ * @brief Message candidate of a call in the timeline merge heap
+ */
+struct call_group_head
+{
+    //! Next message of the call to be merged
+    sip_msg_t *msg;
+    //! Call position in the group
+    int call;
+};
+
+/**
+ * @brief Check if a heap entry must be merged before another one
+ *
+ * Messages with the same timestamp keep group calls order.
+ */
+static int
+call_group_head_before(struct call_group_head *a, struct call_group_head *b)
+{
+    if (a->msg->pkt.ts != b->msg->pkt.ts) return a->msg->pkt.ts < b->msg->pkt.ts;
+    return a->call < b->call;
+}
+
+/**
+ * @brief Move down an entry of the merge heap to its place
+ */
+static void
+call_group_heap_down(struct call_group_head *heap, int count, int i)
+{
+    struct call_group_head tmp;
+    int child;
+
+    while ((child = i * 2 + 1) < count) {
+        if (child + 1 < count && call_group_head_before(&heap[child + 1], &heap[child])) child++;
+        if (!call_group_head_before(&heap[child], &heap[i])) break;
+        tmp = heap[i];
+        heap[i] = heap[child];
+        heap[child] = tmp;
+        i = child;
+    }
+}
+
+/**
+ * @brief Forget all merged messages of the group
+ *
+ * The timeline will be rebuilt next time it's requested.
+ */
+static void
+call_group_reset(sip_call_group_t *group)
+{
+    group->msgcnt = 0;
+    group->cursor = 0;
+    group->changed = 1;
+    if (group->callcnt) {
+        memset(group->merged, 0, sizeof(sip_msg_t *) * group->callcnt);
+        memset(group->mergedcnt, 0, sizeof(int) * group->callcnt);
+    }
+}
+
+/**
+ * @brief Add a message at the end of the timeline
+ *
+ * @return 0 on success, 1 if timeline can not grow
+ */
+static int
+call_group_append(sip_call_group_t *group, sip_msg_t *msg)
+{
+    sip_msg_t **msgs;
+    int size;
+
+    if (group->msgcnt == group->msgsize) {
+        size = (group->msgsize) ? group->msgsize * 2 : 256;
+        if (!(msgs = realloc(group->msgs, sizeof(sip_msg_t *) * size))) return 1;
+        group->msgs = msgs;
+        group->msgsize = size;
+    }
+    group->msgs[group->msgcnt++] = msg;
+    return 0;
+}
+
+/**
+ * @brief Check if all call messages are in the timeline
+ *
+ * @return 1 if any call has messages not merged, 0 otherwise
+ */
+static int
+call_group_pending(sip_call_group_t *group)
+{
+    int i;
+
+    for (i = 0; i < group->callcnt; i++) {
+        if (call_msg_count(group->calls[i]) != group->mergedcnt[i]) return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Get the next message of a group call to be merged
+ *
+ * Messages that can not be parsed are skipped, but they're counted as
+ * merged, so the call doesn't look pending because of them.
+ *
+ * @param group SIP call group structure
+ * @param i Position of the call in the group
+ * @return next parsed message or NULL if there are no more
+ */
+static sip_msg_t *
+call_group_next_msg(sip_call_group_t *group, int i)
+{
+    sip_call_t *call = group->calls[i];
+    sip_msg_t *msg, *parsed = NULL;
+
+    pthread_mutex_lock(&call->lock);
+    msg = (group->merged[i]) ? group->merged[i]->next : call->msgs;
+    for (; msg && !(parsed = msg_parse(msg)); msg = msg->next) {
+        group->merged[i] = msg;
+        group->mergedcnt[i]++;
+    }
+    pthread_mutex_unlock(&call->lock);
+    return parsed;
+}
+
+/**
+ * @brief Merge the new messages of group calls into the timeline
+ *
+ * New messages of all calls are merged using a heap with the next
+ * message of each call, and appended to the timeline.
+ *
+ * @param group SIP call group structure
+ * @return 0 if new messages have been merged, 1 if the timeline must
+ *         be rebuilt (new messages are older than merged ones), -1 if
+ *         there is no memory to merge them
+ */
+static int
+call_group_merge(sip_call_group_t *group)
+{
+    struct call_group_head *heap;
+    int i, count = 0;
+
+    if (!(heap = malloc(sizeof(struct call_group_head) * group->callcnt))) return -1;
+    for (i = 0; i < group->callcnt; i++) {
+        if ((heap[count].msg = call_group_next_msg(group, i))) {
+            heap[count++].call = i;
+        }
+    }
+    for (i = count / 2 - 1; i >= 0; i--) {
+        call_group_heap_down(heap, count, i);
+    }
+
+    // New messages can not be appended
+    if (count && group->msgcnt && heap[0].msg->pkt.ts < group->msgs[group->msgcnt - 1]->pkt.ts) {
+        free(heap);
+        return 1;
+    }
+
+    // Merge new messages, oldest first
+    while (count && call_group_append(group, heap[0].msg) == 0) {
+        i = heap[0].call;
+        group->merged[i] = heap[0].msg;
+        group->mergedcnt[i]++;
+        if (!(heap[0].msg = call_group_next_msg(group, i))) {
+            heap[0] = heap[--count];
+        }
+        call_group_heap_down(heap, count, 0);
+    }
+    free(heap);
+    // Timeline could not grow
+    return (count) ? -1 : 0;
+}
+
+/**
+ * @brief Add the new messages of group calls to the timeline
+ *
+ * Calls are only checked when the group calls or the global messages
+ * generation have changed since the last update. The whole timeline
+ * is only rebuilt if new messages are older than the merged ones.
+ *
+ * @param group SIP call group structure
+ * @return 0 if the timeline is up to date, -1 otherwise
+ */
+static int
+call_group_update(sip_call_group_t *group)
+{
+    unsigned int generation = sip_msgs_generation();
+    int ret;
+
+    // No new messages since last update
+    if (!group->changed && group->generation == generation) return 0;
+
+    if ((ret = call_group_merge(group)) == 1) {
+        call_group_reset(group);
+        ret = call_group_merge(group);
+    }
+
+    // Messages added while merging are merged in next update
+    if (ret != 0 || call_group_pending(group)) return -1;
+    group->generation = generation;
+    group->changed = 0;
+    return 0;
+}
+
+/**
+ * @brief Find a call in the group hash set
+ *
+ * @return slot of the call or the empty slot where it should be added
+ */
+static int
+call_group_member_slot(sip_call_group_t *group, sip_call_t *call)
+{
+    int mask = group->membersize - 1;
+    int slot = (int) ((((uintptr_t) call) >> 4) * 2654435761U) & mask;
+
+    while (group->members[slot].call && group->members[slot].call != call)
+        slot = (slot + 1) & mask;
+    return slot;
+}
+
+/**
+ * @brief Make room for one more call in group arrays
+ *
+ * Group arrays are only replaced once all of them have been allocated.
+ * Groups are only used from the UI thread, so old arrays can be freed
+ * right away.
+ *
+ * @return 0 on success, 1 otherwise
+ */
+static int
+call_group_grow(sip_call_group_t *group)
+{
+    call_group_member_t *old = group->members;
+    int oldsize = group->membersize, size, i;
+    sip_call_t **calls;
+    sip_msg_t **merged;
+    int *mergedcnt;
+
+    // Calls and timeline state of each call
+    if (group->callcnt == group->callsize) {
+        size = (group->callsize) ? group->callsize * 2 : GROUP_MIN_SIZE;
+        calls = malloc(sizeof(sip_call_t *) * size);
+        merged = malloc(sizeof(sip_msg_t *) * size);
+        mergedcnt = malloc(sizeof(int) * size);
+        if (!calls || !merged || !mergedcnt) {
+            free(calls);
+            free(merged);
+            free(mergedcnt);
+            return 1;
+        }
+        if (group->callcnt) {
+            memcpy(calls, group->calls, sizeof(sip_call_t *) * group->callcnt);
+            memcpy(merged, group->merged, sizeof(sip_msg_t *) * group->callcnt);
+            memcpy(mergedcnt, group->mergedcnt, sizeof(int) * group->callcnt);
+        }
+        free(group->calls);
+        free(group->merged);
+        free(group->mergedcnt);
+        group->calls = calls;
+        group->merged = merged;
+        group->mergedcnt = mergedcnt;
+        group->callsize = size;
+    }
+
+    // Hash set is kept at most half full
+    if ((group->callcnt + 1) * 2 > group->membersize) {
+        size = (oldsize) ? oldsize * 2 : GROUP_MIN_SIZE * 2;
+        if (!(group->members = calloc(size, sizeof(call_group_member_t)))) {
+            group->members = old;
+            return 1;
+        }
+        group->membersize = size;
+        for (i = 0; i < oldsize; i++) {
+            if (old[i].call) group->members[call_group_member_slot(group, old[i].call)] = old[i];
+        }
+        free(old);
+    }
+    return 0;
+}
+
 void
 call_group_add(sip_call_group_t *group, sip_call_t *call)
 {
+    int slot, color, i;
 
     if (!group || !call || call_group_exists(group, call)) return;
+    if (call_group_grow(group) != 0) return;
+
+    // Use the color with less calls, so removed calls colors are reused
+    for (color = 0, i = 1; i < CALL_GROUP_COLORS; i++) {
+        if (group->colorcnt[i] < group->colorcnt[color]) color = i;
+    }
+    group->colorcnt[color]++;
+
+    slot = call_group_member_slot(group, call);
+    group->members[slot].call = call;
+    group->members[slot].color = color + 1;
     group->calls[group->callcnt++] = call;
+    call_group_reset(group);
 }
 
 void
 call_group_del(sip_call_group_t *group, sip_call_t *call)
 {
-    int i;
+    int i, slot, next, mask, home;
+
     if (!group || !call || !call_group_exists(group, call)) return;
-    for (i = 0; i < group->callcnt; i++) {
-        if (call == group->calls[i]) {
-            group->calls[i] = group->calls[i + 1];
-            call = group->calls[i + 1];
-        }
+
+    // Remove from the hash set, moving back following entries of the
+    // same cluster that are not in their home slot
+    mask = group->membersize - 1;
+    slot = call_group_member_slot(group, call);
+    group->colorcnt[group->members[slot].color - 1]--;
+    group->members[slot].call = NULL;
+    for (next = (slot + 1) & mask; group->members[next].call; next = (next + 1) & mask) {
+        home = call_group_member_slot(group, group->members[next].call);
+        if (home == next) continue;
+        group->members[slot] = group->members[next];
+        group->members[next].call = NULL;
+        slot = next;
     }
+
+    // Keep the order of the remaining calls
+    for (i = 0; group->calls[i] != call; i++)
+        ;
+    memmove(group->calls + i, group->calls + i + 1, sizeof(sip_call_t *) * (group->callcnt - i - 1));
     group->callcnt--;
+    call_group_reset(group);
+}
+
+void
+call_group_clear(sip_call_group_t *group)
+{
+    if (group->membersize) memset(group->members, 0, sizeof(call_group_member_t) * group->membersize);
+    memset(group->colorcnt, 0, sizeof(group->colorcnt));
+    group->callcnt = 0;
+    call_group_reset(group);
 }
 
 int
 call_group_exists(sip_call_group_t *group, sip_call_t *call)
 {
-    int i;
-    for (i = 0; i < group->callcnt; i++) {
-        if (call == group->calls[i]) return 1;
-    }
-    return 0;
+    if (!group->membersize) return 0;
+    return group->members[call_group_member_slot(group, call)].call == call;
 }
 
 int
 call_group_color(sip_call_group_t *group, sip_call_t *call)
 {
-    int i;
-    for (i = 0; i < group->callcnt; i++) {
-        if (call == group->calls[i]) {
-            return (i % 7) + 1;
-        }
-    }
-    return -1;
+    int slot;
+
+    if (!group->membersize) return -1;
+    slot = call_group_member_slot(group, call);
+    return (group->members[slot].call == call) ? group->members[slot].color : -1;
 }
 
-extern int
+int
 call_group_msg_count(sip_call_group_t *group)
 {
-    sip_msg_t *msg;
-    int msgcnt = 0, i;
+    call_group_update(group);
+    return group->msgcnt;
+}
 
-    for (i = 0; i < group->callcnt; i++) {
-        while ((msg = call_get_next_msg(group->calls[i], msg))) {
-            msgcnt++;
-        }
+sip_msg_t *
+call_group_get_msg(sip_call_group_t *group, int pos)
+{
+    if (pos < 0) return NULL;
+    // Check for new messages when reaching the end of the timeline
+    if (pos >= group->msgcnt) call_group_update(group);
+    if (pos >= group->msgcnt) return NULL;
+    group->cursor = pos;
+    return group->msgs[pos];
+}
+
+int
+call_group_msg_pos(sip_call_group_t *group, sip_msg_t *msg)
+{
+    int lo = 0, hi = group->msgcnt, pos;
+
+    // Most requests are for messages near the last one
+    for (pos = group->cursor - 1; pos <= group->cursor + 1; pos++) {
+        if (pos >= 0 && pos < group->msgcnt && group->msgs[pos] == msg) return pos;
+    }
+
+    // Search the first message with the same timestamp
+    while (lo < hi) {
+        pos = (lo + hi) / 2;
+        if (group->msgs[pos]->pkt.ts < msg->pkt.ts) lo = pos + 1;
+        else hi = pos;
     }
-    return msgcnt;
+    for (pos = lo; pos < group->msgcnt && group->msgs[pos]->pkt.ts == msg->pkt.ts; pos++) {
+        if (group->msgs[pos] == msg) return pos;
+    }
+    return -1;
 }
 
 sip_msg_t *
 call_group_get_next_msg(sip_call_group_t *group, sip_msg_t *msg)
 {
-    sip_msg_t *next = NULL;
-    sip_msg_t *cand;
-    int i;
+    int pos;
 
-    for (i = 0; i < group->callcnt; i++) {
-        cand = NULL;
-        while ((cand = call_get_next_msg(group->calls[i], cand))) {
-            // candidate must be between msg and next
-            if (sip_msg_is_older(cand, msg) && (!next || !sip_msg_is_older(cand, next))) {
-                next = cand;
-                break;
-            }
-        }
-    }
-    return next;
+    if (!msg) return call_group_get_msg(group, 0);
+    if ((pos = call_group_msg_pos(group, msg)) == -1) return NULL;
+    return call_group_get_msg(group, pos + 1);
+}
+
+sip_msg_t *
+call_group_get_prev_msg(sip_call_group_t *group, sip_msg_t *msg)
+{
+    int pos;
+
+    if (!msg || (pos = call_group_msg_pos(group, msg)) == -1) return NULL;
+    return call_group_get_msg(group, pos - 1);
 }
 
 int
@@ -125,10 +475,8 @@ sip_msg_is_older(sip_msg_t *one, sip_msg_t *two)
 {
     // Yes, you are older than nothing
     if (!two) return 1;
-    // Compare seconds
-    if (one->ts.tv_sec > two->ts.tv_sec) return 1;
-    // Compare useconds if seconds are equal
-    if (one->ts.tv_sec == two->ts.tv_sec && one->ts.tv_usec > two->ts.tv_usec) return 1;
+    // Compare capture timestamps
+    if (one->pkt.ts > two->pkt.ts) return 1;
     // Otherwise
     return 0;
 }
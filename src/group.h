@@ -35,8 +35,24 @@
 
 #include "sip.h"
 
+//! Number of colors used for group calls
+#define CALL_GROUP_COLORS 7
+
 //! Shorter declaration of sip_call_group structure
 typedef struct sip_call_group sip_call_group_t;
+//! Shorter declaration of call_group_member structure
+typedef struct call_group_member call_group_member_t;
+
+/**
+ * @brief Entry of the calls membership hash set of a group
+ */
+struct call_group_member
+{
+    //! Group call (NULL if the slot is empty)
+    sip_call_t *call;
+    //! Call color in the group
+    int color;
+};
 
 /**
  * @brief Contains a list of calls
@@ -48,24 +64,77 @@ typedef struct sip_call_group sip_call_group_t;
  * @note Trying to merge extended and normal callflow into a unique
  *       panel and allowing multiple dialog in a callflow.
  *
- * @fixme Remove 1024 "limitation"
+ * Calls are stored in a growable array (in the order they're added) and
+ * in a hash set, so checking if a call is in the group doesn't depend
+ * on the group size.
+ *
+ * Messages of all calls are merged in a timeline ordered by timestamp.
+ * The timeline is extended when calls get new messages and rebuilt
+ * when group calls change.
+ *
+ * Groups are not locked: they are only used from the UI thread, and
+ * the timeline is updated while panels are drawn.
  */
 struct sip_call_group
 {
-    sip_call_t *calls[1024];
+    //! Calls of the group
+    sip_call_t **calls;
+    //! Number of calls in the group
     int callcnt;
+    //! Allocated calls slots
+    int callsize;
+    //! Calls membership hash set (open addressing)
+    call_group_member_t *members;
+    //! Hash set size (power of two)
+    int membersize;
+    //! Number of group calls using each color
+    int colorcnt[CALL_GROUP_COLORS];
     int color;
+    //! Messages of all calls ordered by timestamp
+    sip_msg_t **msgs;
+    //! Number of messages in the timeline
+    int msgcnt;
+    //! Allocated timeline slots
+    int msgsize;
+    //! Last message of each call added to the timeline
+    sip_msg_t **merged;
+    //! Number of messages of each call added to the timeline
+    int *mergedcnt;
+    //! Timeline position of the last returned message
+    int cursor;
+    //! Messages generation the timeline was last updated with
+    unsigned int generation;
+    //! Group calls have changed since last update
+    int changed;
 };
 
 extern sip_call_group_t *
 call_group_create();
 
+/**
+ * @brief Free a group and its timeline
+ *
+ * Group calls are not freed.
+ *
+ * @param group SIP call group structure
+ */
+extern void
+call_group_destroy(sip_call_group_t *group);
+
 extern void
 call_group_add(sip_call_group_t *group, sip_call_t *call);
 
 extern void
 call_group_del(sip_call_group_t *group, sip_call_t *call);
 
+/**
+ * @brief Remove all calls from a group
+ *
+ * @param group SIP call group structure
+ */
+extern void
+call_group_clear(sip_call_group_t *group);
+
 extern int
 call_group_exists(sip_call_group_t *group, sip_call_t *call);
 
@@ -75,6 +144,29 @@ call_group_color(sip_call_group_t *group, sip_call_t *call);
 extern int
 call_group_msg_count(sip_call_group_t *group);
 
+/**
+ * @brief Get a message by its position in the group timeline
+ *
+ * @param group SIP call group structure
+ * @param pos Message position (starting at 0)
+ * @return message at the given position or NULL
+ */
+extern sip_msg_t *
+call_group_get_msg(sip_call_group_t *group, int pos);
+
+/**
+ * @brief Get the position of a message in the group timeline
+ *
+ * Positions near the last returned message are found in constant
+ * time, others are searched by timestamp.
+ *
+ * @param group SIP call group structure
+ * @param msg SIP message of any call of the group
+ * @return message position or -1 if it's not in the timeline
+ */
+extern int
+call_group_msg_pos(sip_call_group_t *group, sip_msg_t *msg);
+
 /**
  * @brief Finds the next msg in a call group.
  *
@@ -88,6 +180,16 @@ call_group_msg_count(sip_call_group_t *group);
 extern sip_msg_t *
 call_group_get_next_msg(sip_call_group_t *group, sip_msg_t *msg);
 
+/**
+ * @brief Finds the previous msg in a call group.
+ *
+ * @param callgroup SIP call group structure
+ * @param msg Actual SIP msg from any call of the group
+ * @return Previous chronological message in the group or NULL
+ */
+extern sip_msg_t *
+call_group_get_prev_msg(sip_call_group_t *group, sip_msg_t *msg);
+
 extern int
 sip_msg_is_older(sip_msg_t *one, sip_msg_t *two);
 
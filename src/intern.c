@@ -0,0 +1,155 @@
+/**************************************************************************
+ **
+ ** sngrep - SIP callflow viewer using ngrep
+ **
+ ** Copyright (C) 2013 Ivan Alonso (Kaian)
+ ** Copyright (C) 2013 Irontec SL. All rights reserved.
+ **
+ ** This program is free software: you can redistribute it and/or modify
+ ** it under the terms of the GNU General Public License as published by
+ ** the Free Software Foundation, either version 3 of the License, or
+ ** (at your option) any later version.
+ **
+ ** This program is distributed in the hope that it will be useful,
+ ** but WITHOUT ANY WARRANTY; without even the implied warranty of
+ ** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ ** GNU General Public License for more details.
+ **
+ ** You should have received a copy of the GNU General Public License
+ ** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ **
+ ****************************************************************************/
+/**
+ * @file intern.c
+ * @author Ivan Alonso [aka Kaian] <kaian@irontec.com>
+ *
+ * @brief Source of functions defined in intern.h
+ *
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "intern.h"
+#include "arena.h"
+
+//! Number of pool shards
+#define INTERN_SHARDS 16
+//! Initial size of shard tables
+#define INTERN_TABLE_MIN 256
+
+/**
+ * @brief Part of the interned strings pool
+ *
+ * Strings are indexed in an open addressing table and stored in the
+ * shard arena.
+ */
+struct intern_shard
+{
+    //! Shard lock
+    pthread_mutex_t lock;
+    //! Interned strings table
+    const char **table;
+    //! Table size (power of two)
+    unsigned int size;
+    //! Used slots
+    unsigned int used;
+    //! Memory of interned strings
+    arena_t arena;
+};
+
+//! Pool shards
+static struct intern_shard shards[INTERN_SHARDS];
+//! Shards locks initialization
+static pthread_once_t shards_once = PTHREAD_ONCE_INIT;
+
+/**
+ * @brief Initialize shards locks
+ */
+static void
+intern_init()
+{
+    int i;
+
+    for (i = 0; i < INTERN_SHARDS; i++)
+        pthread_mutex_init(&shards[i].lock, NULL);
+}
+
+/**
+ * @brief Hash of a string (FNV-1a)
+ */
+static unsigned int
+intern_hash(const char *str)
+{
+    unsigned int hash = 2166136261U;
+
+    for (; *str; str++)
+        hash = (hash ^ (unsigned char) *str) * 16777619U;
+    return hash;
+}
+
+/**
+ * @brief Find a string in a shard table
+ *
+ * @return slot of the string or the empty slot where it should be added
+ */
+static unsigned int
+intern_slot(struct intern_shard *shard, const char *str, unsigned int hash)
+{
+    unsigned int mask = shard->size - 1;
+
+    for (hash &= mask; shard->table[hash]; hash = (hash + 1) & mask) {
+        if (!strcmp(shard->table[hash], str)) break;
+    }
+    return hash;
+}
+
+/**
+ * @brief Make shard table twice bigger
+ *
+ * @return 0 on success, 1 otherwise
+ */
+static int
+intern_grow(struct intern_shard *shard)
+{
+    const char **old = shard->table;
+    unsigned int size = shard->size, i;
+
+    shard->size = (size) ? size * 2 : INTERN_TABLE_MIN;
+    if (!(shard->table = calloc(shard->size, sizeof(const char *)))) {
+        shard->table = old;
+        shard->size = size;
+        return 1;
+    }
+    for (i = 0; i < size; i++) {
+        if (old[i]) shard->table[intern_slot(shard, old[i], intern_hash(old[i]))] = old[i];
+    }
+    free(old);
+    return 0;
+}
+
+const char *
+intern_string(const char *str)
+{
+    struct intern_shard *shard;
+    unsigned int hash, slot;
+    const char *interned = NULL;
+
+    if (!str) return NULL;
+    pthread_once(&shards_once, intern_init);
+
+    hash = intern_hash(str);
+    shard = &shards[(hash >> 24) % INTERN_SHARDS];
+
+    pthread_mutex_lock(&shard->lock);
+    if ((shard->used + 1) * 2 <= shard->size || intern_grow(shard) == 0) {
+        slot = intern_slot(shard, str, hash);
+        if (!(interned = shard->table[slot])) {
+            if ((interned = arena_strndup(&shard->arena, str, strlen(str)))) {
+                shard->table[slot] = interned;
+                shard->used++;
+            }
+        }
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return interned;
+}
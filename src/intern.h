@@ -0,0 +1,50 @@
+/**************************************************************************
+ **
+ ** sngrep - SIP callflow viewer using ngrep
+ **
+ ** Copyright (C) 2013 Ivan Alonso (Kaian)
+ ** Copyright (C) 2013 Irontec SL. All rights reserved.
+ **
+ ** This program is free software: you can redistribute it and/or modify
+ ** it under the terms of the GNU General Public License as published by
+ ** the Free Software Foundation, either version 3 of the License, or
+ ** (at your option) any later version.
+ **
+ ** This program is distributed in the hope that it will be useful,
+ ** but WITHOUT ANY WARRANTY; without even the implied warranty of
+ ** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ ** GNU General Public License for more details.
+ **
+ ** You should have received a copy of the GNU General Public License
+ ** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ **
+ ****************************************************************************/
+/**
+ * @file intern.h
+ * @author Ivan Alonso [aka Kaian] <kaian@irontec.com>
+ *
+ * @brief Functions to manage the interned strings pool
+ *
+ * Values repeated in lots of messages (addresses, URIs, methods...) are
+ * stored only once in the pool. Interned strings are never released, so
+ * their pointers are stable and two interned strings are equal only if
+ * they're the same pointer.
+ *
+ * The pool is split in several shards, each one with its own lock, so
+ * threads loading messages in parallel rarely block each other.
+ */
+#ifndef __SNGREP_INTERN_H
+#define __SNGREP_INTERN_H
+
+/**
+ * @brief Get the interned copy of a string
+ *
+ * The string is added to the pool if it's not already there.
+ *
+ * @param str Null terminated string
+ * @return interned string or NULL if it can not be stored
+ */
+extern const char *
+intern_string(const char *str);
+
+#endif
@@ -0,0 +1,348 @@
+/**************************************************************************
+ **
+ ** sngrep - SIP callflow viewer using ngrep
+ **
+ ** Copyright (C) 2013 Ivan Alonso (Kaian)
+ ** Copyright (C) 2013 Irontec SL. All rights reserved.
+ **
+ ** This program is free software: you can redistribute it and/or modify
+ ** it under the terms of the GNU General Public License as published by
+ ** the Free Software Foundation, either version 3 of the License, or
+ ** (at your option) any later version.
+ **
+ ** This program is distributed in the hope that it will be useful,
+ ** but WITHOUT ANY WARRANTY; without even the implied warranty of
+ ** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ ** GNU General Public License for more details.
+ **
+ ** You should have received a copy of the GNU General Public License
+ ** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ **
+ ****************************************************************************/
+#ifdef WITH_LIBPCAP
+/**
+ * @file ipfrag.c
+ * @author Ivan Alonso [aka Kaian] <kaian@irontec.com>
+ *
+ * @brief Source of functions defined in ipfrag.h
+ *
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "ipfrag.h"
+#include "option.h"
+
+//! Maximum IP payload size
+#define IPFRAG_MAX_SIZE 65535
+//! Fragment offsets are measured in 8 byte blocks
+#define IPFRAG_BLOCKS ((IPFRAG_MAX_SIZE + 7) / 8)
+//! Datagram buffers grow in chunks of this size
+#define IPFRAG_CHUNK 1024
+
+//! Shorter declaration of ipfrag structure
+typedef struct ipfrag ipfrag_t;
+
+/**
+ * @brief Datagram being reassembled
+ */
+struct ipfrag
+{
+    //! Source address
+    struct in_addr src;
+    //! Destination address
+    struct in_addr dst;
+    //! IP identification
+    u_int16_t id;
+    //! IP protocol
+    u_int8_t proto;
+    //! Table bucket of this datagram
+    unsigned int bucket;
+    //! Reassembled payload
+    u_char *data;
+    //! Allocated bytes of data
+    int alloc;
+    //! Payload size (only known after receiving the last fragment)
+    int total;
+    //! Number of received blocks
+    int blocks;
+    //! Received blocks bitmap
+    u_int8_t map[(IPFRAG_BLOCKS + 7) / 8];
+    //! Timestamp of the first received fragment
+    u_int64_t ts;
+    //! Next datagram in the same bucket (or in the free list)
+    ipfrag_t *hnext;
+    //! Datagrams list ordered by age
+    ipfrag_t *prev, *next;
+};
+
+//! Preallocated datagrams
+static ipfrag_t *pool = NULL;
+//! Unused datagrams
+static ipfrag_t *unused = NULL;
+//! Hash table buckets
+static ipfrag_t **buckets = NULL;
+//! Number of buckets - 1
+static unsigned int bucket_mask;
+//! Oldest and newest datagrams
+static ipfrag_t *oldest = NULL, *newest = NULL;
+//! Completed datagram (released in the next call)
+static ipfrag_t *completed = NULL;
+//! Bytes allocated for datagram buffers
+static int memory = 0;
+//! Configured limits
+static int max_memory;
+static u_int64_t timeout;
+//! Reassembly counters
+static struct ipfrag_stats stats;
+
+/**
+ * @brief Allocate the datagram pool and hash table
+ *
+ * @return 0 on success, 1 otherwise
+ */
+static int
+ipfrag_init()
+{
+    int i, max;
+    unsigned int nbuckets = 16;
+
+    if ((max = get_option_int_value("capture.ipfrag.max")) < 1) max = 1;
+    max_memory = get_option_int_value("capture.ipfrag.memory");
+    timeout = (u_int64_t) get_option_int_value("capture.ipfrag.timeout") * 1000000000;
+
+    // Twice buckets than datagrams keeps chains short
+    while (nbuckets < (unsigned int) max * 2)
+        nbuckets <<= 1;
+
+    if (!(pool = malloc(sizeof(ipfrag_t) * max))) return 1;
+    if (!(buckets = calloc(nbuckets, sizeof(ipfrag_t *)))) {
+        free(pool);
+        pool = NULL;
+        return 1;
+    }
+    bucket_mask = nbuckets - 1;
+
+    // All datagrams are unused
+    for (i = 0; i < max; i++) {
+        pool[i].hnext = unused;
+        unused = &pool[i];
+    }
+    return 0;
+}
+
+/**
+ * @brief Get table bucket of a datagram
+ */
+static unsigned int
+ipfrag_hash(const struct nread_ip *ip)
+{
+    unsigned int hash;
+
+    hash = ip->ip_src.s_addr * 2654435761U;
+    hash ^= ip->ip_dst.s_addr * 2246822519U;
+    hash ^= ((unsigned int) ip->ip_id << 8 | ip->ip_p) * 3266489917U;
+    return (hash ^ (hash >> 16)) & bucket_mask;
+}
+
+/**
+ * @brief Remove a datagram from the table and age list
+ *
+ * Datagram data is not released.
+ */
+static void
+ipfrag_unlink(ipfrag_t *frag)
+{
+    ipfrag_t **cur;
+
+    // Remove from its bucket
+    for (cur = &buckets[frag->bucket]; *cur; cur = &(*cur)->hnext) {
+        if (*cur == frag) {
+            *cur = frag->hnext;
+            break;
+        }
+    }
+
+    // Remove from age list
+    if (frag->prev) frag->prev->next = frag->next;
+    else oldest = frag->next;
+    if (frag->next) frag->next->prev = frag->prev;
+    else newest = frag->prev;
+}
+
+/**
+ * @brief Release datagram data and return it to the unused list
+ */
+static void
+ipfrag_free(ipfrag_t *frag)
+{
+    free(frag->data);
+    memory -= frag->alloc;
+    frag->data = NULL;
+    frag->alloc = 0;
+    frag->hnext = unused;
+    unused = frag;
+}
+
+/**
+ * @brief Discard the oldest datagram
+ */
+static void
+ipfrag_evict()
+{
+    ipfrag_t *frag = oldest;
+
+    ipfrag_unlink(frag);
+    ipfrag_free(frag);
+    stats.evicted++;
+}
+
+/**
+ * @brief Find the datagram of a fragment or create a new one
+ *
+ * @return datagram or NULL if it can not be created
+ */
+static ipfrag_t *
+ipfrag_get(const struct nread_ip *ip, u_int64_t ts)
+{
+    ipfrag_t *frag;
+    unsigned int bucket = ipfrag_hash(ip);
+
+    for (frag = buckets[bucket]; frag; frag = frag->hnext) {
+        if (frag->id == ip->ip_id && frag->proto == ip->ip_p
+            && frag->src.s_addr == ip->ip_src.s_addr && frag->dst.s_addr == ip->ip_dst.s_addr) {
+            return frag;
+        }
+    }
+
+    // Make room for this datagram
+    if (!unused) {
+        if (!oldest) return NULL;
+        ipfrag_evict();
+    }
+
+    frag = unused;
+    unused = frag->hnext;
+    memset(frag, 0, sizeof(ipfrag_t));
+    frag->src = ip->ip_src;
+    frag->dst = ip->ip_dst;
+    frag->id = ip->ip_id;
+    frag->proto = ip->ip_p;
+    frag->total = -1;
+    frag->ts = ts;
+
+    // Add to its bucket
+    frag->bucket = bucket;
+    frag->hnext = buckets[bucket];
+    buckets[bucket] = frag;
+
+    // Add to the end of age list
+    frag->prev = newest;
+    if (newest) newest->next = frag;
+    else oldest = frag;
+    newest = frag;
+    return frag;
+}
+
+/**
+ * @brief Make datagram buffer big enough for the given size
+ *
+ * Older datagrams are discarded if required to keep memory usage
+ * under the configured limit.
+ *
+ * @return 0 on success, 1 if buffer can not grow
+ */
+static int
+ipfrag_grow(ipfrag_t *frag, int size)
+{
+    int alloc;
+    u_char *data;
+
+    if (size <= frag->alloc) return 0;
+    alloc = (size + IPFRAG_CHUNK - 1) & ~(IPFRAG_CHUNK - 1);
+
+    // Discard older datagrams until this one fits
+    while (memory + alloc - frag->alloc > max_memory && oldest && oldest != frag) {
+        ipfrag_evict();
+    }
+    if (memory + alloc - frag->alloc > max_memory) return 1;
+
+    if (!(data = realloc(frag->data, alloc))) return 1;
+    memory += alloc - frag->alloc;
+    frag->data = data;
+    frag->alloc = alloc;
+    return 0;
+}
+
+const u_char *
+ipfrag_add(const struct nread_ip *ip, int caplen, u_int64_t ts, int *size)
+{
+    ipfrag_t *frag;
+    int size_ip, offset, len, end, block;
+    int more = ntohs(ip->ip_off) & IP_MF;
+
+    // Allocate table the first time
+    if (!pool && ipfrag_init() != 0) return NULL;
+
+    // Release previously completed datagram
+    if (completed) {
+        ipfrag_free(completed);
+        completed = NULL;
+    }
+
+    // Discard datagrams waiting for too long
+    while (oldest && oldest->ts + timeout < ts) {
+        frag = oldest;
+        ipfrag_unlink(frag);
+        ipfrag_free(frag);
+        stats.expired++;
+    }
+
+    // Get fragment position in the datagram
+    size_ip = IP_HL(ip) * 4;
+    offset = (ntohs(ip->ip_off) & IP_OFFMASK) * 8;
+    len = ntohs(ip->ip_len) - size_ip;
+    end = offset + len;
+
+    // Ignore truncated or malformed fragments
+    if (len <= 0 || len > caplen - size_ip || end > IPFRAG_MAX_SIZE) return NULL;
+    if (more && (len & 7)) return NULL;
+
+    if (!(frag = ipfrag_get(ip, ts))) return NULL;
+
+    if (ipfrag_grow(frag, end) != 0) {
+        ipfrag_unlink(frag);
+        ipfrag_free(frag);
+        stats.evicted++;
+        return NULL;
+    }
+
+    // Store fragment data and mark its blocks as received
+    memcpy(frag->data + offset, (const u_char *) ip + size_ip, len);
+    for (block = offset / 8; block < (end + 7) / 8; block++) {
+        if (!(frag->map[block >> 3] & (1 << (block & 7)))) {
+            frag->map[block >> 3] |= 1 << (block & 7);
+            frag->blocks++;
+        }
+    }
+
+    // Last fragment gives us the datagram size
+    if (!more) frag->total = end;
+
+    // Check if all blocks have been received
+    if (frag->total < 0 || frag->blocks != (frag->total + 7) / 8) return NULL;
+
+    // Keep the data until next call
+    ipfrag_unlink(frag);
+    completed = frag;
+    stats.reassembled++;
+    *size = frag->total;
+    return frag->data;
+}
+
+void
+ipfrag_get_stats(struct ipfrag_stats *fstats)
+{
+    memcpy(fstats, &stats, sizeof(struct ipfrag_stats));
+}
+
+#endif
@@ -0,0 +1,87 @@
+/**************************************************************************
+ **
+ ** sngrep - SIP callflow viewer using ngrep
+ **
+ ** Copyright (C) 2013 Ivan Alonso (Kaian)
+ ** Copyright (C) 2013 Irontec SL. All rights reserved.
+ **
+ ** This program is free software: you can redistribute it and/or modify
+ ** it under the terms of the GNU General Public License as published by
+ ** the Free Software Foundation, either version 3 of the License, or
+ ** (at your option) any later version.
+ **
+ ** This program is distributed in the hope that it will be useful,
+ ** but WITHOUT ANY WARRANTY; without even the implied warranty of
+ ** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ ** GNU General Public License for more details.
+ **
+ ** You should have received a copy of the GNU General Public License
+ ** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ **
+ ****************************************************************************/
+/**
+ * @file ipfrag.h
+ * @author Ivan Alonso [aka Kaian] <kaian@irontec.com>
+ *
+ * @brief Functions to reassemble fragmented IPv4 datagrams
+ *
+ * Big SIP messages over UDP (INVITEs with large SDP or many Via headers)
+ * are usually fragmented. Fragments are stored in a table indexed by
+ * source, destination, identification and protocol until the whole
+ * datagram has been received.
+ *
+ * Memory used by the table is limited using the following options:
+ *
+ *  - capture.ipfrag.max      Maximum datagrams being reassembled
+ *  - capture.ipfrag.memory   Maximum bytes of buffered fragments
+ *  - capture.ipfrag.timeout  Seconds to wait for missing fragments
+ *
+ * When any limit is reached, the oldest datagram is discarded.
+ *
+ * This is not thread-safe: all fragments must be added by the same
+ * thread.
+ */
+#ifndef __SNGREP_IPFRAG_H
+#define __SNGREP_IPFRAG_H
+
+#include "spcap.h"
+
+/**
+ * @brief Fragment reassembly counters
+ */
+struct ipfrag_stats
+{
+    //! Datagrams completely reassembled
+    unsigned long reassembled;
+    //! Datagrams discarded because not all fragments arrived in time
+    unsigned long expired;
+    //! Datagrams discarded to keep the table within its limits
+    unsigned long evicted;
+};
+
+/**
+ * @brief Add a fragment to the reassembly table
+ *
+ * Fragment data is copied to the datagram buffer. When the last missing
+ * fragment is added, the reassembled datagram payload (transport header
+ * and data) is returned. That pointer is only valid until the next call
+ * to this function.
+ *
+ * @param ip IP header of the fragment
+ * @param caplen Captured bytes from the start of IP header
+ * @param ts Fragment timestamp in nanoseconds
+ * @param size Filled with datagram payload size
+ * @return datagram payload or NULL if the datagram is not complete
+ */
+extern const u_char *
+ipfrag_add(const struct nread_ip *ip, int caplen, u_int64_t ts, int *size);
+
+/**
+ * @brief Get current reassembly counters
+ *
+ * @param stats Structure to be filled with current counters
+ */
+extern void
+ipfrag_get_stats(struct ipfrag_stats *stats);
+
+#endif
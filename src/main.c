@@ -31,6 +31,7 @@
  */
 
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 #include "option.h"
 #include "ui_manager.h"
@@ -53,7 +54,8 @@ usage(const char* progname)
     fprintf(stdout, "\tsee 'man ngrep' for available ngrep options\n\n");
     fprintf(stdout, "Note: some ngrep options are forced by %s\n", progname);
 #else
-    fprintf(stdout, "\t%s <pcap filter>\n", progname);
+    fprintf(stdout, "\t%s [<pcap filter>]\n", progname);
+    fprintf(stdout, "\tonly SIP ports are captured if no filter is given\n");
 #endif
 }
 
@@ -64,8 +66,9 @@ usage(const char* progname)
  *
  * @note There are no params actually... if you supply one
  *    param, I will assume we are running offline mode with
- *    a pcap file. Otherwise the args will be passed to ngrep
- *    without any type of validation.
+ *    a pcap file, loaded in background. Otherwise the args will be passed to ngrep
+ *    without any type of validation. Without ngrep, running
+ *    with no args captures using the default SIP filter.
  *
  */
 int
@@ -77,25 +80,42 @@ main(int argc, char* argv[])
     pthread_attr_t attr;
     //! ngrep running thread
     pthread_t exec_t;
+    //! Capture file loading progress
+    struct capture_load_stats load_stats;
 
     // Initialize configuration options
     init_options();
 
     // Parse arguments.. I mean..
+#ifdef WITH_NGREP
     if (argc < 2) {
         // No arguments!
         usage(argv[0]);
         return 1;
+    }
+#endif
+    if (argc == 2 && (!strcmp(argv[1], "-h") || !strcmp(argv[1], "--help"))) {
+        usage(argv[0]);
+        return 0;
     } else if (argc == 2) {
         // Show offline mode in ui
         set_option_value("sngrep.mode", "Offline");
         set_option_value("sngrep.file", argv[1]);
 
         // Assume Offline mode with pcap file
-        if (load_from_file(argv[1]) != 0) {
+        if (access(argv[1], R_OK) != 0) {
             fprintf(stderr, "Error loading data from pcap file %s\n", argv[1]);
             return 1;
         }
+
+        // Load the file in a thread, calls are displayed while loading
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if (pthread_create(&exec_t, &attr, (void *) load_from_file, argv[1])) {
+            fprintf(stderr, "Unable to create Load Thread!\n");
+            return 1;
+        }
+        pthread_attr_destroy(&attr);
     } else {
         // Show online mode in ui
         set_option_value("sngrep.mode", "Online");
@@ -114,6 +134,16 @@ main(int argc, char* argv[])
     // This is a blocking call. Interface have user action loops.
     init_interface();
 
+    // Report capture file errors once the interface is closed
+    if (get_option_value("sngrep.file")) {
+        capture_get_load_stats(&load_stats);
+        if (load_stats.status == CAPTURE_LOAD_FAILED) {
+            fprintf(stderr, "Error loading data from pcap file %s: %s\n",
+                get_option_value("sngrep.file"), load_stats.error);
+            ret = 1;
+        }
+    }
+
     // Delete the temporal file (if any)
     if (!is_option_enabled("sngrep.keeptmpfile") &&
         !is_option_disabled(get_option_value("sngrep.tmpfile"))) {
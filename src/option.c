@@ -85,6 +85,29 @@ init_options()
     set_option_value("sip.ignoreincomlete", "on");
     set_option_value("sip.capture", "on");
 
+    // Online capture backend options
+    set_option_value("capture.device", "any");
+    set_option_value("capture.merge.delay", "50");
+    set_option_value("capture.workers", "2");
+    set_option_value("capture.ringsize", "8388608");
+    set_option_value("capture.filter.ports", "5060,5061");
+    set_option_value("capture.filter.payload", "off");
+    set_option_value("capture.tpacket", "off");
+    set_option_value("capture.tpacket.blocksize", "1048576");
+    set_option_value("capture.tpacket.blocks", "64");
+    set_option_value("capture.tpacket.timeout", "100");
+    set_option_value("capture.dump.batch", "1048576");
+    set_option_value("capture.dump.interval", "1000");
+    set_option_value("capture.dump.queuesize", "8388608");
+    set_option_value("capture.ipfrag.max", "1024");
+    set_option_value("capture.ipfrag.memory", "4194304");
+    set_option_value("capture.ipfrag.timeout", "30");
+    set_option_value("capture.tcp.max", "4096");
+    set_option_value("capture.tcp.memory", "16777216");
+    set_option_value("capture.tcp.timeout", "60");
+    set_option_value("capture.offline.workers", "0");
+    set_option_value("capture.index", "on");
+
     // Set default temporal file
     sprintf(tmpfile, "/tmp/sngrep-%u.pcap", (unsigned)time(NULL));
     set_option_value("sngrep.tmpfile", tmpfile);
@@ -237,6 +260,8 @@ int
 is_ignored_value(const char *field, const char *fvalue)
 {
     int i;
+    // Attributes without value can not be ignored
+    if (!fvalue) return 0;
     for (i = 0; i < optscnt; i++) {
         if (!strcasecmp(options[i].opt, field) && !strcasecmp(options[i].value, fvalue)) {
             return 1;
@@ -245,6 +270,18 @@ is_ignored_value(const char *field, const char *fvalue)
     return 0;
 }
 
+int
+has_ignored_values(const char *field)
+{
+    int i;
+    for (i = 0; i < optscnt; i++) {
+        if (!strcasecmp(options[i].opt, field)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
 void
 toggle_option(const char *option)
 {
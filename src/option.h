@@ -189,6 +189,17 @@ is_option_disabled(const char *opt);
 extern int
 is_ignored_value(const char *field, const char *fvalue);
 
+/**
+ * @brief Check if there is any ignore directive for the given field
+ *
+ * Used to avoid getting field values that will never be ignored.
+ *
+ * @param field Name of configuration option
+ * @return 1 if an ignore directive for field exists
+ */
+extern int
+has_ignored_values(const char *field);
+
 extern void
 toggle_option(const char *option);
 
@@ -0,0 +1,380 @@
+/**************************************************************************
+ **
+ ** sngrep - SIP callflow viewer using ngrep
+ **
+ ** Copyright (C) 2013 Ivan Alonso (Kaian)
+ ** Copyright (C) 2013 Irontec SL. All rights reserved.
+ **
+ ** This program is free software: you can redistribute it and/or modify
+ ** it under the terms of the GNU General Public License as published by
+ ** the Free Software Foundation, either version 3 of the License, or
+ ** (at your option) any later version.
+ **
+ ** This program is distributed in the hope that it will be useful,
+ ** but WITHOUT ANY WARRANTY; without even the implied warranty of
+ ** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ ** GNU General Public License for more details.
+ **
+ ** You should have received a copy of the GNU General Public License
+ ** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ **
+ ****************************************************************************/
+#ifdef WITH_LIBPCAP
+/**
+ * @file pcapfile.c
+ * @author Ivan Alonso [aka Kaian] <kaian@irontec.com>
+ *
+ * @brief Source of functions defined in pcapfile.h
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "pcapfile.h"
+
+//! Classic pcap magic numbers (microsecond and nanosecond timestamps)
+#define PCAP_MAGIC       0xa1b2c3d4
+#define PCAP_MAGIC_NSEC  0xa1b23c4d
+//! Classic pcap file and record header sizes
+#define PCAP_FILE_HDR_LEN   24
+#define PCAP_RECORD_HDR_LEN 16
+
+//! pcapng block types
+#define PCAPNG_SHB 0x0A0D0D0A
+#define PCAPNG_IDB 0x00000001
+#define PCAPNG_PB  0x00000002
+#define PCAPNG_SPB 0x00000003
+#define PCAPNG_EPB 0x00000006
+//! pcapng byte order magic
+#define PCAPNG_BOM 0x1A2B3C4D
+//! pcapng interface timestamp resolution option
+#define PCAPNG_OPT_TSRESOL 9
+//! Linktype values stored in files that differ from DLT values
+#define LINKTYPE_RAW  101
+#define LINKTYPE_LOOP 108
+
+/**
+ * @brief Mapped capture file
+ */
+struct pcapfile
+{
+    //! Mapped file data
+    const u_char *data;
+    //! File size
+    size_t size;
+    //! File uses the other byte order
+    int swapped;
+    //! Packet handler
+    pcap_handler handler;
+    //! Handler user argument
+    u_char *user;
+    //! Bytes read so far (can be NULL)
+    size_t *read;
+    //! Datalink of the file (-1 until known)
+    int linktype;
+    //! Timestamp units per second of each pcapng interface
+    u_int64_t *tsres;
+    //! Number of pcapng interfaces in current section
+    int ifcount;
+    //! Error message buffer (PCAP_ERRBUF_SIZE bytes)
+    char *errbuf;
+};
+
+//! File being read and its size
+static const u_char *mapped = NULL;
+static size_t mapped_size = 0;
+
+/**
+ * @brief Read a 16 bits value in file byte order
+ */
+static inline u_int16_t
+pcapfile_u16(const struct pcapfile *pf, const u_char *p)
+{
+    u_int16_t v;
+    memcpy(&v, p, sizeof(v));
+    return pf->swapped ? __builtin_bswap16(v) : v;
+}
+
+/**
+ * @brief Read a 32 bits value in file byte order
+ */
+static inline u_int32_t
+pcapfile_u32(const struct pcapfile *pf, const u_char *p)
+{
+    u_int32_t v;
+    memcpy(&v, p, sizeof(v));
+    return pf->swapped ? __builtin_bswap32(v) : v;
+}
+
+/**
+ * @brief Set the datalink of the file
+ *
+ * All packets must share the same datalink.
+ *
+ * @return 0 on success, 1 if linktype is not supported
+ */
+static int
+pcapfile_set_linktype(struct pcapfile *pf, int linktype)
+{
+    // Convert file values to libpcap DLT values
+    if (linktype == LINKTYPE_RAW) linktype = DLT_RAW;
+#ifdef DLT_LOOP
+    if (linktype == LINKTYPE_LOOP) linktype = DLT_LOOP;
+#endif
+
+    if (pf->linktype == linktype) return 0;
+    if (pf->linktype != -1) {
+        snprintf(pf->errbuf, PCAP_ERRBUF_SIZE,
+            "Capture files with several datalink types are not supported");
+        return 1;
+    }
+    if (capture_set_linktype(linktype) != 0) {
+        snprintf(pf->errbuf, PCAP_ERRBUF_SIZE, "Unsupported datalink type %s",
+            pcap_datalink_val_to_name(linktype));
+        return 1;
+    }
+    pf->linktype = linktype;
+    return 0;
+}
+
+/**
+ * @brief Walk all records of a classic pcap file
+ */
+static int
+pcapfile_read_pcap(struct pcapfile *pf, int nsec)
+{
+    struct pcap_pkthdr header;
+    const u_char *pos = pf->data + PCAP_FILE_HDR_LEN, *end = pf->data + pf->size;
+    u_int32_t caplen;
+
+    if (pcapfile_set_linktype(pf, pcapfile_u32(pf, pf->data + 20) & 0x03ffffff) != 0)
+        return PCAPFILE_ERROR;
+
+    // Stop at the first truncated record
+    while (end - pos >= PCAP_RECORD_HDR_LEN) {
+        caplen = pcapfile_u32(pf, pos + 8);
+        if (caplen > (size_t) (end - pos) - PCAP_RECORD_HDR_LEN) break;
+
+        header.ts.tv_sec = pcapfile_u32(pf, pos);
+        header.ts.tv_usec = pcapfile_u32(pf, pos + 4);
+        if (nsec) header.ts.tv_usec /= 1000;
+        header.caplen = caplen;
+        header.len = pcapfile_u32(pf, pos + 12);
+
+        pf->handler(pf->user, &header, pos + PCAP_RECORD_HDR_LEN);
+        pos += PCAP_RECORD_HDR_LEN + caplen;
+        if (pf->read) *pf->read = pos - pf->data;
+    }
+    return PCAPFILE_OK;
+}
+
+/**
+ * @brief Add a pcapng interface with its timestamp resolution
+ *
+ * @param body Interface description block body
+ * @param len Block body length
+ */
+static int
+pcapfile_add_interface(struct pcapfile *pf, const u_char *body, size_t len)
+{
+    u_int64_t *tsres;
+    u_int16_t code, olen;
+    size_t pos = 8;
+    int i;
+
+    if (len < 8 || pcapfile_set_linktype(pf, pcapfile_u16(pf, body)) != 0)
+        return 1;
+
+    if (!(tsres = realloc(pf->tsres, sizeof(u_int64_t) * (pf->ifcount + 1)))) {
+        snprintf(pf->errbuf, PCAP_ERRBUF_SIZE, "Not enough memory");
+        return 1;
+    }
+    pf->tsres = tsres;
+    pf->tsres[pf->ifcount] = 1000000;
+
+    // Look for timestamp resolution option
+    while (pos + 4 <= len) {
+        code = pcapfile_u16(pf, body + pos);
+        olen = pcapfile_u16(pf, body + pos + 2);
+        if (code == 0 || pos + 4 + olen > len) break;
+        if (code == PCAPNG_OPT_TSRESOL && olen >= 1) {
+            if (body[pos + 4] & 0x80) {
+                pf->tsres[pf->ifcount] = (u_int64_t) 1 << (body[pos + 4] & 0x3f);
+            } else {
+                for (i = 0, pf->tsres[pf->ifcount] = 1; i < (body[pos + 4] & 0x7f) && i < 19; i++)
+                    pf->tsres[pf->ifcount] *= 10;
+            }
+        }
+        pos += 4 + ((olen + 3) & ~3);
+    }
+    pf->ifcount++;
+    return 0;
+}
+
+/**
+ * @brief Pass a pcapng packet to the handler
+ *
+ * @param iface Interface number
+ * @param ts Timestamp in interface units
+ * @param data Packet data
+ * @param caplen Captured packet length
+ * @param len Original packet length
+ */
+static void
+pcapfile_packet(struct pcapfile *pf, u_int32_t iface, u_int64_t ts, const u_char *data,
+                u_int32_t caplen, u_int32_t len)
+{
+    struct pcap_pkthdr header;
+    u_int64_t tsres;
+
+    // Ignore packets of unknown interfaces
+    if (iface >= (u_int32_t) pf->ifcount) return;
+    tsres = pf->tsres[iface];
+
+    header.ts.tv_sec = ts / tsres;
+    if (tsres >= 1000000) {
+        header.ts.tv_usec = (ts % tsres) / (tsres / 1000000);
+    } else {
+        header.ts.tv_usec = (ts % tsres) * 1000000 / tsres;
+    }
+    header.caplen = caplen;
+    header.len = len;
+    pf->handler(pf->user, &header, data);
+}
+
+/**
+ * @brief Walk all blocks of a pcapng file
+ */
+static int
+pcapfile_read_pcapng(struct pcapfile *pf)
+{
+    const u_char *pos = pf->data, *end = pf->data + pf->size, *body;
+    u_int32_t type, blen, caplen, bom;
+    size_t len;
+
+    while (end - pos >= 12) {
+        type = pcapfile_u32(pf, pos);
+
+        // Each section can use its own byte order
+        if (type == PCAPNG_SHB) {
+            if (end - pos < 28) break;
+            memcpy(&bom, pos + 8, sizeof(bom));
+            if (bom == PCAPNG_BOM) pf->swapped = 0;
+            else if (__builtin_bswap32(bom) == PCAPNG_BOM) pf->swapped = 1;
+            else break;
+            pf->ifcount = 0;
+        }
+
+        // Stop at the first truncated block
+        blen = pcapfile_u32(pf, pos + 4);
+        if (blen < 12 || (blen & 3) || blen > (size_t) (end - pos)) break;
+        body = pos + 8;
+        len = blen - 12;
+
+        switch (type) {
+            case PCAPNG_IDB:
+                if (pcapfile_add_interface(pf, body, len) != 0) return PCAPFILE_ERROR;
+                break;
+            case PCAPNG_EPB:
+                if (len < 20) break;
+                caplen = pcapfile_u32(pf, body + 12);
+                if (caplen > len - 20) break;
+                pcapfile_packet(pf, pcapfile_u32(pf, body),
+                    (u_int64_t) pcapfile_u32(pf, body + 4) << 32 | pcapfile_u32(pf, body + 8),
+                    body + 20, caplen, pcapfile_u32(pf, body + 16));
+                break;
+            case PCAPNG_PB:
+                if (len < 20) break;
+                caplen = pcapfile_u32(pf, body + 12);
+                if (caplen > len - 20) break;
+                pcapfile_packet(pf, pcapfile_u16(pf, body),
+                    (u_int64_t) pcapfile_u32(pf, body + 4) << 32 | pcapfile_u32(pf, body + 8),
+                    body + 20, caplen, pcapfile_u32(pf, body + 16));
+                break;
+            case PCAPNG_SPB:
+                // Simple packets have no timestamp and belong to first interface
+                if (len < 4) break;
+                caplen = pcapfile_u32(pf, body);
+                if (caplen > len - 4) caplen = len - 4;
+                pcapfile_packet(pf, 0, 0, body + 4, caplen, pcapfile_u32(pf, body));
+                break;
+        }
+        pos += blen;
+        if (pf->read) *pf->read = pos - pf->data;
+    }
+    return PCAPFILE_OK;
+}
+
+int
+pcapfile_load(const char *file, pcap_handler handler, u_char *user, size_t *read,
+              char *errbuf)
+{
+    struct pcapfile pf;
+    struct stat st;
+    void *map;
+    u_int32_t magic;
+    int fd, ret;
+
+    if ((fd = open(file, O_RDONLY)) == -1) return PCAPFILE_UNSUPPORTED;
+
+    // Only regular files can be mapped
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size < PCAP_FILE_HDR_LEN
+        || (u_int64_t) st.st_size > SIZE_MAX) {
+        close(fd);
+        return PCAPFILE_UNSUPPORTED;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return PCAPFILE_UNSUPPORTED;
+
+    // File is read once from start to end
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+    madvise(map, st.st_size, MADV_WILLNEED);
+
+    memset(&pf, 0, sizeof(pf));
+    pf.data = map;
+    pf.size = st.st_size;
+    pf.handler = handler;
+    pf.user = user;
+    pf.read = read;
+    pf.linktype = -1;
+    pf.errbuf = errbuf;
+
+    mapped = pf.data;
+    mapped_size = pf.size;
+
+    memcpy(&magic, pf.data, sizeof(magic));
+    if (magic == PCAP_MAGIC || magic == PCAP_MAGIC_NSEC) {
+        ret = pcapfile_read_pcap(&pf, magic == PCAP_MAGIC_NSEC);
+    } else if (__builtin_bswap32(magic) == PCAP_MAGIC
+               || __builtin_bswap32(magic) == PCAP_MAGIC_NSEC) {
+        pf.swapped = 1;
+        ret = pcapfile_read_pcap(&pf, __builtin_bswap32(magic) == PCAP_MAGIC_NSEC);
+    } else if (magic == PCAPNG_SHB) {
+        ret = pcapfile_read_pcapng(&pf);
+    } else {
+        ret = PCAPFILE_UNSUPPORTED;
+    }
+
+    mapped = NULL;
+    free(pf.tsres);
+    munmap(map, st.st_size);
+    return ret;
+}
+
+u_int64_t
+pcapfile_offset(const u_char *data)
+{
+    if (!mapped || (uintptr_t) data < (uintptr_t) mapped
+        || (uintptr_t) data >= (uintptr_t) mapped + mapped_size)
+        return 0;
+    return data - mapped;
+}
+
+#endif
@@ -0,0 +1,85 @@
+/**************************************************************************
+ **
+ ** sngrep - SIP callflow viewer using ngrep
+ **
+ ** Copyright (C) 2013 Ivan Alonso (Kaian)
+ ** Copyright (C) 2013 Irontec SL. All rights reserved.
+ **
+ ** This program is free software: you can redistribute it and/or modify
+ ** it under the terms of the GNU General Public License as published by
+ ** the Free Software Foundation, either version 3 of the License, or
+ ** (at your option) any later version.
+ **
+ ** This program is distributed in the hope that it will be useful,
+ ** but WITHOUT ANY WARRANTY; without even the implied warranty of
+ ** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ ** GNU General Public License for more details.
+ **
+ ** You should have received a copy of the GNU General Public License
+ ** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ **
+ ****************************************************************************/
+/**
+ * @file pcapfile.h
+ * @author Ivan Alonso [aka Kaian] <kaian@irontec.com>
+ *
+ * @brief Functions to read capture files in place
+ *
+ * Classic pcap (microsecond and nanosecond, any byte order) and pcapng
+ * files are mapped into memory and their records are walked without
+ * copying them: the packet pointer passed to the handler points inside
+ * the mapping, so reading a file is mostly bound by disk bandwidth.
+ *
+ * Other formats (or files that can not be mapped, like pipes) must be
+ * read using libpcap.
+ */
+#ifndef __SNGREP_PCAPFILE_H
+#define __SNGREP_PCAPFILE_H
+
+#include "spcap.h"
+
+/**
+ * @brief Return codes of pcapfile_load
+ */
+enum pcapfile_result
+{
+    //! All packets have been read
+    PCAPFILE_OK = 0,
+    //! File format not supported, use libpcap instead
+    PCAPFILE_UNSUPPORTED,
+    //! File is corrupt or uses an unsupported datalink
+    PCAPFILE_ERROR
+};
+
+/**
+ * @brief Read all packets of a capture file
+ *
+ * The datalink of the file is set using capture_set_linktype before
+ * any packet is passed to the handler. Packets are only valid during
+ * the handler call.
+ *
+ * @param file Full path to capture file
+ * @param handler Function invoked for each packet
+ * @param user First argument of handler
+ * @param read Updated with the bytes read after each record (can be NULL)
+ * @param errbuf Filled with the error message on PCAPFILE_ERROR
+ *  (PCAP_ERRBUF_SIZE bytes)
+ * @return PCAPFILE_OK, PCAPFILE_UNSUPPORTED or PCAPFILE_ERROR
+ */
+extern int
+pcapfile_load(const char *file, pcap_handler handler, u_char *user, size_t *read,
+              char *errbuf);
+
+/**
+ * @brief Get the file offset of data being read
+ *
+ * Only valid from the packet handler of pcapfile_load.
+ *
+ * @param data Pointer to packet data (or part of it)
+ * @return offset in the capture file or 0 if data is not in the file
+ * (reassembled data, for example)
+ */
+extern u_int64_t
+pcapfile_offset(const u_char *data);
+
+#endif
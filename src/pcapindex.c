@@ -0,0 +1,556 @@
+/**************************************************************************
+ **
+ ** sngrep - SIP callflow viewer using ngrep
+ **
+ ** Copyright (C) 2013 Ivan Alonso (Kaian)
+ ** Copyright (C) 2013 Irontec SL. All rights reserved.
+ **
+ ** This program is free software: you can redistribute it and/or modify
+ ** it under the terms of the GNU General Public License as published by
+ ** the Free Software Foundation, either version 3 of the License, or
+ ** (at your option) any later version.
+ **
+ ** This program is distributed in the hope that it will be useful,
+ ** but WITHOUT ANY WARRANTY; without even the implied warranty of
+ ** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ ** GNU General Public License for more details.
+ **
+ ** You should have received a copy of the GNU General Public License
+ ** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ **
+ ****************************************************************************/
+#ifdef WITH_LIBPCAP
+/**
+ * @file pcapindex.c
+ * @author Ivan Alonso [aka Kaian] <kaian@irontec.com>
+ *
+ * @brief Source of functions defined in pcapindex.h
+ *
+ * Index file layout (native byte order, records aligned to 8 bytes):
+ *
+ *   header | call table (sorted by first timestamp) | call records
+ *
+ * Each call record contains the summary attributes of the call and the
+ * packet information of its messages (followed by their payload if it
+ * can not be read from the capture file).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "pcapindex.h"
+#include "option.h"
+
+//! Index file magic (including format version)
+#define PCAPINDEX_MAGIC "SNGIDX06"
+//! Index file name suffix
+#define PCAPINDEX_SUFFIX ".sngidx"
+//! Byte order mark
+#define PCAPINDEX_BOM 0x1A2B3C4D
+//! Records alignment
+#define PCAPINDEX_ALIGN(len) (((len) + 7) & ~((size_t) 7))
+
+/**
+ * @brief Index file header
+ */
+struct pcapindex_header
+{
+    //! Index magic
+    char magic[8];
+    //! Byte order mark
+    u_int32_t bom;
+    //! Size of packet information (changes between platforms)
+    u_int32_t pktsize;
+    //! Capture file size
+    u_int64_t size;
+    //! Capture file modification time (seconds and nanoseconds)
+    int64_t mtime, mtime_nsec;
+    //! Capture file inode
+    u_int64_t inode;
+    //! Hash of the options used while loading the capture file
+    u_int64_t options;
+    //! Packets of the capture file
+    u_int64_t packets;
+    //! Longest call duration (nanoseconds)
+    u_int64_t span;
+    //! Number of calls
+    u_int64_t calls;
+};
+
+/**
+ * @brief Call table entry
+ */
+struct pcapindex_entry
+{
+    //! First and last message timestamps
+    u_int64_t first, last;
+    //! Call record offset in the index
+    u_int64_t offset;
+};
+
+/**
+ * @brief Call record header
+ *
+ * Followed by summary attributes and messages.
+ */
+struct pcapindex_call
+{
+    //! Number of summary attributes
+    u_int32_t attrs;
+    //! Number of messages
+    u_int32_t msgs;
+};
+
+/**
+ * @brief Summary attribute header
+ *
+ * Followed by the null terminated value.
+ */
+struct pcapindex_attr
+{
+    //! Attribute id
+    u_int32_t id;
+    //! Value length (including null terminator)
+    u_int32_t len;
+};
+
+/**
+ * @brief Message record
+ *
+ * Followed by its payload if stored in the index.
+ */
+struct pcapindex_msg
+{
+    //! Packet information (including payload offset in capture file)
+    sip_packet_t pkt;
+    //! Payload length
+    u_int32_t len;
+    //! Payload is stored in the index
+    u_int32_t stored;
+    //! Response status code (0 for requests)
+    u_int32_t status;
+    //! CSeq method id
+    u_int32_t method;
+    //! Payload fingerprint
+    u_int64_t fingerprint;
+};
+
+//! Capture file of loaded messages
+static int capture_fd = -1;
+
+//! Options that change the calls and messages loaded from a capture file
+static const char *pcapindex_option_names[] = {
+    "sip.ignoreincomplete",
+    "capture.ipfrag.max", "capture.ipfrag.memory", "capture.ipfrag.timeout",
+    "capture.tcp.max", "capture.tcp.memory", "capture.tcp.timeout",
+    NULL
+};
+
+/**
+ * @brief Get index file name of a capture file
+ */
+static int
+pcapindex_path(const char *file, char *path, size_t len)
+{
+    return snprintf(path, len, "%s%s", file, PCAPINDEX_SUFFIX) >= (int) len;
+}
+
+/**
+ * @brief Convert a time option (YYYY-MM-DDTHH:MM:SS) to nanoseconds
+ *
+ * @return option time or 0 if it's not set
+ */
+static u_int64_t
+pcapindex_time_option(const char *option)
+{
+    const char *value = get_option_value(option);
+    struct tm when;
+    char *end;
+
+    if (!value || !strlen(value)) return 0;
+    memset(&when, 0, sizeof(when));
+    if (!(end = strptime(value, "%Y-%m-%dT%H:%M:%S", &when)) || *end) return 0;
+    when.tm_isdst = -1;
+    return (u_int64_t) mktime(&when) * 1000000000;
+}
+
+/**
+ * @brief Hash the values of the options that change loaded calls
+ *
+ * Indexes created with other values of these options are not valid.
+ * Display filters are applied when calls are shown, so they don't
+ * change the index.
+ */
+static u_int64_t
+pcapindex_options()
+{
+    const char *value, *c;
+    u_int64_t hash = 14695981039346656037ULL;
+    int i;
+
+    // FNV-1a hash of all option values
+    for (i = 0; pcapindex_option_names[i]; i++) {
+        value = get_option_value(pcapindex_option_names[i]);
+        for (c = value ? value : ""; *c; c++)
+            hash = (hash ^ (u_char) *c) * 1099511628211ULL;
+        hash = (hash ^ '\n') * 1099511628211ULL;
+    }
+    return hash;
+}
+
+/**
+ * @brief Check the index was created for the capture file and options
+ */
+static int
+pcapindex_valid(const struct pcapindex_header *hdr, const struct stat *st, size_t isize)
+{
+    return !memcmp(hdr->magic, PCAPINDEX_MAGIC, sizeof(hdr->magic))
+        && hdr->bom == PCAPINDEX_BOM && hdr->pktsize == sizeof(sip_packet_t)
+        && hdr->size == (u_int64_t) st->st_size
+        && hdr->mtime == (int64_t) st->st_mtim.tv_sec
+        && hdr->mtime_nsec == (int64_t) st->st_mtim.tv_nsec
+        && hdr->inode == (u_int64_t) st->st_ino
+        && hdr->options == pcapindex_options()
+        && hdr->calls <= (isize - sizeof(*hdr)) / sizeof(struct pcapindex_entry);
+}
+
+/**
+ * @brief Compare call table entries by first timestamp
+ */
+static int
+pcapindex_entry_cmp(const void *a, const void *b)
+{
+    const struct pcapindex_entry *ea = a, *eb = b;
+
+    if (ea->first != eb->first) return ea->first < eb->first ? -1 : 1;
+    return ea->offset < eb->offset ? -1 : 1;
+}
+
+/**
+ * @brief Write data followed by padding up to records alignment
+ */
+static void
+pcapindex_write(FILE *f, const void *data, size_t len)
+{
+    static const char pad[8];
+
+    fwrite(data, 1, len, f);
+    fwrite(pad, 1, PCAPINDEX_ALIGN(len) - len, f);
+}
+
+/**
+ * @brief Get a message payload to be stored in the index
+ *
+ * Parsed messages have their payload split in lines, so their raw
+ * copy is stored instead.
+ *
+ * @return original payload bytes (msg->len) or NULL
+ */
+static const char *
+pcapindex_msg_payload(sip_msg_t *msg)
+{
+    return (msg->parsed) ? msg->raw : msg->payload;
+}
+
+/**
+ * @brief Get a message attribute stored in the index
+ *
+ * Time and addresses are not stored, they're formatted from packet info.
+ *
+ * @return attribute value or NULL if it's not stored
+ */
+static const char *
+pcapindex_attr_stored(sip_msg_t *msg, int id)
+{
+    if (id == SIP_ATTR_TIME || id == SIP_ATTR_SRC || id == SIP_ATTR_DST) return NULL;
+    return sip_attr_get(&msg->attrs, id);
+}
+
+/**
+ * @brief Write a call record
+ *
+ * @param f Index file
+ * @param call Call to be stored
+ * @param entry Call table entry to be filled
+ */
+static void
+pcapindex_write_call(FILE *f, sip_call_t *call, struct pcapindex_entry *entry)
+{
+    struct pcapindex_call crec;
+    struct pcapindex_attr arec;
+    struct pcapindex_msg mrec;
+    const char *value;
+    sip_msg_t *msg;
+    int id;
+    const char *payload;
+
+    pthread_mutex_lock(&call->lock);
+    entry->offset = ftell(f);
+    entry->first = call->summary.first;
+    entry->last = call->summary.last;
+
+    memset(&crec, 0, sizeof(crec));
+    for (id = 0; id < SIP_ATTR_COUNT; id++) {
+        if (pcapindex_attr_stored(call->msgs, id)) crec.attrs++;
+    }
+    crec.msgs = call->summary.msgcnt;
+    fwrite(&crec, sizeof(crec), 1, f);
+
+    // Attributes displayed in call list
+    for (id = 0; id < SIP_ATTR_COUNT; id++) {
+        if (!(value = pcapindex_attr_stored(call->msgs, id))) continue;
+        arec.id = id;
+        arec.len = strlen(value) + 1;
+        fwrite(&arec, sizeof(arec), 1, f);
+        pcapindex_write(f, value, arec.len);
+    }
+
+    // Messages (and their payload if it's not in the capture file)
+    for (msg = call->msgs; msg; msg = msg->next) {
+        memset(&mrec, 0, sizeof(mrec));
+        mrec.pkt = msg->pkt;
+        mrec.len = msg->len;
+        mrec.status = msg->status;
+        mrec.method = msg->method;
+        mrec.fingerprint = msg->fingerprint;
+        payload = NULL;
+        if (!msg->pkt.offset && (payload = pcapindex_msg_payload(msg))) {
+            mrec.stored = 1;
+        }
+        fwrite(&mrec, sizeof(mrec), 1, f);
+        if (payload) {
+            pcapindex_write(f, payload, msg->len);
+        }
+    }
+    pthread_mutex_unlock(&call->lock);
+}
+
+/**
+ * @brief Read a call record and add it to current thread store
+ *
+ * If the record is not valid, the call may have been partially added
+ * to the store, so the whole store must be discarded.
+ *
+ * @param data Index file data
+ * @param size Index file size
+ * @param offset Call record offset
+ * @param capsize Capture file size
+ * @return 0 on success, 1 if the record is not valid
+ */
+static int
+pcapindex_read_call(const u_char *data, size_t size, u_int64_t offset, u_int64_t capsize)
+{
+    const struct pcapindex_call *crec;
+    const struct pcapindex_attr *arec;
+    const struct pcapindex_msg *mrec;
+    const char *callid = NULL, *value;
+    size_t pos = offset, attrpos;
+    sip_call_t *call;
+    sip_msg_t *msg;
+    u_int32_t i, j;
+
+    if (pos > size || size - pos < sizeof(*crec)) return 1;
+    crec = (const struct pcapindex_call *) (data + pos);
+    pos += sizeof(*crec);
+
+    // Check attributes and look for the Call-ID
+    for (attrpos = pos, i = 0; i < crec->attrs; i++) {
+        if (size - pos < sizeof(*arec)) return 1;
+        arec = (const struct pcapindex_attr *) (data + pos);
+        value = (const char *) (data + pos + sizeof(*arec));
+        if (!arec->len || arec->id >= SIP_ATTR_COUNT
+            || size - pos - sizeof(*arec) < PCAPINDEX_ALIGN(arec->len)
+            || value[arec->len - 1] != '\0')
+            return 1;
+        if (arec->id == SIP_ATTR_CALLID) callid = value;
+        pos += sizeof(*arec) + PCAPINDEX_ALIGN(arec->len);
+    }
+    if (!callid || !crec->msgs) return 1;
+
+    if (!(call = sip_call_create((char *) callid))) return 1;
+    for (i = 0; i < crec->msgs; i++) {
+        if (size - pos < sizeof(*mrec)) return 1;
+        mrec = (const struct pcapindex_msg *) (data + pos);
+        pos += sizeof(*mrec);
+
+        // Payload must be in the index or in the capture file
+        if (mrec->len > INT_MAX) return 1;
+        if (mrec->stored) {
+            if (size - pos < PCAPINDEX_ALIGN(mrec->len)) return 1;
+        } else if (!mrec->pkt.offset || mrec->pkt.offset > capsize
+                   || capsize - mrec->pkt.offset < mrec->len) {
+            return 1;
+        }
+
+        // Payload is read from capture file when needed
+        if (!(msg = sip_msg_create(call, &mrec->pkt,
+            mrec->stored ? (const char *) (data + pos) : NULL, mrec->len)))
+            return 1;
+        if (mrec->stored) pos += PCAPINDEX_ALIGN(mrec->len);
+        msg->status = mrec->status;
+        msg->method = (mrec->method <= SIP_METHOD_CANCEL) ? mrec->method : SIP_METHOD_OTHER;
+        msg->fingerprint = mrec->fingerprint;
+
+        // First message has the call summary attributes
+        if (i == 0) {
+            arec = (const struct pcapindex_attr *) (data + attrpos);
+            for (j = 0; j < crec->attrs; j++) {
+                msg_set_attribute(msg, arec->id, (const char *) (arec + 1));
+                arec = (const struct pcapindex_attr *) ((const u_char *) (arec + 1)
+                    + PCAPINDEX_ALIGN(arec->len));
+            }
+        }
+        call_add_message(call, msg);
+    }
+    return 0;
+}
+
+int
+pcapindex_load(const char *file, unsigned long *packets)
+{
+    char path[PATH_MAX];
+    struct stat st, ist;
+    const struct pcapindex_header *hdr;
+    const struct pcapindex_entry *entries;
+    const u_char *data;
+    void *map;
+    sip_store_t store;
+    u_int64_t from, to, start, i, lo, hi;
+    int fd, ret = 0;
+
+    if (!is_option_enabled("capture.index")) return 1;
+    if (pcapindex_path(file, path, sizeof(path)) != 0) return 1;
+    if (stat(file, &st) != 0 || (fd = open(path, O_RDONLY)) == -1) return 1;
+    if (fstat(fd, &ist) != 0 || (size_t) ist.st_size < sizeof(*hdr)) {
+        close(fd);
+        return 1;
+    }
+    map = mmap(NULL, ist.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return 1;
+    data = map;
+    hdr = map;
+
+    // Check the index belongs to this capture file
+    if (!pcapindex_valid(hdr, &st, ist.st_size)) {
+        munmap(map, ist.st_size);
+        return 1;
+    }
+    entries = (const struct pcapindex_entry *) (data + sizeof(*hdr));
+
+    // Only calls active in the requested time range are loaded
+    from = pcapindex_time_option("capture.index.from");
+    if (!(to = pcapindex_time_option("capture.index.to"))) to = UINT64_MAX;
+
+    // Find the first call that can be active at range start
+    start = (from > hdr->span) ? from - hdr->span : 0;
+    for (lo = 0, hi = hdr->calls; lo < hi;) {
+        i = lo + (hi - lo) / 2;
+        if (entries[i].first < start) lo = i + 1;
+        else hi = i;
+    }
+
+    memset(&store, 0, sizeof(store));
+    sip_store_set(&store);
+    for (i = lo; i < hdr->calls && entries[i].first <= to; i++) {
+        if (entries[i].last < from) continue;
+        if ((ret = pcapindex_read_call(data, ist.st_size, entries[i].offset, hdr->size)) != 0)
+            break;
+    }
+    sip_store_set(NULL);
+
+    // Corrupt or truncated index, capture file must be parsed
+    if (ret != 0) {
+        sip_store_clear(&store);
+        munmap(map, ist.st_size);
+        return 1;
+    }
+    sip_store_merge(&store, 1);
+
+    *packets = hdr->packets;
+    munmap(map, ist.st_size);
+    return 0;
+}
+
+int
+pcapindex_save(const char *file, unsigned long packets)
+{
+    char path[PATH_MAX], tmppath[PATH_MAX + 8];
+    struct stat st;
+    struct pcapindex_header hdr;
+    struct pcapindex_entry *entries;
+    sip_call_t *call;
+    u_int64_t count = 0, i;
+    FILE *f;
+    int ret;
+
+    if (!is_option_enabled("capture.index")) return 1;
+    if (pcapindex_path(file, path, sizeof(path)) != 0 || stat(file, &st) != 0) return 1;
+    sprintf(tmppath, "%s.tmp", path);
+
+    for (call = sip_calls_next(NULL); call; call = sip_calls_next(call))
+        count++;
+    if (!(entries = calloc(count + 1, sizeof(struct pcapindex_entry)))) return 1;
+    if (!(f = fopen(tmppath, "w"))) {
+        free(entries);
+        return 1;
+    }
+
+    // Call records are written after the header and call table
+    fseek(f, sizeof(hdr) + sizeof(struct pcapindex_entry) * count, SEEK_SET);
+    memset(&hdr, 0, sizeof(hdr));
+    for (i = 0, call = sip_calls_next(NULL); call && i < count; call = sip_calls_next(call)) {
+        pcapindex_write_call(f, call, &entries[i]);
+        if (entries[i].last - entries[i].first > hdr.span)
+            hdr.span = entries[i].last - entries[i].first;
+        i++;
+    }
+    qsort(entries, i, sizeof(struct pcapindex_entry), pcapindex_entry_cmp);
+
+    memcpy(hdr.magic, PCAPINDEX_MAGIC, sizeof(hdr.magic));
+    hdr.bom = PCAPINDEX_BOM;
+    hdr.pktsize = sizeof(sip_packet_t);
+    hdr.size = st.st_size;
+    hdr.mtime = st.st_mtim.tv_sec;
+    hdr.mtime_nsec = st.st_mtim.tv_nsec;
+    hdr.inode = st.st_ino;
+    hdr.options = pcapindex_options();
+    hdr.packets = packets;
+    hdr.calls = i;
+    fseek(f, 0, SEEK_SET);
+    fwrite(&hdr, sizeof(hdr), 1, f);
+    fwrite(entries, sizeof(struct pcapindex_entry), i, f);
+    free(entries);
+
+    // Replace the index only if it has been completely written
+    ret = ferror(f);
+    if (fclose(f) != 0 || ret || rename(tmppath, path) != 0) {
+        unlink(tmppath);
+        return 1;
+    }
+    return 0;
+}
+
+int
+pcapindex_open(const char *file)
+{
+    if (capture_fd != -1) close(capture_fd);
+    return (capture_fd = open(file, O_RDONLY)) == -1;
+}
+
+int
+pcapindex_payload(const sip_packet_t *pkt, char *payload, int len)
+{
+    if (capture_fd == -1 || !pkt->offset || len < 0) return 1;
+    if (pread(capture_fd, payload, len, pkt->offset) != len) return 1;
+    payload[len] = '\0';
+    return 0;
+}
+
+#endif
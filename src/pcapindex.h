@@ -0,0 +1,103 @@
+/**************************************************************************
+ **
+ ** sngrep - SIP callflow viewer using ngrep
+ **
+ ** Copyright (C) 2013 Ivan Alonso (Kaian)
+ ** Copyright (C) 2013 Irontec SL. All rights reserved.
+ **
+ ** This program is free software: you can redistribute it and/or modify
+ ** it under the terms of the GNU General Public License as published by
+ ** the Free Software Foundation, either version 3 of the License, or
+ ** (at your option) any later version.
+ **
+ ** This program is distributed in the hope that it will be useful,
+ ** but WITHOUT ANY WARRANTY; without even the implied warranty of
+ ** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ ** GNU General Public License for more details.
+ **
+ ** You should have received a copy of the GNU General Public License
+ ** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ **
+ ****************************************************************************/
+/**
+ * @file pcapindex.h
+ * @author Ivan Alonso [aka Kaian] <kaian@irontec.com>
+ *
+ * @brief Functions to store loaded calls in an index file
+ *
+ * Once a capture file has been completely loaded, its calls are stored
+ * in an index file next to it (same name plus .sngidx). When the same
+ * capture file is opened again, calls are loaded from the index instead
+ * of parsing all its packets.
+ *
+ * The index contains, for each call, its first and last timestamps, the
+ * attributes displayed in the call list and the packet information of
+ * each message. Messages whose payload is stored contiguously in the
+ * capture file only keep its file offset and are read when they're
+ * parsed, usually when the call is displayed (this is also done while
+ * the capture file is loaded). Other payloads (TCP streams or
+ * fragmented datagrams) are stored in the index.
+ *
+ * Calls are sorted by time in the index, so only calls in a time range
+ * can be loaded using capture.index.from and capture.index.to options.
+ *
+ * Index is discarded if the capture file size, modification time or
+ * inode changes, or if it was created with different values of the
+ * options that change loaded calls (like sip.ignoreincomplete). Corrupt
+ * or truncated indexes are also discarded and the capture file is
+ * parsed again.
+ */
+#ifndef __SNGREP_PCAPINDEX_H
+#define __SNGREP_PCAPINDEX_H
+
+#include "spcap.h"
+
+/**
+ * @brief Load calls from the index of a capture file
+ *
+ * Calls are stored in the global calls list.
+ *
+ * @param file Full path to capture file
+ * @param packets Filled with the number of packets of the capture file
+ * @return 0 if calls have been loaded, 1 if there is no valid index
+ */
+extern int
+pcapindex_load(const char *file, unsigned long *packets);
+
+/**
+ * @brief Write the index of a capture file
+ *
+ * All calls of the global list are stored in the index. It's written in
+ * a temporal file that replaces the index once completed.
+ *
+ * @param file Full path to capture file
+ * @param packets Number of packets of the capture file
+ * @return 0 if the index has been written, 1 otherwise
+ */
+extern int
+pcapindex_save(const char *file, unsigned long packets);
+
+/**
+ * @brief Open the capture file to read message payloads
+ *
+ * Must be called before loading any message from the capture file,
+ * either from its index or from its packets.
+ *
+ * @param file Full path to capture file
+ * @return 0 on success, 1 if the file can not be opened
+ */
+extern int
+pcapindex_open(const char *file);
+
+/**
+ * @brief Read a message payload from the capture file
+ *
+ * @param pkt Packet information with the payload offset
+ * @param payload Buffer for the payload (at least len + 1 bytes)
+ * @param len Payload length
+ * @return 0 if the null terminated payload was read, 1 otherwise
+ */
+extern int
+pcapindex_payload(const sip_packet_t *pkt, char *payload, int len);
+
+#endif
@@ -0,0 +1,880 @@
+/**************************************************************************
+ **
+ ** sngrep - SIP callflow viewer using ngrep
+ **
+ ** Copyright (C) 2013 Ivan Alonso (Kaian)
+ ** Copyright (C) 2013 Irontec SL. All rights reserved.
+ **
+ ** This program is free software: you can redistribute it and/or modify
+ ** it under the terms of the GNU General Public License as published by
+ ** the Free Software Foundation, either version 3 of the License, or
+ ** (at your option) any later version.
+ **
+ ** This program is distributed in the hope that it will be useful,
+ ** but WITHOUT ANY WARRANTY; without even the implied warranty of
+ ** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ ** GNU General Public License for more details.
+ **
+ ** You should have received a copy of the GNU General Public License
+ ** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ **
+ ****************************************************************************/
+#ifdef WITH_LIBPCAP
+/**
+ * @file pipeline.c
+ * @author Ivan Alonso [aka Kaian] <kaian@irontec.com>
+ *
+ * @brief Source of functions defined in pipeline.h
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/time.h>
+#include "pipeline.h"
+#include "option.h"
+#include "pcapfile.h"
+
+//! Records are aligned to this size
+#define RING_ALIGN 8
+//! Record marker to jump to the start of the buffer
+#define RING_WRAP  0xffffffff
+//! Maximum number of parser workers
+#define MAX_WORKERS 64
+//! Maximum number of capture inputs
+#define MAX_INPUTS 16
+//! Records read from a file before passing to the next loader thread
+#define LOAD_BATCH 4096
+//! Minimum queue size of each loader thread (fits several big payloads)
+#define LOAD_RING_MIN 262144
+//! Microseconds an idle thread sleeps before checking its rings again
+#define RING_IDLE_WAIT 1000000
+
+/**
+ * @brief Thread sleeping until its rings have records (or free space)
+ *
+ * Before sleeping, the thread sets the sleeping flag and checks again
+ * its rings. The other side of the ring checks the flag after
+ * publishing its changes and only signals the thread if it's sleeping,
+ * so running threads don't pay for the wakeups and none is lost.
+ */
+struct ring_waiter
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    //! Thread is (or is going to be) sleeping
+    int sleeping;
+};
+
+/**
+ * @brief Record stored in the rings
+ *
+ * Each record is followed by a fixed size header (libpcap header in the
+ * capture ring, packet information in worker rings) and its data.
+ */
+struct ring_record
+{
+    //! Stored bytes (header and data) or RING_WRAP
+    u_int32_t len;
+    //! Padding to keep the header aligned
+    u_int32_t pad;
+};
+
+//! Record size including its data, aligned
+#define RECORD_SIZE(len) \
+    ((sizeof(struct ring_record) + (len) + RING_ALIGN - 1) & ~((size_t) RING_ALIGN - 1))
+//! Pointer to the header stored after a record
+#define RECORD_HEADER(record) ((u_char *) (record) + sizeof(struct ring_record))
+
+//! Waiters of each thread
+static struct ring_waiter dispatcher_waiter, writer_waiter, sync_waiter, reader_waiter;
+static struct ring_waiter worker_waiters[MAX_WORKERS], load_waiters[MAX_WORKERS];
+static pthread_once_t waiters_once = PTHREAD_ONCE_INIT;
+//! Rings from each capture thread to dispatcher
+static packet_ring_t capture_rings[MAX_INPUTS];
+//! Number of capture inputs
+static int input_count = 0;
+//! Capture rings producer positions when the dispatcher last checked them
+static size_t capture_heads[MAX_INPUTS];
+//! Microseconds to wait for idle inputs before dispatching a packet
+static long merge_delay;
+//! Rings from dispatcher to each worker
+static packet_ring_t worker_rings[MAX_WORKERS];
+//! Number of parser workers
+static int worker_count = 0;
+//! Ring from dispatcher to temporal file writer
+static packet_ring_t dump_ring;
+//! Temporal file writer is running
+static int dump_enabled = 0;
+//! Temporal file sync requests and last completed request
+static unsigned int dump_sync_req = 0, dump_sync_done = 0;
+//! Rings from file reader to each loader thread
+static packet_ring_t load_rings[MAX_WORKERS];
+//! Partial calls lists of each loader thread
+static sip_store_t load_stores[MAX_WORKERS];
+//! Loader threads
+static pthread_t load_threads[MAX_WORKERS];
+//! Number of loader threads
+static int load_count = 0;
+//! Loader thread receiving current batch and records read
+static int load_current = 0;
+static unsigned long load_records = 0;
+//! All file records have been read
+static int load_done = 0;
+
+/**
+ * @brief Allocate ring buffer
+ *
+ * @param ring Ring structure
+ * @param size Requested size, rounded up to the next power of two
+ * @return 0 on success, 1 otherwise
+ */
+static int
+ring_init(packet_ring_t *ring, size_t size)
+{
+    size_t rsize = 4096;
+
+    while (rsize < size)
+        rsize <<= 1;
+
+    memset(ring, 0, sizeof(packet_ring_t));
+    if (!(ring->buffer = malloc(rsize))) return 1;
+    ring->size = rsize;
+    return 0;
+}
+
+/**
+ * @brief Initialize a thread waiter
+ */
+static void
+ring_waiter_init(struct ring_waiter *waiter)
+{
+    pthread_condattr_t attr;
+
+    pthread_mutex_init(&waiter->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&waiter->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    waiter->sleeping = 0;
+}
+
+/**
+ * @brief Initialize the waiters of all threads
+ */
+static void
+ring_waiters_init()
+{
+    int i;
+
+    ring_waiter_init(&dispatcher_waiter);
+    ring_waiter_init(&writer_waiter);
+    ring_waiter_init(&sync_waiter);
+    ring_waiter_init(&reader_waiter);
+    for (i = 0; i < MAX_WORKERS; i++) {
+        ring_waiter_init(&worker_waiters[i]);
+        ring_waiter_init(&load_waiters[i]);
+    }
+}
+
+/**
+ * @brief Sleep until there is something to do
+ *
+ * The thread sleeps until it's woken up by the other side of one of
+ * its rings or usec microseconds have passed. It doesn't sleep at all
+ * if ready function returns true after the sleeping flag is set.
+ *
+ * @param waiter Waiter of the calling thread
+ * @param ready Function checking if there is something to do (or NULL)
+ * @param arg Argument for ready function
+ * @param usec Maximum microseconds to sleep
+ */
+static void
+ring_wait(struct ring_waiter *waiter, int (*ready)(void *arg), void *arg, long usec)
+{
+    struct timespec ts;
+
+    pthread_mutex_lock(&waiter->lock);
+    __atomic_store_n(&waiter->sleeping, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if (!ready || !ready(arg)) {
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        ts.tv_sec += usec / 1000000;
+        ts.tv_nsec += (usec % 1000000) * 1000;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&waiter->cond, &waiter->lock, &ts);
+    }
+
+    __atomic_store_n(&waiter->sleeping, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&waiter->lock);
+}
+
+/**
+ * @brief Wake up a thread if it's sleeping
+ *
+ * Must be invoked after publishing the changes the thread is waiting for.
+ */
+static void
+ring_wake(struct ring_waiter *waiter)
+{
+    if (!waiter) return;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (!__atomic_load_n(&waiter->sleeping, __ATOMIC_RELAXED)) return;
+
+    pthread_mutex_lock(&waiter->lock);
+    pthread_cond_signal(&waiter->cond);
+    pthread_mutex_unlock(&waiter->lock);
+}
+
+/**
+ * @brief Store a header and its data in the ring (producer side)
+ *
+ * @param ring Ring structure
+ * @param header Record header
+ * @param hlen Record header size
+ * @param data Record data
+ * @param len Record data size
+ * @return 0 if packet has been stored, 1 if the ring is full
+ */
+static int
+ring_put(packet_ring_t *ring, const void *header, size_t hlen, const u_char *data, size_t len)
+{
+    struct ring_record *record;
+    size_t head, tail, pos, avail, need, skip = 0;
+
+    head = ring->head;
+    tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    pos = head & (ring->size - 1);
+    need = RECORD_SIZE(hlen + len);
+
+    // Record does not fit at the end of the buffer, jump to the start
+    if (ring->size - pos < need) skip = ring->size - pos;
+
+    // Check there is enough free space
+    avail = ring->size - (head - tail);
+    if (need + skip > avail) return 1;
+
+    if (skip) {
+        // Mark the rest of the buffer as unused (if a record header fits)
+        if (skip >= sizeof(struct ring_record)) {
+            record = (struct ring_record *) (ring->buffer + pos);
+            record->len = RING_WRAP;
+        }
+        pos = 0;
+    }
+
+    record = (struct ring_record *) (ring->buffer + pos);
+    record->len = hlen + len;
+    memcpy(RECORD_HEADER(record), header, hlen);
+    memcpy(RECORD_HEADER(record) + hlen, data, len);
+
+    // Publish the record
+    __atomic_store_n(&ring->head, head + skip + need, __ATOMIC_RELEASE);
+    ring_wake(ring->consumer);
+    return 0;
+}
+
+/**
+ * @brief Store a record in the ring or discard it if the ring is full
+ *
+ * @return 0 if packet has been stored, 1 if it has been discarded
+ */
+static int
+ring_push(packet_ring_t *ring, const void *header, size_t hlen, const u_char *data, size_t len)
+{
+    if (ring_put(ring, header, hlen, data, len) != 0) {
+        ring->drops++;
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Check if the consumer has released records since last check
+ *
+ * @param arg Ring whose consumer position was stored in its snapshot
+ */
+static int
+ring_released(void *arg)
+{
+    packet_ring_t *ring = (packet_ring_t *) arg;
+    return __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) != ring->snapshot;
+}
+
+/**
+ * @brief Store a record in the ring waiting for free space if required
+ *
+ * Records that would never fit in the ring are discarded. The producer
+ * sleeps on the ring producer waiter until the consumer releases records.
+ */
+static void
+ring_push_wait(packet_ring_t *ring, const void *header, size_t hlen, const u_char *data,
+               size_t len)
+{
+    if (RECORD_SIZE(hlen + len) * 2 > ring->size) {
+        ring->drops++;
+        return;
+    }
+    for (;;) {
+        ring->snapshot = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        if (ring_put(ring, header, hlen, data, len) == 0) break;
+        ring_wait(ring->producer, ring_released, ring, RING_IDLE_WAIT);
+    }
+}
+
+/**
+ * @brief Get the oldest record of the ring (consumer side)
+ *
+ * The record stays in the ring until ring_release is called
+ *
+ * @return oldest record or NULL if ring is empty
+ */
+static struct ring_record *
+ring_peek(packet_ring_t *ring)
+{
+    struct ring_record *record;
+    size_t head, pos;
+
+    for (;;) {
+        head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        if (ring->tail == head) return NULL;
+
+        pos = ring->tail & (ring->size - 1);
+        record = (struct ring_record *) (ring->buffer + pos);
+
+        // Skip the unused end of the buffer
+        if (ring->size - pos < sizeof(struct ring_record) || record->len == RING_WRAP) {
+            __atomic_store_n(&ring->tail, ring->tail + (ring->size - pos), __ATOMIC_RELEASE);
+            continue;
+        }
+        return record;
+    }
+}
+
+/**
+ * @brief Release the record returned by ring_peek
+ */
+static void
+ring_release(packet_ring_t *ring, struct ring_record *record)
+{
+    __atomic_store_n(&ring->tail, ring->tail + RECORD_SIZE(record->len), __ATOMIC_RELEASE);
+    ring_wake(ring->producer);
+}
+
+/**
+ * @brief Check if the ring has records (consumer side)
+ */
+static int
+ring_ready(void *arg)
+{
+    return ring_peek((packet_ring_t *) arg) != NULL;
+}
+
+/**
+ * @brief Check if more than half of the ring is being used
+ */
+static int
+ring_half_full(packet_ring_t *ring)
+{
+    return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - ring->tail > ring->size / 2;
+}
+
+/**
+ * @brief Check if the consumer has released all records (producer side)
+ */
+static int
+ring_empty(void *arg)
+{
+    packet_ring_t *ring = (packet_ring_t *) arg;
+    return __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == ring->head;
+}
+
+/**
+ * @brief Free ring buffer
+ */
+static void
+ring_free(packet_ring_t *ring)
+{
+    free(ring->buffer);
+    memset(ring, 0, sizeof(packet_ring_t));
+}
+
+/**
+ * @brief Get the oldest captured packet of all inputs
+ *
+ * Packets of each input are already ordered, so the oldest packet is
+ * always at the head of one of the capture rings. It can only be
+ * dispatched when all inputs have packets (no older packet can arrive)
+ * or it has been waiting for idle inputs more than capture.merge.delay.
+ * A ring filling up also forces its packets to be dispatched.
+ *
+ * @param ring Filled with the capture ring containing the packet
+ * @param delay Filled with microseconds until the oldest packet can be
+ * dispatched (or -1 if there are no packets)
+ * @return oldest record or NULL if there is none ready
+ */
+static struct ring_record *
+pipeline_next_record(packet_ring_t **ring, long *delay)
+{
+    struct ring_record *record, *oldest = NULL;
+    struct pcap_pkthdr *header, *oheader = NULL;
+    struct timeval now;
+    int i, pending = 0;
+    long waiting;
+
+    *delay = -1;
+
+    // Nothing to merge with only one input
+    if (input_count == 1) {
+        *ring = &capture_rings[0];
+        return ring_peek(*ring);
+    }
+
+    for (i = 0; i < input_count; i++) {
+        if (!(record = ring_peek(&capture_rings[i]))) continue;
+        pending++;
+        header = (struct pcap_pkthdr *) RECORD_HEADER(record);
+        if (!oldest || timercmp(&header->ts, &oheader->ts, <)) {
+            oldest = record;
+            oheader = header;
+            *ring = &capture_rings[i];
+        }
+    }
+
+    if (!oldest || pending == input_count || ring_half_full(*ring)) return oldest;
+
+    // Wait for idle inputs until this packet is old enough
+    gettimeofday(&now, NULL);
+    waiting = (now.tv_sec - oheader->ts.tv_sec) * 1000000 + (now.tv_usec - oheader->ts.tv_usec);
+    if (waiting >= merge_delay) return oldest;
+    *delay = merge_delay - waiting;
+    return NULL;
+}
+
+/**
+ * @brief Check if capture rings got new packets since last check
+ *
+ * Positions are stored by the dispatcher before looking for the next
+ * packet, so packets pushed after that are never missed.
+ */
+static int
+pipeline_dispatcher_ready(void *arg)
+{
+    int i;
+
+    for (i = 0; i < input_count; i++) {
+        if (__atomic_load_n(&capture_rings[i].head, __ATOMIC_ACQUIRE) != capture_heads[i])
+            return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Dispatcher thread
+ *
+ * Read packets from capture rings in timestamp order, queue them for
+ * the temporal file and forward them to the worker that parses its
+ * dialog.
+ */
+static void *
+pipeline_dispatcher(void *arg)
+{
+    packet_ring_t *ring;
+    struct ring_record *record;
+    struct pcap_pkthdr *header;
+    const u_char *packet, *payload;
+    sip_packet_t pkt;
+    int size;
+    unsigned int hash;
+    long delay;
+    int i;
+
+    for (;;) {
+        for (i = 0; i < input_count; i++)
+            capture_heads[i] = __atomic_load_n(&capture_rings[i].head, __ATOMIC_ACQUIRE);
+
+        if (!(record = pipeline_next_record(&ring, &delay))) {
+            // Sleep until a new packet arrives or the oldest one can be dispatched
+            ring_wait(&dispatcher_waiter, pipeline_dispatcher_ready, NULL,
+                (delay < 0) ? RING_IDLE_WAIT : delay);
+            continue;
+        }
+        header = (struct pcap_pkthdr *) RECORD_HEADER(record);
+        packet = RECORD_HEADER(record) + sizeof(struct pcap_pkthdr);
+
+        // Packets are stored in the temporal file by the writer thread
+        // All of them are stored, so fragments are kept too
+        if (dump_enabled) {
+            ring_push(&dump_ring, header, sizeof(struct pcap_pkthdr), packet, header->caplen);
+        }
+
+        // Parse all SIP payloads of this packet
+        payload = capture_packet_payload(header, packet, &pkt, &size);
+        for (; payload; payload = capture_next_payload(&pkt, &size)) {
+            // Workers only receive the packet information and payload
+            hash = sip_get_callid_hash((const char *) payload, size);
+            ring_push(&worker_rings[hash % worker_count], &pkt,
+                sizeof(sip_packet_t), payload, size);
+        }
+        ring_release(ring, record);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Parser worker thread
+ *
+ * Read decoded payloads from its ring and add them to SIP storage
+ */
+static void *
+pipeline_worker(void *arg)
+{
+    packet_ring_t *ring = (packet_ring_t *) arg;
+    struct ring_record *record;
+
+    for (;;) {
+        if (!(record = ring_peek(ring))) {
+            ring_wait(ring->consumer, ring_ready, ring, RING_IDLE_WAIT);
+            continue;
+        }
+        capture_load_payload((u_char *) "Online", (sip_packet_t *) RECORD_HEADER(record),
+            RECORD_HEADER(record) + sizeof(sip_packet_t),
+            record->len - sizeof(sip_packet_t));
+        ring_release(ring, record);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Check if the writer has queued packets or pending sync requests
+ */
+static int
+pipeline_writer_ready(void *arg)
+{
+    return ring_peek(&dump_ring) != NULL
+        || __atomic_load_n(&dump_sync_req, __ATOMIC_ACQUIRE) != dump_sync_done;
+}
+
+/**
+ * @brief Temporal file writer thread
+ *
+ * Read packets from dump ring and store them in the temporal file.
+ * Packets are written to the file buffer, that is only written to disk
+ * when it's full (capture.dump.batch bytes), when packets have been
+ * waiting more than capture.dump.interval milliseconds or when someone
+ * needs to read the file.
+ */
+static void *
+pipeline_writer(void *arg)
+{
+    struct ring_record *record;
+    struct pcap_pkthdr *header;
+    struct timeval now, last;
+    unsigned int sync, pending;
+    size_t sync_head = 0;
+    int interval, unflushed = 0;
+    long elapsed;
+
+    interval = get_option_int_value("capture.dump.interval");
+    gettimeofday(&last, NULL);
+    pending = dump_sync_done;
+
+    for (;;) {
+        sync = __atomic_load_n(&dump_sync_req, __ATOMIC_ACQUIRE);
+
+        // New sync request: only packets queued until now must be written
+        if (sync != pending) {
+            pending = sync;
+            sync_head = __atomic_load_n(&dump_ring.head, __ATOMIC_ACQUIRE);
+        }
+
+        if (sync != dump_sync_done && (ssize_t) (dump_ring.tail - sync_head) >= 0) {
+            // All requested packets are in the buffer, write them now
+            capture_flush_dump();
+            unflushed = 0;
+            gettimeofday(&last, NULL);
+            __atomic_store_n(&dump_sync_done, sync, __ATOMIC_RELEASE);
+            ring_wake(&sync_waiter);
+            continue;
+        }
+
+        if ((record = ring_peek(&dump_ring))) {
+            header = (struct pcap_pkthdr *) RECORD_HEADER(record);
+            capture_dump_packet(header, RECORD_HEADER(record) + sizeof(struct pcap_pkthdr));
+            ring_release(&dump_ring, record);
+            unflushed = 1;
+        }
+
+        // Write buffered packets that have been waiting too long
+        gettimeofday(&now, NULL);
+        elapsed = (now.tv_sec - last.tv_sec) * 1000 + (now.tv_usec - last.tv_usec) / 1000;
+        if (elapsed >= interval) {
+            if (unflushed) capture_flush_dump();
+            unflushed = 0;
+            last = now;
+        }
+
+        // Sleep until more packets are queued or buffered ones must be written
+        if (!record) {
+            ring_wait(&writer_waiter, pipeline_writer_ready, NULL,
+                unflushed ? (interval - elapsed) * 1000 : RING_IDLE_WAIT);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Check if a loader has queued payloads or the file has been read
+ */
+static int
+pipeline_loader_ready(void *arg)
+{
+    return ring_ready(arg) || __atomic_load_n(&load_done, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * @brief Loader thread
+ *
+ * Read decoded payloads of a capture file from its ring and add them
+ * to its own partial calls list until the whole file has been read.
+ */
+static void *
+pipeline_loader(void *arg)
+{
+    int index = (int) (long) arg;
+    struct ring_record *record;
+
+    // Calls of this thread are stored in its own list
+    sip_store_set(&load_stores[index]);
+
+    for (;;) {
+        if (!(record = ring_peek(&load_rings[index]))) {
+            // Check again the ring after the reader has finished
+            if (__atomic_load_n(&load_done, __ATOMIC_ACQUIRE) && !ring_peek(&load_rings[index]))
+                break;
+            ring_wait(&load_waiters[index], pipeline_loader_ready, &load_rings[index],
+                RING_IDLE_WAIT);
+            continue;
+        }
+        capture_load_payload((u_char *) "Offline", (sip_packet_t *) RECORD_HEADER(record),
+            RECORD_HEADER(record) + sizeof(sip_packet_t),
+            record->len - sizeof(sip_packet_t));
+        ring_release(&load_rings[index], record);
+    }
+
+    sip_store_set(NULL);
+    return NULL;
+}
+
+int
+pipeline_init(int workers, int inputs)
+{
+    pthread_attr_t attr;
+    pthread_t thread;
+    size_t ringsize;
+    int i;
+
+    if (workers < 1) workers = 1;
+    if (workers > MAX_WORKERS) workers = MAX_WORKERS;
+    if (inputs < 1 || inputs > MAX_INPUTS) return 1;
+    ringsize = get_option_int_value("capture.ringsize");
+    merge_delay = (long) get_option_int_value("capture.merge.delay") * 1000;
+    pthread_once(&waiters_once, ring_waiters_init);
+
+    // Create all rings before starting any thread
+    for (i = 0; i < inputs; i++) {
+        if (ring_init(&capture_rings[i], ringsize) != 0) return 1;
+        capture_rings[i].consumer = &dispatcher_waiter;
+    }
+    input_count = inputs;
+    for (i = 0; i < workers; i++) {
+        if (ring_init(&worker_rings[i], ringsize) != 0) return 1;
+        worker_rings[i].consumer = &worker_waiters[i];
+    }
+    worker_count = workers;
+
+    // Create temporal file queue (if enabled)
+    if (!is_option_disabled("sngrep.tmpfile")) {
+        if (ring_init(&dump_ring, get_option_int_value("capture.dump.queuesize")) != 0) return 1;
+        dump_ring.consumer = &writer_waiter;
+        dump_enabled = 1;
+    }
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    for (i = 0; i < workers; i++) {
+        if (pthread_create(&thread, &attr, pipeline_worker, &worker_rings[i])) {
+            pthread_attr_destroy(&attr);
+            return 1;
+        }
+    }
+    if (dump_enabled && pthread_create(&thread, &attr, pipeline_writer, NULL)) {
+        pthread_attr_destroy(&attr);
+        return 1;
+    }
+    if (pthread_create(&thread, &attr, pipeline_dispatcher, NULL)) {
+        pthread_attr_destroy(&attr);
+        return 1;
+    }
+    pthread_attr_destroy(&attr);
+    return 0;
+}
+
+u_char *
+pipeline_input(int index)
+{
+    return (u_char *) &capture_rings[index];
+}
+
+void
+pipeline_push(u_char *input, const struct pcap_pkthdr *header, const u_char *packet)
+{
+    packet_ring_t *ring = input ? (packet_ring_t *) input : &capture_rings[0];
+    ring_push(ring, header, sizeof(struct pcap_pkthdr), packet, header->caplen);
+}
+
+unsigned long
+pipeline_drops()
+{
+    unsigned long drops;
+    int i;
+
+    drops = 0;
+    for (i = 0; i < input_count; i++) {
+        drops += capture_rings[i].drops;
+    }
+    for (i = 0; i < worker_count; i++) {
+        drops += worker_rings[i].drops;
+    }
+    return drops;
+}
+
+unsigned long
+pipeline_dump_drops()
+{
+    return dump_ring.drops;
+}
+
+/**
+ * @brief Check if the writer has completed a sync request
+ */
+static int
+pipeline_dump_synced(void *arg)
+{
+    unsigned int req = *(unsigned int *) arg;
+    return (int) (__atomic_load_n(&dump_sync_done, __ATOMIC_ACQUIRE) - req) >= 0;
+}
+
+void
+pipeline_dump_sync()
+{
+    unsigned int req;
+
+    // Nothing to wait if there is no writer thread
+    if (!dump_enabled) return;
+
+    // Ask the writer to flush and wait until it's done
+    req = __atomic_add_fetch(&dump_sync_req, 1, __ATOMIC_ACQ_REL);
+    ring_wake(&writer_waiter);
+    while (!pipeline_dump_synced(&req)) {
+        ring_wait(&sync_waiter, pipeline_dump_synced, &req, RING_IDLE_WAIT);
+    }
+}
+
+int
+pipeline_load_init(int loaders)
+{
+    size_t ringsize;
+
+    if (loaders > MAX_WORKERS) loaders = MAX_WORKERS;
+    if (loaders < 1) return 1;
+
+    // Loaders share the configured queue memory
+    ringsize = get_option_int_value("capture.ringsize") / loaders;
+    if (ringsize < LOAD_RING_MIN) ringsize = LOAD_RING_MIN;
+    pthread_once(&waiters_once, ring_waiters_init);
+
+    load_done = 0;
+    load_current = 0;
+    load_records = 0;
+    for (load_count = 0; load_count < loaders; load_count++) {
+        memset(&load_stores[load_count], 0, sizeof(sip_store_t));
+        if (ring_init(&load_rings[load_count], ringsize) != 0) break;
+        load_rings[load_count].consumer = &load_waiters[load_count];
+        load_rings[load_count].producer = &reader_waiter;
+        if (pthread_create(&load_threads[load_count], NULL, pipeline_loader,
+                (void *) (long) load_count)) {
+            ring_free(&load_rings[load_count]);
+            break;
+        }
+    }
+
+    // Not all threads could be created, stop the rest
+    if (load_count != loaders) {
+        pipeline_load_finish();
+        return 1;
+    }
+    return 0;
+}
+
+void
+pipeline_load_push(u_char *mode, const struct pcap_pkthdr *header, const u_char *packet)
+{
+    const u_char *payload;
+    sip_packet_t pkt;
+    int size;
+
+    // Packets are decoded in file order, so reassembly works as usual
+    payload = capture_packet_payload(header, packet, &pkt, &size);
+    for (; payload; payload = capture_next_payload(&pkt, &size)) {
+        pkt.offset = pcapfile_offset(payload);
+        ring_push_wait(&load_rings[load_current], &pkt, sizeof(sip_packet_t), payload, size);
+    }
+
+    // Move to next loader thread after each batch of records
+    if (++load_records % LOAD_BATCH == 0) {
+        load_current = (load_current + 1) % load_count;
+    }
+}
+
+void
+pipeline_load_sync()
+{
+    int i;
+
+    // Wait until all queued payloads have been parsed
+    for (i = 0; i < load_count; i++) {
+        while (!ring_empty(&load_rings[i]))
+            ring_wait(&reader_waiter, ring_empty, &load_rings[i], RING_IDLE_WAIT);
+    }
+
+    // Loaders are idle, their calls can be merged
+    sip_store_merge(load_stores, load_count);
+}
+
+void
+pipeline_load_finish()
+{
+    int i;
+
+    // Wait until all loaders have parsed their queued payloads
+    __atomic_store_n(&load_done, 1, __ATOMIC_RELEASE);
+    for (i = 0; i < load_count; i++) {
+        ring_wake(&load_waiters[i]);
+        pthread_join(load_threads[i], NULL);
+        ring_free(&load_rings[i]);
+    }
+
+    // Join their calls in the global list
+    sip_store_merge(load_stores, load_count);
+    load_count = 0;
+}
+
+#endif
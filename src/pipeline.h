@@ -0,0 +1,199 @@
+/**************************************************************************
+ **
+ ** sngrep - SIP callflow viewer using ngrep
+ **
+ ** Copyright (C) 2013 Ivan Alonso (Kaian)
+ ** Copyright (C) 2013 Irontec SL. All rights reserved.
+ **
+ ** This program is free software: you can redistribute it and/or modify
+ ** it under the terms of the GNU General Public License as published by
+ ** the Free Software Foundation, either version 3 of the License, or
+ ** (at your option) any later version.
+ **
+ ** This program is distributed in the hope that it will be useful,
+ ** but WITHOUT ANY WARRANTY; without even the implied warranty of
+ ** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ ** GNU General Public License for more details.
+ **
+ ** You should have received a copy of the GNU General Public License
+ ** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ **
+ ****************************************************************************/
+/**
+ * @file pipeline.h
+ * @author Ivan Alonso [aka Kaian] <kaian@irontec.com>
+ *
+ * @brief Functions to parse captured packets in multiple threads
+ *
+ * In online mode, each capture thread only copies each frame into a
+ * lock-free single producer/single consumer ring. A dispatcher thread
+ * merges those rings by packet timestamp, queues the packet for the
+ * temporal file writer and forwards it to one of the parser workers,
+ * choosing the worker from the Call-ID hash so all messages of a dialog
+ * are parsed in order by the same thread.
+ *
+ *   capture 1 --> ring --+--> dispatcher --+--> ring --> worker 1
+ *   capture 2 --> ring --+                 +--> ring --> worker 2
+ *   ...                                    +--> ...
+ *                                          +--> ring --> writer --> tmpfile
+ *
+ * If a ring is full the packet is discarded and counted, so a slow
+ * parser (or a slow screen refresh or disk) never blocks the capture
+ * thread. Threads with nothing to do sleep on a condition variable and
+ * are woken up by the other side of their rings.
+ *
+ * Capture files are also parsed by several loader threads. Records are
+ * decoded by the reading thread and their payloads are passed, in
+ * batches of consecutive records, to each loader in turn. Each loader
+ * stores its calls in its own partial list (see sip_store_t) and those
+ * lists are merged from time to time while the file is being read.
+ *
+ *   reader --+--> ring --> loader 1 --> store 1 --+--> merge --> calls
+ *            +--> ring --> loader 2 --> store 2 --+
+ *            +--> ...
+ *
+ */
+#ifndef __SNGREP_PIPELINE_H
+#define __SNGREP_PIPELINE_H
+
+#include "spcap.h"
+
+//! Shorter declaration of packet_ring structure
+typedef struct packet_ring packet_ring_t;
+//! Sleeping thread of a ring side (defined in pipeline.c)
+struct ring_waiter;
+
+/**
+ * @brief Lock-free single producer single consumer packet ring
+ *
+ * Packets are stored as variable length records in a contiguous
+ * buffer. Positions are free running counters: the producer only
+ * writes head and the consumer only writes tail.
+ */
+struct packet_ring
+{
+    //! Records buffer
+    u_char *buffer;
+    //! Buffer size (power of two)
+    size_t size;
+    //! Bytes written by producer
+    size_t head;
+    //! Bytes released by consumer
+    size_t tail;
+    //! Packets discarded because the ring was full
+    unsigned long drops;
+    //! Thread reading the ring, woken up on new records
+    struct ring_waiter *consumer;
+    //! Thread waiting for free space, woken up on released records
+    struct ring_waiter *producer;
+    //! Consumer position when the producer started waiting
+    size_t snapshot;
+};
+
+/**
+ * @brief Create the rings and start dispatcher and worker threads
+ *
+ * @param workers Number of parser worker threads
+ * @param inputs Number of capture threads (one ring each)
+ * @return 0 on success, 1 otherwise
+ */
+extern int
+pipeline_init(int workers, int inputs);
+
+/**
+ * @brief Get the pipeline input of a capture thread
+ *
+ * @param index Capture thread number (from 0 to inputs - 1)
+ * @return argument for pipeline_push
+ */
+extern u_char *
+pipeline_input(int index);
+
+/**
+ * @brief Push a captured packet into the pipeline
+ *
+ * This function has the same signature as parse_packet so it can be
+ * used as libpcap callback from the capture thread. The packet is
+ * copied into the capture ring and never parsed here.
+ *
+ * Each capture thread must use its own input. Packets pushed to the
+ * same input must be in timestamp order.
+ *
+ * @param input Value returned by pipeline_input (NULL for the first)
+ * @param header Packet header from libpcap
+ * @param packet Packet data
+ */
+extern void
+pipeline_push(u_char *input, const struct pcap_pkthdr *header, const u_char *packet);
+
+/**
+ * @brief Get the number of packets discarded by full rings
+ *
+ * @return discarded packets in capture and worker rings
+ */
+extern unsigned long
+pipeline_drops();
+
+/**
+ * @brief Get the number of packets not stored in the temporal file
+ *
+ * Packets are not stored when the writer queue is full, but they are
+ * still parsed.
+ *
+ * @return discarded packets in the writer ring
+ */
+extern unsigned long
+pipeline_dump_drops();
+
+/**
+ * @brief Write all queued packets to the temporal file
+ *
+ * Use this before reading the temporal file. This function waits until
+ * the writer thread has written all packets queued before the call,
+ * even if new packets keep arriving.
+ */
+extern void
+pipeline_dump_sync();
+
+/**
+ * @brief Start loader threads to parse a capture file
+ *
+ * @param loaders Number of loader threads
+ * @return 0 on success, 1 otherwise
+ */
+extern int
+pipeline_load_init(int loaders);
+
+/**
+ * @brief Pass a packet read from a capture file to loader threads
+ *
+ * This function has the same signature as parse_packet so it can be
+ * used as packet handler while reading the file. The packet is decoded
+ * here and its payloads are queued for the loader of current batch,
+ * waiting if its queue is full.
+ *
+ * @param mode Unused
+ * @param header Packet header from libpcap
+ * @param packet Packet data
+ */
+extern void
+pipeline_load_push(u_char *mode, const struct pcap_pkthdr *header, const u_char *packet);
+
+/**
+ * @brief Wait for loader threads to parse queued payloads and merge
+ * their calls into the global list
+ *
+ * Must be invoked from the thread pushing packets, between pushes.
+ */
+extern void
+pipeline_load_sync();
+
+/**
+ * @brief Wait for loader threads and merge their calls
+ *
+ * Must be invoked once all packets of the file have been pushed.
+ */
+extern void
+pipeline_load_finish();
+
+#endif
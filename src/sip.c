@@ -32,13 +32,20 @@
  *
  * @todo Replace structures for their typedef shorter names
  */
+#include <ctype.h>
 #include <regex.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <time.h>
+#include <arpa/inet.h>
 #include "sip.h"
 #include "option.h"
+#include "intern.h"
+#ifdef WITH_LIBPCAP
+#include "pcapindex.h"
+#endif
 
 /**
  * @brief Linked list of parsed calls
@@ -56,25 +63,114 @@ static sip_call_t *calls = NULL;
  * single call data.
  */
 
-static pthread_mutex_t calls_lock;
+static pthread_mutex_t calls_lock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+
+/**
+ * @brief Partial calls list of current thread
+ *
+ * When set, calls are only searched and created in this list, without
+ * locking the global calls list.
+ */
+static __thread sip_store_t *store = NULL;
+//! Last call of the global calls list
+static sip_call_t *calls_last = NULL;
+//! Global calls indexed by Call-ID
+static sip_call_index_t calls_index;
+//! Global calls indexed by X-Call-ID
+static sip_call_index_t xcalls_index;
+//! Incremented each time global calls get new messages
+static unsigned int msgs_generation = 0;
+//! Calls structures pool
+static slab_t call_slab = SLAB_INITIALIZER(sizeof(sip_call_t), 64);
+
+//! Slot of a header name in the header names table
+#define SIP_HDR_HASH(len, first, last) (((len) + (first) + (last) * 4) & 31)
+
+/**
+ * @brief Headers recognized by the payload tokenizer
+ */
+enum sip_hdr_id
+{
+    SIP_HDR_OTHER = 0,
+    SIP_HDR_CALLID,
+    SIP_HDR_FROM,
+    SIP_HDR_TO,
+    SIP_HDR_CSEQ,
+    SIP_HDR_XCALLID,
+    SIP_HDR_CTYPE,
+    SIP_HDR_COUNT
+};
+
+/**
+ * @brief Header names table entry
+ */
+struct sip_hdr_name
+{
+    //! Lowercase header name
+    const char *name;
+    //! Header name length
+    int len;
+    //! Header id
+    enum sip_hdr_id id;
+};
+
+//! Header names (long and compact forms) indexed by SIP_HDR_HASH
+static const struct sip_hdr_name hdr_names[32] = {
+    [SIP_HDR_HASH(7, 'c', 'd')] = { "call-id", 7, SIP_HDR_CALLID },
+    [SIP_HDR_HASH(1, 'i', 'i')] = { "i", 1, SIP_HDR_CALLID },
+    [SIP_HDR_HASH(4, 'f', 'm')] = { "from", 4, SIP_HDR_FROM },
+    [SIP_HDR_HASH(1, 'f', 'f')] = { "f", 1, SIP_HDR_FROM },
+    [SIP_HDR_HASH(2, 't', 'o')] = { "to", 2, SIP_HDR_TO },
+    [SIP_HDR_HASH(1, 't', 't')] = { "t", 1, SIP_HDR_TO },
+    [SIP_HDR_HASH(4, 'c', 'q')] = { "cseq", 4, SIP_HDR_CSEQ },
+    [SIP_HDR_HASH(9, 'x', 'd')] = { "x-call-id", 9, SIP_HDR_XCALLID },
+    [SIP_HDR_HASH(5, 'x', 'd')] = { "x-cid", 5, SIP_HDR_XCALLID },
+    [SIP_HDR_HASH(12, 'c', 'e')] = { "content-type", 12, SIP_HDR_CTYPE },
+    [SIP_HDR_HASH(1, 'c', 'c')] = { "c", 1, SIP_HDR_CTYPE }, };
+
+/**
+ * @brief Position of a token in a payload
+ */
+struct sip_token
+{
+    //! First character (not null terminated)
+    const char *value;
+    //! Token length
+    int len;
+};
+
+/**
+ * @brief Tokenized payload headers
+ */
+typedef struct sip_tokens
+{
+    //! Request or status line
+    struct sip_token start;
+    //! Value of each recognized header
+    struct sip_token hdrs[SIP_HDR_COUNT];
+} sip_tokens_t;
 
 static sip_attr_hdr_t attrs[] = {
     {
         .id = SIP_ATTR_SIPFROM,
         .name = "sipfrom",
-        .desc = "SIP From" },
+        .desc = "SIP From",
+        .intern = 1 },
     {
         .id = SIP_ATTR_SIPTO,
         .name = "sipto",
-        .desc = "SIP To" },
+        .desc = "SIP To",
+        .intern = 1 },
     {
         .id = SIP_ATTR_SRC,
         .name = "src",
-        .desc = "Source" },
+        .desc = "Source",
+        .intern = 1 },
     {
         .id = SIP_ATTR_DST,
         .name = "dst",
-        .desc = "Destiny" },
+        .desc = "Destiny",
+        .intern = 1 },
     {
         .id = SIP_ATTR_CALLID,
         .name = "callid",
@@ -82,7 +178,8 @@ static sip_attr_hdr_t attrs[] = {
     {
         .id = SIP_ATTR_XCALLID,
         .name = "xcallid",
-        .desc = "X-Call-ID" },
+        .desc = "X-Call-ID",
+        .intern = 1 },
     {
         .id = SIP_ATTR_TIME,
         .name = "time",
@@ -90,19 +187,23 @@ static sip_attr_hdr_t attrs[] = {
     {
         .id = SIP_ATTR_METHOD,
         .name = "method",
-        .desc = "Method" },
+        .desc = "Method",
+        .intern = 1 },
     {
         .id = SIP_ATTR_REQUEST,
         .name = "request",
-        .desc = "Request" },
+        .desc = "Request",
+        .intern = 1 },
     {
         .id = SIP_ATTR_CSEQ,
         .name = "CSeq",
-        .desc = "CSeq" },
+        .desc = "CSeq",
+        .intern = 1 },
     {
         .id = SIP_ATTR_SDP,
         .name = "sdp",
-        .desc = "Has SDP"},
+        .desc = "Has SDP",
+        .intern = 1 },
     {
         .id = SIP_ATTR_STARTING,
         .name = "starting",
@@ -110,128 +211,1198 @@ static sip_attr_hdr_t attrs[] = {
     {
         .id = SIP_ATTR_MSGCNT,
         .name = "msgcnt",
-        .desc = "Msgs" }, };
+        .desc = "Msgs" },
+    {
+        .id = SIP_ATTR_DURATION,
+        .name = "duration",
+        .desc = "Duration" },
+    {
+        .id = SIP_ATTR_CALLSTATE,
+        .name = "state",
+        .desc = "State" },
+    {
+        .id = SIP_ATTR_CONVDUR,
+        .name = "convdur",
+        .desc = "Conversation" },
+    {
+        .id = SIP_ATTR_PDD,
+        .name = "pdd",
+        .desc = "PDD" },
+    {
+        .id = SIP_ATTR_SETUPTIME,
+        .name = "setuptime",
+        .desc = "Setup time" },
+    {
+        .id = SIP_ATTR_CAUSE,
+        .name = "cause",
+        .desc = "Release cause" }, };
+
+//! Dialog state names (indexed by enum sip_dialog_state)
+static const char *dialog_states[] = {
+    NULL, "SETUP", "RINGING", "ANSWERED", "TERMINATED", "CANCELLED", "FAILED" };
+
+//! Attribute headers indexed by attribute id
+static sip_attr_hdr_t *attrs_index[SIP_ATTR_COUNT];
+//! Attribute headers index initialization
+static pthread_once_t attrs_once = PTHREAD_ONCE_INIT;
+
+/**
+ * @brief Fill the attribute headers index
+ */
+static void
+sip_attr_index_headers()
+{
+    int i;
+    for (i = 0; i < sizeof(attrs) / sizeof(*attrs); i++) {
+        attrs_index[attrs[i].id] = &attrs[i];
+    }
+}
+
+/**
+ * @brief Check if attribute values are stored in the interned pool
+ *
+ * @param id Attribute id
+ * @return 1 if values are interned, 0 otherwise
+ */
+static int
+sip_attr_is_interned(enum sip_attr_id id)
+{
+    sip_attr_hdr_t *header = sip_attr_get_header(id);
+    return header && header->intern;
+}
+
+sip_msg_t *
+sip_msg_create(sip_call_t *call, const sip_packet_t *pkt, const char *payload, int len)
+{
+    sip_msg_t *msg;
+
+    pthread_mutex_lock(&call->lock);
+    if (!(msg = arena_alloc(&call->arena, sizeof(sip_msg_t)))) {
+        pthread_mutex_unlock(&call->lock);
+        return NULL;
+    }
+    memset(msg, 0, sizeof(sip_msg_t));
+    msg->attrs = NULL;
+    msg->pkt = *pkt;
+    msg->len = len;
+    msg->call = call;
+    // Store a null terminated copy of the payload
+    // (a failed copy is released with the rest of the call)
+    if (payload && !(msg->payload = arena_strndup(&call->arena, payload, len))) {
+        pthread_mutex_unlock(&call->lock);
+        return NULL;
+    }
+    pthread_mutex_unlock(&call->lock);
+    msg->parsed = 0;
+    msg->color = -1;
+    return msg;
+}
+
+/**
+ * @brief Get the value a call is indexed by
+ *
+ * Calls are indexed by their Call-ID or by an attribute of their first
+ * message.
+ */
+static const char *
+sip_index_key(sip_call_t *call, enum sip_attr_id id)
+{
+    if (id == SIP_ATTR_CALLID) return call->callid;
+    return msg_get_attribute(call->msgs, id);
+}
+
+/**
+ * @brief Find a call in an index
+ *
+ * @param index Calls index
+ * @param id Indexed attribute
+ * @param value Attribute value to search
+ * @return slot of the call or the empty slot where it should be added
+ */
+static unsigned int
+sip_index_slot(sip_call_index_t *index, enum sip_attr_id id, const char *value)
+{
+    unsigned int hash = 2166136261U, mask = index->size - 1;
+    const char *c, *cur;
+
+    for (c = value; *c; c++)
+        hash = (hash ^ (u_char) *c) * 16777619U;
+    for (hash &= mask; index->table[hash]; hash = (hash + 1) & mask) {
+        cur = sip_index_key(index->table[hash], id);
+        if (cur && !strcmp(cur, value)) break;
+    }
+    return hash;
+}
+
+/**
+ * @brief Find a call in an index
+ *
+ * @return found call or NULL
+ */
+static sip_call_t *
+sip_index_find(sip_call_index_t *index, enum sip_attr_id id, const char *value)
+{
+    if (!index->size || !value) return NULL;
+    return index->table[sip_index_slot(index, id, value)];
+}
+
+/**
+ * @brief Add a call to an index
+ *
+ * The call is indexed by its Call-ID or the given attribute of its
+ * first message. If there is already a call with the same value, index is not
+ * changed. Index grows when it's half full.
+ *
+ * @return 0 on success, 1 otherwise
+ */
+static int
+sip_index_add(sip_call_index_t *index, enum sip_attr_id id, sip_call_t *call)
+{
+    sip_call_t **old = index->table;
+    unsigned int size = index->size, slot, i;
+    const char *value;
+
+    if (!(value = sip_index_key(call, id))) return 1;
+
+    if ((index->used + 1) * 2 > index->size) {
+        index->size = size ? size * 2 : 1024;
+        if (!(index->table = calloc(index->size, sizeof(sip_call_t *)))) {
+            index->table = old;
+            index->size = size;
+            return 1;
+        }
+        index->used = 0;
+        for (i = 0; i < size; i++) {
+            if (old[i]) sip_index_add(index, id, old[i]);
+        }
+        free(old);
+    }
+
+    slot = sip_index_slot(index, id, value);
+    if (index->table[slot]) return 0;
+    index->table[slot] = call;
+    index->used++;
+    return 0;
+}
+
+/**
+ * @brief Free an index table
+ */
+static void
+sip_index_free(sip_call_index_t *index)
+{
+    free(index->table);
+    memset(index, 0, sizeof(sip_call_index_t));
+}
+
+/**
+ * @brief Add a new call to the global indexes
+ *
+ * Call must have its first message. Global calls lock must be held.
+ */
+static void
+sip_call_index(sip_call_t *call)
+{
+    sip_index_add(&calls_index, SIP_ATTR_CALLID, call);
+    if (msg_get_attribute(call->msgs, SIP_ATTR_XCALLID))
+        sip_index_add(&xcalls_index, SIP_ATTR_XCALLID, call);
+}
+
+/**
+ * @brief Allocate a new call with the given callid
+ *
+ * The call is not added to any list or index until it's published.
+ *
+ * @return allocated call or NULL
+ */
+static sip_call_t *
+sip_call_alloc(const char *callid)
+{
+    // Initialize a new call structure
+    sip_call_t *call = slab_alloc(&call_slab);
+    if (!call) return NULL;
+    memset(call, 0, sizeof(sip_call_t));
+    call->attrs = NULL;
+    call->color = -1;
+
+    // Initialize call lock
+    call->lock = (pthread_mutex_t) PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+
+    // Call-ID is the key of the call indexes
+    if (!(call->callid = arena_strndup(&call->arena, callid, strlen(callid)))) {
+        slab_free(&call_slab, call);
+        return NULL;
+    }
+    return call;
+}
+
+/**
+ * @brief Free a call structure and all its messages
+ *
+ * Messages and their data are allocated in the call arena, so they're
+ * all released at once. Messages moved to another call must have
+ * been moved with the arena.
+ */
+static void
+sip_call_destroy(sip_call_t *call)
+{
+    arena_free(&call->arena);
+    pthread_mutex_destroy(&call->lock);
+    slab_free(&call_slab, call);
+}
+
+/**
+ * @brief Add a new call to the current thread store or global index
+ *
+ * Global calls lock must be held if there is no store, so the call
+ * can not be created twice.
+ *
+ * @param call SIP call structure
+ */
+static void
+sip_call_publish(sip_call_t *call)
+{
+    // Add the call to the end of current thread store
+    if (store) {
+        if (store->last) store->last->next = call;
+        else store->first = call;
+        call->prev = store->last;
+        store->last = call;
+        sip_index_add(&store->index, SIP_ATTR_CALLID, call);
+        return;
+    }
+
+    // Global calls are searchable at once, but they're only
+    // listed once they have their first message
+    pthread_mutex_lock(&calls_lock);
+    sip_index_add(&calls_index, SIP_ATTR_CALLID, call);
+    pthread_mutex_unlock(&calls_lock);
+}
+
+sip_call_t *
+sip_call_create(const char *callid)
+{
+    sip_call_t *call;
+
+    if ((call = sip_call_alloc(callid))) sip_call_publish(call);
+    return call;
+}
+
+/**
+ * @brief Allocate memory for message data
+ *
+ * Message data is allocated in its call arena.
+ *
+ * @param msg SIP message structure
+ * @param size Required bytes
+ * @return allocated memory or NULL
+ */
+static void *
+msg_alloc(sip_msg_t *msg, size_t size)
+{
+    void *data;
+
+    pthread_mutex_lock(&msg->call->lock);
+    data = arena_alloc(&msg->call->arena, size);
+    pthread_mutex_unlock(&msg->call->lock);
+    return data;
+}
+
+/**
+ * @brief Get the header id of a header name
+ *
+ * Header names are looked up in a perfect hash table built at compile
+ * time, using their length, first and last characters (lowercase).
+ *
+ * @param name Header name (not null terminated)
+ * @param len Header name length
+ * @return header id or SIP_HDR_OTHER if it's not a known header
+ */
+static enum sip_hdr_id
+sip_hdr_lookup(const char *name, int len)
+{
+    const struct sip_hdr_name *hdr;
+
+    if (len <= 0) return SIP_HDR_OTHER;
+    hdr = &hdr_names[SIP_HDR_HASH(len, tolower((unsigned char) name[0]),
+        tolower((unsigned char) name[len - 1]))];
+    if (hdr->len != len || strncasecmp(hdr->name, name, len)) return SIP_HDR_OTHER;
+    return hdr->id;
+}
+
+/**
+ * @brief Split a raw payload into start line and header values
+ *
+ * Payload headers are walked once. Only the position of the start line
+ * and the values of known headers are stored (the last one if a header
+ * is repeated), nothing is copied.
+ *
+ * @param payload Raw payload (not null terminated)
+ * @param len Payload length
+ * @param tokens Structure to be filled
+ */
+static void
+sip_tokenize(const char *payload, int len, sip_tokens_t *tokens)
+{
+    const char *line, *next, *end = payload + len;
+    const char *eol, *colon, *name_end, *value;
+    enum sip_hdr_id id;
+
+    memset(tokens, 0, sizeof(sip_tokens_t));
+    for (line = payload; line < end; line = next) {
+        if ((eol = memchr(line, '\n', end - line))) {
+            next = eol + 1;
+        } else {
+            next = eol = end;
+        }
+
+        // fix last ngrep line character
+        if (eol > line && eol[-1] == '.') eol--;
+        if (eol > line && eol[-1] == '\r') eol--;
+
+        // Empty line marks the end of headers
+        if (eol == line) break;
+
+        // First line is the request or status line
+        if (line == payload) {
+            tokens->start.value = line;
+            tokens->start.len = eol - line;
+            continue;
+        }
+
+        // Get header name without trailing blanks
+        if (!(colon = memchr(line, ':', eol - line))) continue;
+        for (name_end = colon; name_end > line && isblank((unsigned char) name_end[-1]);
+             name_end--)
+            ;
+        if ((id = sip_hdr_lookup(line, name_end - line)) == SIP_HDR_OTHER) continue;
+
+        // Get header value without leading blanks
+        for (value = colon + 1; value < eol && isblank((unsigned char) *value); value++)
+            ;
+        tokens->hdrs[id].value = value;
+        tokens->hdrs[id].len = eol - value;
+    }
+}
+
+/**
+ * @brief Get the Call-ID of a tokenized payload
+ *
+ * Only the part of the value before the '@' is used.
+ *
+ * @return allocated callid or NULL if payload has no Call-ID
+ */
+static char *
+sip_tokens_callid(const sip_tokens_t *tokens)
+{
+    const struct sip_token *hdr = &tokens->hdrs[SIP_HDR_CALLID];
+    const char *at;
+    int len = hdr->len;
+
+    if (!len) return NULL;
+    if ((at = memchr(hdr->value, '@', len))) len = at - hdr->value;
+    return (len > 0) ? strndup(hdr->value, len) : NULL;
+}
+
+char *
+sip_get_callid(const char* payload, int len)
+{
+    sip_tokens_t tokens;
+
+    sip_tokenize(payload, len, &tokens);
+    return sip_tokens_callid(&tokens);
+}
+
+unsigned int
+sip_get_callid_hash(const char *payload, int len)
+{
+    sip_tokens_t tokens;
+    const struct sip_token *hdr = &tokens.hdrs[SIP_HDR_CALLID];
+    unsigned int hash = 2166136261U;
+    int i;
+
+    sip_tokenize(payload, len, &tokens);
+    if (!hdr->len) return 0;
+
+    // Hash the same part of the value used as call key
+    for (i = 0; i < hdr->len && hdr->value[i] != '@'; i++)
+        hash = (hash ^ (u_char) hdr->value[i]) * 16777619U;
+    return i ? hash : 0;
+}
 
 sip_msg_t *
-sip_msg_create(const char *header, const char *payload)
+sip_load_message(const char *header, const char *payload)
+{
+    sip_packet_t pkt;
+
+    // Convert ngrep header to packet information
+    if (sip_parse_header(header, &pkt) != 0) {
+        return NULL;
+    }
+    return sip_load_packet(&pkt, payload, strlen(payload));
+}
+
+/**
+ * @brief Get the length of a token before any of the stop characters
+ */
+static int
+sip_token_span(const char *value, int len, const char *stop)
+{
+    int i;
+
+    for (i = 0; i < len && !strchr(stop, value[i]); i++)
+        ;
+    return i;
+}
+
+/**
+ * @brief Skip the leading blanks of a token
+ *
+ * @return number of skipped characters
+ */
+static int
+sip_token_skip(const char *value, int len)
+{
+    int i;
+
+    for (i = 0; i < len && isblank((unsigned char) value[i]); i++)
+        ;
+    return i;
+}
+
+/**
+ * @brief Store a token as message attribute
+ *
+ * Empty tokens are ignored and long tokens are truncated.
+ */
+static void
+msg_set_token(sip_msg_t *msg, enum sip_attr_id id, const char *value, int len)
+{
+    char buffer[256];
+
+    if (len <= 0) return;
+    if (len >= sizeof(buffer)) len = sizeof(buffer) - 1;
+    memcpy(buffer, value, len);
+    buffer[len] = '\0';
+    msg_set_attribute(msg, id, buffer);
+}
+
+/**
+ * @brief Store the user and host of a From/To header as attribute
+ */
+static void
+msg_set_uri_token(sip_msg_t *msg, enum sip_attr_id id, const struct sip_token *tok)
+{
+    const char *colon, *value;
+
+    // URI starts after the first colon (sip:, sips:, tel:...)
+    if (!tok->len || !(colon = memchr(tok->value, ':', tok->len)) || colon == tok->value) return;
+    value = colon + 1;
+    msg_set_token(msg, id, value, sip_token_span(value, tok->len - (value - tok->value), "\t>;"));
+}
+
+/**
+ * @brief Set message attributes from its tokenized payload
+ *
+ * @param msg SIP message structure
+ * @param tokens Start line and header values of message payload
+ */
+static void
+msg_parse_tokens(sip_msg_t *msg, const sip_tokens_t *tokens)
+{
+    const struct sip_token *tok;
+    const char *value;
+    int len, num;
+
+    // Responses method is their status
+    tok = &tokens->start;
+    if (tok->len > 8 && !strncmp(tok->value, "SIP/2.0 ", 8)) {
+        value = tok->value + 8;
+        len = tok->len - 8;
+        num = sip_token_skip(value, len);
+        msg_set_token(msg, SIP_ATTR_METHOD, value + num, sip_token_span(value + num, len - num, "\t"));
+    }
+
+    // CSeq contains the sequence number and the request method
+    tok = &tokens->hdrs[SIP_HDR_CSEQ];
+    if ((num = sip_token_span(tok->value, tok->len, " \t")) > 0) {
+        len = sip_token_skip(tok->value + num, tok->len - num);
+        value = tok->value + num + len;
+        len = sip_token_span(value, tok->len - num - len, "\t");
+        if (len > 0 && !msg_get_attribute(msg, SIP_ATTR_METHOD)) {
+            // ACK Messages are not considered requests
+            if (len != 3 || strncasecmp(value, "ACK", 3))
+                msg_set_attribute(msg, SIP_ATTR_REQUEST, "1");
+            msg_set_token(msg, SIP_ATTR_METHOD, value, len);
+        }
+        msg_set_token(msg, SIP_ATTR_CSEQ, tok->value, num);
+    }
+
+    msg_set_uri_token(msg, SIP_ATTR_SIPFROM, &tokens->hdrs[SIP_HDR_FROM]);
+    msg_set_uri_token(msg, SIP_ATTR_SIPTO, &tokens->hdrs[SIP_HDR_TO]);
+
+    tok = &tokens->hdrs[SIP_HDR_XCALLID];
+    msg_set_token(msg, SIP_ATTR_XCALLID, tok->value, sip_token_span(tok->value, tok->len, "@\t"));
+
+    tok = &tokens->hdrs[SIP_HDR_CTYPE];
+    if (tok->len >= 15 && !strncasecmp(tok->value, "application/sdp", 15))
+        msg_set_attribute(msg, SIP_ATTR_SDP, "1");
+}
+
+/**
+ * @brief Check if a method can start a new call
+ *
+ * Only requests in the following group create calls when incomplete
+ * dialogs are ignored.
+ */
+static int
+sip_method_is_initial(const char *method)
+{
+    return !method || !strncasecmp(method, "INVITE", 6)
+        || !strncasecmp(method, "REGISTER", 8) || !strncasecmp(method, "SUBSCRIBE", 9)
+        || !strncasecmp(method, "OPTIONS", 7) || !strncasecmp(method, "PUBLISH", 7)
+        || !strncasecmp(method, "MESSAGE", 7) || !strncasecmp(method, "NOTIFY", 6);
+}
+
+/**
+ * @brief Check if a message can start a new call
+ *
+ * @see sip_method_is_initial
+ */
+static int
+msg_is_initial(sip_msg_t *msg)
+{
+    const char *method = msg_get_attribute(msg, SIP_ATTR_METHOD);
+
+    // Parse the message unless its method is already known
+    if (!method) method = msg_get_attribute(msg_parse(msg), SIP_ATTR_METHOD);
+    return sip_method_is_initial(method);
+}
+
+/**
+ * @brief Get the fingerprint of a raw payload
+ *
+ * FNV-1a hash of the payload lines as they're stored once parsed (empty
+ * lines and trailing ngrep dots removed), case insensitive. Two payloads
+ * with the same lines have the same fingerprint.
+ *
+ * @param payload Raw payload (not null terminated)
+ * @param len Payload length
+ * @return payload fingerprint
+ */
+static u_int64_t
+sip_payload_fingerprint(const char *payload, int len)
+{
+    const char *line, *eol, *end;
+    u_int64_t hash = 14695981039346656037ULL;
+
+    // Payload is used up to the first null character
+    if ((end = memchr(payload, '\0', len)) == NULL) end = payload + len;
+
+    for (line = payload; line < end; line = eol + 1) {
+        if (!(eol = memchr(line, '\n', end - line))) eol = end;
+        if (eol == line) continue;
+        for (; line < eol - (eol[-1] == '.'); line++)
+            hash = (hash ^ (unsigned char) tolower((unsigned char) *line)) * 1099511628211ULL;
+        hash = (hash ^ '\n') * 1099511628211ULL;
+    }
+    return hash;
+}
+
+/**
+ * @brief Get the status code of a tokenized response
+ *
+ * @param tokens Start line and header values of message payload
+ * @return status code or 0 if the payload is not a response
+ */
+static int
+sip_tokens_status(const sip_tokens_t *tokens)
+{
+    const struct sip_token *tok = &tokens->start;
+    int i, status = 0;
+
+    if (tok->len <= 8 || strncmp(tok->value, "SIP/2.0 ", 8)) return 0;
+    for (i = 8; i < tok->len && isdigit((unsigned char) tok->value[i]); i++)
+        status = status * 10 + tok->value[i] - '0';
+    return status;
+}
+
+/**
+ * @brief Get the method of the CSeq header of a tokenized payload
+ *
+ * @param tokens Start line and header values of message payload
+ * @param method Buffer for the null terminated method
+ * @param size Buffer size
+ * @return 0 if the method has been found, 1 otherwise
+ */
+static int
+sip_tokens_cseq_method(const sip_tokens_t *tokens, char *method, size_t size)
+{
+    const struct sip_token *tok = &tokens->hdrs[SIP_HDR_CSEQ];
+    int num, len;
+
+    if (!(num = sip_token_span(tok->value, tok->len, " \t"))) return 1;
+    num += sip_token_skip(tok->value + num, tok->len - num);
+    if (!(len = sip_token_span(tok->value + num, tok->len - num, "\t"))) return 1;
+    if (len >= size) len = size - 1;
+    memcpy(method, tok->value + num, len);
+    method[len] = '\0';
+    return 0;
+}
+
+/**
+ * @brief Get the id of the CSeq method of a tokenized payload
+ *
+ * @param tokens Start line and header values of message payload
+ * @return method id or SIP_METHOD_OTHER
+ */
+static enum sip_method_id
+sip_tokens_method(const sip_tokens_t *tokens)
+{
+    char method[32];
+
+    if (sip_tokens_cseq_method(tokens, method, sizeof(method)) != 0) return SIP_METHOD_OTHER;
+    if (!strcasecmp(method, "INVITE")) return SIP_METHOD_INVITE;
+    if (!strcasecmp(method, "ACK")) return SIP_METHOD_ACK;
+    if (!strcasecmp(method, "BYE")) return SIP_METHOD_BYE;
+    if (!strcasecmp(method, "CANCEL")) return SIP_METHOD_CANCEL;
+    return SIP_METHOD_OTHER;
+}
+
+/**
+ * @brief Check if a tokenized payload can start a new call
+ *
+ * Same as msg_is_initial, but before the message has any attribute.
+ *
+ * @see sip_method_is_initial
+ */
+static int
+sip_tokens_initial(const sip_tokens_t *tokens)
+{
+    char method[32];
+
+    // Responses have their status as method
+    if (tokens->start.len > 8 && !strncmp(tokens->start.value, "SIP/2.0 ", 8)) return 0;
+
+    // Requests method is in CSeq header
+    if (sip_tokens_cseq_method(tokens, method, sizeof(method)) != 0) return 1;
+    return sip_method_is_initial(method);
+}
+
+sip_msg_t *
+sip_load_packet(const sip_packet_t *pkt, const char *payload, int len)
+{
+    sip_msg_t *msg;
+    sip_call_t *call;
+    sip_tokens_t tokens;
+    char *callid;
+
+    // Skip messages if capture is disabled
+    // (capture file loaders are paused by their reader instead)
+    if (!store && !is_option_enabled("sip.capture")) {
+        return NULL;
+    }
+
+    // Get the Call-ID of this message
+    sip_tokenize(payload, len, &tokens);
+    if (!(callid = sip_tokens_callid(&tokens))) {
+        return NULL;
+    }
+
+    // Find the call for this msg
+    // Multiple parser threads can be loading messages at the same time,
+    // but all messages of a dialog are parsed by the same thread, so the
+    // global lock is only needed to search and index the call
+    if (!store) pthread_mutex_lock(&calls_lock);
+    if ((call = call_find_by_callid(callid))) {
+        if (!store) pthread_mutex_unlock(&calls_lock);
+        msg = sip_msg_create(call, pkt, (pkt->offset) ? NULL : payload, len);
+    } else {
+        // Only create a new call if the first msg
+        // is a request message in the following gorup
+        // (stores are checked once merged)
+        if (!store && get_option_int_value("sip.ignoreincomplete")
+            && !sip_tokens_initial(&tokens)) {
+            pthread_mutex_unlock(&calls_lock);
+            free(callid);
+            return NULL;
+        }
+
+        // Create the call if not found, but only publish it with its
+        // first message, so calls without messages are never seen
+        msg = NULL;
+        if ((call = sip_call_alloc(callid))
+            && !(msg = sip_msg_create(call, pkt, (pkt->offset) ? NULL : payload, len))) {
+            sip_call_destroy(call);
+        }
+        if (msg) sip_call_publish(call);
+        if (!store) pthread_mutex_unlock(&calls_lock);
+    }
+
+    // Payloads stored in the capture file are not copied to the message
+    // (created in the call arena), they're read again when it's parsed
+    if (!msg) {
+        free(callid);
+        return NULL;
+    }
+    msg->status = sip_tokens_status(&tokens);
+    msg->method = sip_tokens_method(&tokens);
+    msg->fingerprint = sip_payload_fingerprint(payload, len);
+
+    // First message attributes are displayed in call list
+    if (!call->msgs) {
+        msg_set_attribute(msg, SIP_ATTR_CALLID, callid);
+        msg_parse_tokens(msg, &tokens);
+    }
+    free(callid);
+
+    // Add the message to the found/created call
+    // (new calls are listed with their first message)
+    call_add_message(call, msg);
+
+    // Return the loaded message
+    return msg;
+}
+
+void
+sip_store_set(sip_store_t *thread_store)
+{
+    store = thread_store;
+}
+
+/**
+ * @brief Update the dialog state machine with a new message
+ *
+ * Only INVITE dialogs have a state:
+ * INVITE -> 18x -> 2xx -> BYE, with CANCEL or final error responses
+ * releasing the dialog before it's answered. A 2xx response received
+ * after a CANCEL (before any other final response) means the INVITE
+ * was answered before the CANCEL arrived, so it answers the dialog.
+ *
+ * @param dialog Dialog state of the call
+ * @param msg SIP message added to the call
+ */
+static void
+call_dialog_update(sip_dialog_t *dialog, sip_msg_t *msg)
 {
-    sip_msg_t *msg;
+    u_int64_t ts = msg->pkt.ts;
+    int pending = dialog->state == SIP_DIALOG_SETUP || dialog->state == SIP_DIALOG_RINGING;
+
+    // Requests
+    if (!msg->status) {
+        switch (msg->method) {
+        case SIP_METHOD_INVITE:
+            if (dialog->state == SIP_DIALOG_NONE) {
+                dialog->state = SIP_DIALOG_SETUP;
+                dialog->invite_ts = ts;
+            }
+            break;
+        case SIP_METHOD_CANCEL:
+            if (pending) {
+                dialog->state = SIP_DIALOG_CANCELLED;
+                dialog->end_ts = ts;
+            }
+            break;
+        case SIP_METHOD_BYE:
+            if (pending || dialog->state == SIP_DIALOG_ANSWERED) {
+                dialog->state = SIP_DIALOG_TERMINATED;
+                dialog->end_ts = ts;
+            }
+            break;
+        default:
+            break;
+        }
+        return;
+    }
 
-    if (!(msg = malloc(sizeof(sip_msg_t)))) return NULL;
-    memset(msg, 0, sizeof(sip_msg_t));
-    msg->attrs = NULL;
-    msg->headerptr = strdup(header);
-    msg->payloadptr = strdup(payload);
-    msg->parsed = 0;
-    msg->color = -1;
-    return msg;
+    // Only INVITE responses change the dialog state
+    if (msg->method != SIP_METHOD_INVITE) return;
+
+    if (msg->status >= 180 && msg->status < 200) {
+        if (dialog->state == SIP_DIALOG_SETUP) {
+            dialog->state = SIP_DIALOG_RINGING;
+            dialog->ringing_ts = ts;
+        }
+    } else if (msg->status >= 200 && msg->status < 300) {
+        if (pending || (dialog->state == SIP_DIALOG_CANCELLED && !dialog->cause)) {
+            dialog->state = SIP_DIALOG_ANSWERED;
+            dialog->answer_ts = ts;
+            dialog->end_ts = 0;
+        }
+    } else if (msg->status >= 300) {
+        if (pending) {
+            dialog->state = (msg->status == 487) ? SIP_DIALOG_CANCELLED : SIP_DIALOG_FAILED;
+            dialog->end_ts = ts;
+            dialog->cause = msg->status;
+        } else if (dialog->state == SIP_DIALOG_CANCELLED && !dialog->cause) {
+            // Final response to a cancelled INVITE
+            dialog->cause = msg->status;
+        }
+    }
 }
 
-sip_call_t *
-sip_call_create(char *callid)
+/**
+ * @brief Format a call summary or dialog attribute
+ *
+ * @param call SIP call structure
+ * @param id Attribute id
+ * @param value Output buffer (SIP_SUMMARY_VALUE_LEN bytes)
+ * @return 0 if the attribute has a value, 1 otherwise
+ */
+static int
+call_format_attribute(sip_call_t *call, enum sip_attr_id id, char *value)
 {
-    // Initialize a new call structure
-    sip_call_t *call = malloc(sizeof(sip_call_t));
-    memset(call, 0, sizeof(sip_call_t));
-    call->attrs = NULL;
-    call->color = -1;
+    sip_call_summary_t *summary = &call->summary;
+    sip_dialog_t *dialog = &call->dialog;
+    u_int64_t span, end;
 
-    // Initialize call lock
-    pthread_mutexattr_t attr;
-    pthread_mutexattr_init(&attr);
-    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE_NP);
-    pthread_mutex_init(&call->lock, &attr);
+    switch (id) {
+    case SIP_ATTR_MSGCNT:
+        sprintf(value, "%d", summary->msgcnt);
+        return 0;
+    case SIP_ATTR_DURATION:
+        span = (summary->last - summary->first) / 1000000000;
+        sprintf(value, "%d:%02d", (int) span / 60, (int) span % 60);
+        return 0;
+    case SIP_ATTR_CALLSTATE:
+        if (dialog->state == SIP_DIALOG_NONE) return 1;
+        strcpy(value, dialog_states[dialog->state]);
+        return 0;
+    case SIP_ATTR_CONVDUR:
+        if (!dialog->answer_ts) return 1;
+        // Calls still in conversation last until their last message
+        end = (dialog->end_ts) ? dialog->end_ts : summary->last;
+        span = (end - dialog->answer_ts) / 1000000000;
+        sprintf(value, "%d:%02d", (int) span / 60, (int) span % 60);
+        return 0;
+    case SIP_ATTR_PDD:
+    case SIP_ATTR_SETUPTIME:
+        end = (id == SIP_ATTR_PDD) ? dialog->ringing_ts : dialog->answer_ts;
+        if (!end) return 1;
+        span = (end - dialog->invite_ts) / 1000000;
+        sprintf(value, "%d.%03d", (int) (span / 1000), (int) (span % 1000));
+        return 0;
+    case SIP_ATTR_CAUSE:
+        if (dialog->cause) {
+            sprintf(value, "%d", dialog->cause);
+        } else if (dialog->state == SIP_DIALOG_TERMINATED) {
+            strcpy(value, "BYE");
+        } else if (dialog->state == SIP_DIALOG_CANCELLED) {
+            strcpy(value, "CANCEL");
+        } else {
+            return 1;
+        }
+        return 0;
+    default:
+        return 1;
+    }
+}
 
-    //@todo Add the call to the end of the list.
-    //@todo This should be improved
-    pthread_mutex_lock(&calls_lock);
-    sip_call_t *cur, *prev;
-    if (!calls) {
-        calls = call;
-    } else {
-        for (cur = calls; cur; prev = cur, cur = cur->next)
-            ;
-        prev->next = call;
-        call->prev = prev;
+/**
+ * @brief Format all summary and dialog attributes of a call
+ *
+ * Values are formatted in place, so readers without the call lock
+ * always find a null terminated value.
+ *
+ * @param call SIP call structure
+ */
+static void
+call_summary_format(sip_call_t *call)
+{
+    char value[SIP_SUMMARY_VALUE_LEN];
+    int i;
+
+    for (i = 0; i < SIP_SUMMARY_ATTRS; i++) {
+        if (call_format_attribute(call, SIP_ATTR_MSGCNT + i, value) != 0) *value = '\0';
+        strcpy(call->summary.values[i], value);
     }
-    pthread_mutex_unlock(&calls_lock);
-    return call;
 }
 
-char *
-sip_get_callid(const char* payload)
+/**
+ * @brief Add a message to the call summary
+ *
+ * Call lock must be held by the caller. The message is compared with
+ * the current last message of the call to detect retransmissions, so
+ * this must be called before updating it.
+ *
+ * @param call SIP call structure
+ * @param msg SIP message added to the call
+ */
+static void
+call_summary_add(sip_call_t *call, sip_msg_t *msg)
 {
-    char *body = strdup(payload);
-    char *pch, *callid = NULL;
-    char value[256];
+    sip_call_summary_t *summary = &call->summary;
+    sip_msg_t *prev = call->msgs_last;
 
-    for (pch = strtok(body, "\n"); pch; pch = strtok(NULL, "\n")) {
-        // fix last ngrep line character
-        if (pch[strlen(pch) - 1] == '.') pch[strlen(pch) - 1] = '\0';
+    // Messages with the same payload as the previous one are retransmissions
+    msg->retrans = (prev && prev->fingerprint == msg->fingerprint) ? prev->retrans + 1 : 0;
 
-        if (!strncasecmp(pch, "Call-ID", 7)) {
-            if (sscanf(pch, "Call-ID: %[^@\n]", value) == 1) {
-                callid = strdup(value);
-            }
-        }
+    if (!summary->msgcnt++ || msg->pkt.ts < summary->first) summary->first = msg->pkt.ts;
+    if (msg->pkt.ts > summary->last) summary->last = msg->pkt.ts;
+    if (msg->status && msg->pkt.ts >= summary->status_ts) {
+        summary->status = msg->status;
+        summary->status_ts = msg->pkt.ts;
     }
-    free(body);
-    return callid;
+    summary->bytes += msg->len;
+
+    call_dialog_update(&call->dialog, msg);
+    call_summary_format(call);
 }
 
-sip_msg_t *
-sip_load_message(const char *header, const char *payload)
+/**
+ * @brief Rebuild the call summary and last message from the messages list
+ *
+ * Only required when messages are merged or removed.
+ *
+ * @param call SIP call structure
+ */
+static void
+call_summary_update(sip_call_t *call)
 {
     sip_msg_t *msg;
-    sip_call_t *call;
-    char *callid;
 
-    // Skip messages if capture is disabled
-    if (!is_option_enabled("sip.capture")) {
-        return NULL;
+    memset(&call->summary, 0, sizeof(sip_call_summary_t));
+    memset(&call->dialog, 0, sizeof(sip_dialog_t));
+    call->msgs_last = NULL;
+    for (msg = call->msgs; msg; msg = msg->next) {
+        call_summary_add(call, msg);
+        call->msgs_last = msg;
     }
+}
 
-    // Get the Call-ID of this message
-    if (!(callid = sip_get_callid(payload))) {
-        return NULL;
-    }
+/**
+ * @brief Compare messages by timestamp and capture file offset
+ *
+ * Messages with the same timestamp are sorted by their position in the
+ * capture file. Messages without offset (reassembled payloads) are
+ * considered equal.
+ */
+static int
+sip_msg_cmp(const sip_msg_t *a, const sip_msg_t *b)
+{
+    if (a->pkt.ts != b->pkt.ts)
+        return a->pkt.ts < b->pkt.ts ? -1 : 1;
+    if (a->pkt.offset && b->pkt.offset && a->pkt.offset != b->pkt.offset)
+        return a->pkt.offset < b->pkt.offset ? -1 : 1;
+    return 0;
+}
 
-    // Create a new message from this data
-    if (!(msg = sip_msg_create(header, payload))) {
-        return NULL;
+/**
+ * @brief Merge two message lists ordered by timestamp
+ *
+ * Messages with the same timestamp are ordered by file offset, or keep
+ * the first list order if they have none.
+ */
+static sip_msg_t *
+sip_merge_msgs(sip_msg_t *first, sip_msg_t *second)
+{
+    sip_msg_t *head = NULL, **tail = &head;
+
+    while (first && second) {
+        if (sip_msg_cmp(second, first) < 0) {
+            *tail = second;
+            second = second->next;
+        } else {
+            *tail = first;
+            first = first->next;
+        }
+        tail = &(*tail)->next;
     }
+    *tail = first ? first : second;
+    return head;
+}
 
-    // Find the call for this msg
-    if (!(call = call_find_by_callid(callid))) {
+/**
+ * @brief Merged call and its position before sorting
+ */
+struct sip_merged_call
+{
+    sip_call_t *call;
+    int order;
+};
 
-        // Only create a new call if the first msg
-        // is a request message in the following gorup
-        if (get_option_int_value("sip.ignoreincomplete")) {
-            const char *method = msg_get_attribute(msg_parse(msg), SIP_ATTR_METHOD);
-            if (method && strncasecmp(method, "INVITE", 6)
-                && strncasecmp(method, "REGISTER", 8) && strncasecmp(method, "SUBSCRIBE", 9)
-                && strncasecmp(method, "OPTIONS", 7) && strncasecmp(method, "PUBLISH", 7)
-                && strncasecmp(method, "MESSAGE", 7) && strncasecmp(method, "NOTIFY", 6)){
-                //@todo sip_msg_destroy();
-                return NULL;
+/**
+ * @brief Compare merged calls by their first message timestamp
+ */
+static int
+sip_merged_call_cmp(const void *a, const void *b)
+{
+    const struct sip_merged_call *ma = a, *mb = b;
+    int ret;
+
+    if ((ret = sip_msg_cmp(ma->call->msgs, mb->call->msgs)) != 0)
+        return ret;
+    return ma->order - mb->order;
+}
+
+void
+sip_store_merge(sip_store_t *stores, int count)
+{
+    struct sip_merged_call *merged;
+    sip_call_index_t joined;
+    sip_call_t *call, *next, *found;
+    sip_msg_t *msg;
+    unsigned int slot;
+    int i, total = 0, ncalls = 0;
+
+    // Calls being merged indexed by Call-ID
+    memset(&joined, 0, sizeof(sip_call_index_t));
+    for (i = 0; i < count; i++) {
+        for (call = stores[i].first; call; call = call->next)
+            total++;
+    }
+    for (joined.size = 16; joined.size < (unsigned int) total * 2; joined.size <<= 1)
+        ;
+    if (!(joined.table = calloc(joined.size, sizeof(sip_call_t *)))) return;
+    if (!(merged = malloc(sizeof(struct sip_merged_call) * (total + 1)))) {
+        free(joined.table);
+        return;
+    }
+
+    // Join calls with the same Call-ID
+    for (i = 0; i < count; i++) {
+        for (call = stores[i].first; call; call = next) {
+            next = call->next;
+            call->next = call->prev = NULL;
+            slot = sip_index_slot(&joined, SIP_ATTR_CALLID, call->callid);
+
+            if (joined.table[slot]) {
+                // Move all messages to the first found call
+                found = joined.table[slot];
+                for (msg = call->msgs; msg; msg = msg->next)
+                    msg->call = found;
+                found->msgs = sip_merge_msgs(found->msgs, call->msgs);
+                call_summary_update(found);
+                arena_join(&found->arena, &call->arena);
+                sip_call_destroy(call);
+            } else {
+                joined.table[slot] = call;
+                merged[ncalls].call = call;
+                merged[ncalls].order = ncalls;
+                ncalls++;
+            }
+        }
+        stores[i].first = stores[i].last = NULL;
+        sip_index_free(&stores[i].index);
+    }
+    sip_index_free(&joined);
+
+    for (i = 0; i < ncalls; i++) {
+        call = merged[i].call;
+
+        // Append messages to the call merged in a previous run
+        pthread_mutex_lock(&calls_lock);
+        found = sip_index_find(&calls_index, SIP_ATTR_CALLID, call->callid);
+        pthread_mutex_unlock(&calls_lock);
+        if (found) {
+            pthread_mutex_lock(&found->lock);
+            found->msgs_last->next = call->msgs;
+            for (msg = call->msgs; msg; msg = msg->next) {
+                msg->call = found;
+                call_summary_add(found, msg);
+                found->msgs_last = msg;
             }
+            arena_join(&found->arena, &call->arena);
+            pthread_mutex_unlock(&found->lock);
+            __atomic_add_fetch(&msgs_generation, 1, __ATOMIC_RELEASE);
+            call->msgs = NULL;
         }
 
-        // Create the call if not found
-        if (!(call = sip_call_create(callid))) {
-            //@todo sip_msg_destroy();
-            return NULL;
+        // Remove messages received before the first request of the dialog
+        // (their memory is released with the call arena)
+        while (get_option_int_value("sip.ignoreincomplete") && call->msgs
+            && !msg_is_initial(call->msgs)) {
+            msg = call->msgs;
+            call->msgs = msg->next;
+            // Call-ID is stored in the first message
+            if (call->msgs && !sip_attr_get(&call->msgs->attrs, SIP_ATTR_CALLID))
+                msg_set_attribute(call->msgs, SIP_ATTR_CALLID, sip_attr_get(&msg->attrs, SIP_ATTR_CALLID));
+            call_summary_update(call);
+        }
+        if (!call->msgs) {
+            sip_call_destroy(call);
+            merged[i--] = merged[--ncalls];
+            continue;
         }
+        if (!msg_get_attribute(call->msgs, SIP_ATTR_METHOD)) msg_parse(call->msgs);
+    }
+
+    // Add new calls at the end of global list
+    qsort(merged, ncalls, sizeof(struct sip_merged_call), sip_merged_call_cmp);
+    pthread_mutex_lock(&calls_lock);
+    for (i = 0; i < ncalls; i++) {
+        call = merged[i].call;
+        call->prev = calls_last;
+        if (calls_last) calls_last->next = call;
+        else calls = call;
+        calls_last = call;
+        sip_call_index(call);
     }
+    pthread_mutex_unlock(&calls_lock);
+    free(merged);
+}
 
-    // Set message callid
-    msg_set_attribute(msg, SIP_ATTR_CALLID, callid);
+void
+sip_store_clear(sip_store_t *discard)
+{
+    sip_call_t *call, *next;
 
-    // Add the message to the found/created call
-    call_add_message(call, msg);
+    // Messages are released with their call arena
+    for (call = discard->first; call; call = next) {
+        next = call->next;
+        sip_call_destroy(call);
+    }
+    discard->first = discard->last = NULL;
+    sip_index_free(&discard->index);
+}
 
-    // Return the loaded message
-    return msg;
+int
+sip_parse_header(const char *header, sip_packet_t *pkt)
+{
+    struct tm when = {
+        0 };
+    char proto, ipfrom[64], ipto[64];
+    char *port;
+    int usec;
+    time_t timet;
+
+    // Sanity check
+    if (!header || !pkt) return 1;
+
+    memset(pkt, 0, sizeof(sip_packet_t));
+    if (sscanf(header, "%c %d/%d/%d %d:%d:%d.%d %63s -> %63s", &proto, &when.tm_year,
+            &when.tm_mon, &when.tm_mday, &when.tm_hour, &when.tm_min, &when.tm_sec, &usec,
+            ipfrom, ipto) != 10) {
+        return 1;
+    }
+
+    // Fix some time data
+    when.tm_isdst = -1; // Let mktime guess daylight saving time
+    when.tm_year -= 1900; // C99 Years since 1900
+    when.tm_mon--; // C99 0-11
+    timet = mktime(&when);
+    pkt->ts = (u_int64_t) timet * 1000000000 + (u_int64_t) usec * 1000;
+    pkt->transport = (proto == 'T') ? SIP_TRANSPORT_TCP : SIP_TRANSPORT_UDP;
+
+    // Split address and port (port goes after the last colon)
+    if (!(port = strrchr(ipfrom, ':'))) return 1;
+    *port++ = '\0';
+    pkt->sport = atoi(port);
+    if (!(port = strrchr(ipto, ':'))) return 1;
+    *port++ = '\0';
+    pkt->dport = atoi(port);
+
+    // Convert addresses to binary
+    if (inet_pton(AF_INET, ipfrom, &pkt->src.v4) == 1
+        && inet_pton(AF_INET, ipto, &pkt->dst.v4) == 1) {
+        pkt->family = AF_INET;
+    } else if (inet_pton(AF_INET6, ipfrom, &pkt->src.v6) == 1
+        && inet_pton(AF_INET6, ipto, &pkt->dst.v6) == 1) {
+        pkt->family = AF_INET6;
+    } else {
+        return 1;
+    }
+    return 0;
 }
 
 int
@@ -252,8 +1423,9 @@ sip_check_call_ignore(sip_call_t *call)
     int i;
     char filter_option[80];
     const char *filter;
-    // Check if an ignore option exists
+    // Check if an ignore option exists (only get values of ignored attributes)
     for (i = 0; i < sizeof(attrs) / sizeof(*attrs); i++) {
+        if (!has_ignored_values(attrs[i].name)) continue;
         if (is_ignored_value(attrs[i].name, call_get_attribute(call, attrs[i].id))) {
             return 1;
         }
@@ -295,13 +1467,9 @@ sip_check_call_ignore(sip_call_t *call)
 sip_attr_hdr_t *
 sip_attr_get_header(enum sip_attr_id id)
 {
-    int i;
-    for (i = 0; i < sizeof(attrs) / sizeof(*attrs); i++) {
-        if (id == attrs[i].id) {
-            return &attrs[i];
-        }
-    }
-    return NULL;
+    pthread_once(&attrs_once, sip_attr_index_headers);
+    if (id <= 0 || id >= SIP_ATTR_COUNT) return NULL;
+    return attrs_index[id];
 }
 
 const char *
@@ -339,106 +1507,125 @@ sip_attr_from_name(const char *name)
 }
 
 void
-sip_attr_set(sip_attr_t **list, enum sip_attr_id id, const char *value)
+sip_attr_set(arena_t *arena, sip_attr_t **list, enum sip_attr_id id, const char *value)
 {
-    sip_attr_t *attr;
+    sip_attr_t *attrs;
+    const char *old;
 
-    // If attribute already exists change its value
-    for (attr = *list; attr; attr = attr->next) {
-        if (id == attr->hdr->id) {
-            attr->value = strdup(value);
-            return;
-        }
+    if (!value || id <= 0 || id >= SIP_ATTR_COUNT) return;
+
+    // Allocate attributes with the first value (publish them once empty)
+    if (!(attrs = *list)) {
+        attrs = (arena) ? arena_alloc(arena, sizeof(sip_attr_t)) : malloc(sizeof(sip_attr_t));
+        if (!attrs) return;
+        memset(attrs, 0, sizeof(sip_attr_t));
+        __atomic_store_n(list, attrs, __ATOMIC_RELEASE);
+    }
+
+    // Interned values are shared, just point to them
+    if (sip_attr_is_interned(id)) {
+        if ((value = intern_string(value)))
+            __atomic_store_n(&attrs->value[id], value, __ATOMIC_RELEASE);
+        return;
     }
 
-    // Otherwise add a new attribute
-    if (!(attr = malloc(sizeof(sip_attr_t)))) return;
-    attr->hdr = sip_attr_get_header(id);
-    attr->value = strdup(value);
-    attr->next = *list;
-    *list = attr;
+    // Keep current value if it doesn't change
+    if ((old = attrs->value[id]) && !strcmp(old, value)) return;
+    if (arena) {
+        // Replaced values are released with the arena, they may still be read
+        if ((value = arena_strndup(arena, value, strlen(value))))
+            __atomic_store_n(&attrs->value[id], value, __ATOMIC_RELEASE);
+    } else {
+        attrs->value[id] = strdup(value);
+        free((char *) old);
+    }
 }
 
 const char *
-sip_attr_get(sip_attr_t *list, enum sip_attr_id id)
+sip_attr_get(sip_attr_t **list, enum sip_attr_id id)
 {
-    sip_attr_t *attr;
-    for (attr = list; attr; attr = attr->next) {
-        if (id == attr->hdr->id) {
-            return attr->value;
-        }
-    }
-    return NULL;
+    sip_attr_t *attrs;
+
+    if (id <= 0 || id >= SIP_ATTR_COUNT) return NULL;
+    if (!(attrs = __atomic_load_n(list, __ATOMIC_ACQUIRE))) return NULL;
+    return __atomic_load_n(&attrs->value[id], __ATOMIC_ACQUIRE);
 }
 
 void
 call_add_message(sip_call_t *call, sip_msg_t *msg)
 {
-    sip_msg_t *cur, *prev;
+    int first;
 
     pthread_mutex_lock(&call->lock);
     // Set the message owner
     msg->call = call;
-    // XXX Put this msg at the end of the msg list
+    // Put this msg at the end of the msg list
     // Order is important!!!
-    if (!call->msgs) {
-        call->msgs = msg_parse(msg);
+    if ((first = !call->msgs)) {
+        call->msgs = msg;
     } else {
-        for (cur = call->msgs; cur; prev = cur, cur = cur->next)
-            ;
-        prev->next = msg;
+        call->msgs_last->next = msg;
     }
+    call_summary_add(call, msg);
+    call->msgs_last = msg;
     pthread_mutex_unlock(&call->lock);
+
+    // Partial calls are not visible until the store is merged
+    if (!store) __atomic_add_fetch(&msgs_generation, 1, __ATOMIC_RELEASE);
+
+    // Global calls are listed once their first message is known
+    if (first && !store) {
+        pthread_mutex_lock(&calls_lock);
+        call->prev = calls_last;
+        if (calls_last) calls_last->next = call;
+        else calls = call;
+        calls_last = call;
+        if (msg_get_attribute(msg, SIP_ATTR_XCALLID))
+            sip_index_add(&xcalls_index, SIP_ATTR_XCALLID, call);
+        pthread_mutex_unlock(&calls_lock);
+    }
 }
 
 sip_call_t *
 call_find_by_callid(const char *callid)
 {
-    const char *cur_callid;
-    sip_call_t *cur = calls;
-    // XXX LOCKING
+    sip_call_t *call;
 
-    while (cur) {
-        cur_callid = call_get_attribute(cur, SIP_ATTR_CALLID);
-        if (cur_callid && !strcmp(cur_callid, callid)) {
-            return cur;
-        }
-        cur = cur->next;
-    }
-    return NULL;
+    if (store) return sip_index_find(&store->index, SIP_ATTR_CALLID, callid);
+
+    pthread_mutex_lock(&calls_lock);
+    call = sip_index_find(&calls_index, SIP_ATTR_CALLID, callid);
+    pthread_mutex_unlock(&calls_lock);
+    return call;
 }
 
 sip_call_t *
 call_find_by_xcallid(const char *xcallid)
 {
-    const char *cur_xcallid;
-    sip_call_t *cur = calls;
+    sip_call_t *call;
 
-    while (cur) {
-        cur_xcallid = call_get_attribute(cur, SIP_ATTR_XCALLID);
-        if (cur_xcallid && !strcmp(cur_xcallid, xcallid)) {
-            return cur;
-        }
-        cur = cur->next;
-    }
-    return NULL;
+    pthread_mutex_lock(&calls_lock);
+    call = sip_index_find(&xcalls_index, SIP_ATTR_XCALLID, xcallid);
+    pthread_mutex_unlock(&calls_lock);
+    return call;
 }
 
-//@todo replace this for Msgcnt attribute
 int
 call_msg_count(sip_call_t *call)
 {
-    int msgcnt = 0;
+    int msgcnt;
     pthread_mutex_lock(&call->lock);
-    sip_msg_t *msg = call->msgs;
-    while (msg) {
-        msgcnt++;
-        msg = msg->next;
-    }
+    msgcnt = call->summary.msgcnt;
     pthread_mutex_unlock(&call->lock);
     return msgcnt;
 }
 
+unsigned int
+sip_msgs_generation()
+{
+    return __atomic_load_n(&msgs_generation, __ATOMIC_ACQUIRE);
+}
+
 sip_call_t *
 call_get_xcall(sip_call_t *call)
 {
@@ -455,7 +1642,7 @@ call_get_next_msg(sip_call_t *call, sip_msg_t *msg)
     sip_msg_t *ret;
     pthread_mutex_lock(&call->lock);
     if (msg == NULL) {
-        ret = call->msgs;
+        ret = msg_parse(call->msgs);
     } else {
         ret = msg_parse(msg->next);
     }
@@ -499,6 +1686,12 @@ call_get_next(sip_call_t *cur)
     return next;
 }
 
+sip_call_t *
+sip_calls_next(sip_call_t *cur)
+{
+    return (cur) ? cur->next : calls;
+}
+
 sip_call_t *
 call_get_prev(sip_call_t *cur)
 {
@@ -519,27 +1712,36 @@ call_get_prev(sip_call_t *cur)
 void
 call_set_attribute(sip_call_t *call, enum sip_attr_id id, const char *value)
 {
-    sip_attr_set(&call->attrs, id, value);
+    pthread_mutex_lock(&call->lock);
+    sip_attr_set(&call->arena, &call->attrs, id, value);
+    pthread_mutex_unlock(&call->lock);
 }
 
 const char *
 call_get_attribute(sip_call_t *call, enum sip_attr_id id)
 {
-    char value[80];
-    if (id == SIP_ATTR_MSGCNT) {
-        // FIXME REALLY
-        sprintf(value, "%d", call_msg_count(call));
-        return strdup(value);
-    }
+    const char *value;
+
+    // First message attributes are known without parsing its payload
     if (id == SIP_ATTR_STARTING) {
-        return msg_get_attribute(call_get_next_msg(call, NULL), SIP_ATTR_METHOD);
+        return msg_get_attribute(call->msgs, SIP_ATTR_METHOD);
+    }
+    if (id < SIP_ATTR_MSGCNT) {
+        return msg_get_attribute(call->msgs, id);
     }
-    return msg_get_attribute(call_get_next_msg(call, NULL), id);
+
+    // Summary and dialog values are formatted when messages are added
+    if (id >= SIP_ATTR_COUNT) return NULL;
+    value = call->summary.values[id - SIP_ATTR_MSGCNT];
+    return (*value) ? value : NULL;
 }
 
 sip_msg_t *
 msg_parse(sip_msg_t *msg)
 {
+#ifdef WITH_LIBPCAP
+    char *payload;
+#endif
 
     // Nothing to parse
     if (!msg) return NULL;
@@ -547,15 +1749,17 @@ msg_parse(sip_msg_t *msg)
     // Message already parsed
     if (msg->parsed) return msg;
 
-    // Parse message header
-    if (msg_parse_header(msg, msg->headerptr) != 0) return NULL;
+#ifdef WITH_LIBPCAP
+    // Read the payload from the capture file
+    if (!msg->payload) {
+        if (!(payload = msg_alloc(msg, msg->len + 1))) return NULL;
+        if (pcapindex_payload(&msg->pkt, payload, msg->len) != 0) return NULL;
+        msg->payload = payload;
+    }
+#endif
 
     // Parse message payload
-    if (msg_parse_payload(msg, msg->payloadptr) != 0) return NULL;
-
-    // Free message pointers
-    //free(msg->headerptr);
-    free(msg->payloadptr);
+    if (msg_parse_payload(msg) != 0) return NULL;
 
     // Mark as parsed
     msg->parsed = 1;
@@ -564,139 +1768,169 @@ msg_parse(sip_msg_t *msg)
 }
 
 int
-msg_parse_header(sip_msg_t *msg, const char *header)
+msg_parse_payload(sip_msg_t *msg)
 {
-    struct tm when = {
-        0 };
-    char time[20], ipfrom[22], ipto[22];
-    time_t timet;
+    sip_tokens_t tokens;
+    char *line, *eol, *end;
+    uint16_t *lines16;
+    uint32_t *lines32;
+    int len, count = 0;
 
     // Sanity check
-    if (!msg || !header) return 1;
-
-    if (sscanf(header, "U %d/%d/%d %d:%d:%d.%d %s -> %s", &when.tm_year, &when.tm_mon,
-            &when.tm_mday, &when.tm_hour, &when.tm_min, &when.tm_sec, (int*) &msg->ts.tv_usec,
-            ipfrom, ipto)) {
-
-        // Fix some time data
-        when.tm_isdst = 1; // Daylight saving time flag
-        when.tm_year -= 1900; // C99 Years since 1900
-        when.tm_mon--; // C99 0-11
-        timet = mktime(&when);
-        msg->ts.tv_sec = (long int) timet;
-
-        // Convert to string
-        strftime(time, 20, "%H:%M:%S", localtime(&timet));
-        sprintf(time + strlen(time), ".%06d", (int) msg->ts.tv_usec);
-
-        msg_set_attribute(msg, SIP_ATTR_TIME, time);
-        msg_set_attribute(msg, SIP_ATTR_SRC, ipfrom);
-        msg_set_attribute(msg, SIP_ATTR_DST, ipto);
-
-        return 0;
+    if (!msg || !msg->payload) return 1;
+    end = msg->payload + strlen(msg->payload);
+
+    // Set message attributes from its headers. Tokenizer only walks the
+    // headers and needs the raw payload, so it's done before splitting
+    sip_tokenize(msg->payload, end - msg->payload, &tokens);
+    msg_parse_tokens(msg, &tokens);
+
+    // Payloads that can not be read again from the capture file are
+    // kept as they were received (the split changes their bytes)
+    if (!msg->pkt.offset) {
+        if (!(msg->raw = msg_alloc(msg, msg->len + 1))) return 1;
+        memcpy(msg->raw, msg->payload, msg->len + 1);
     }
-    return 1;
-}
 
-int
-msg_parse_payload(sip_msg_t *msg, const char *payload)
-{
-    char *body = strdup(payload);
-    char * pch;
-    char value[256];
-    char rest[256];
-    int irest;
+    // Count payload lines to allocate the lines index. This pass only
+    // looks for line endings (memchr) so the index can be allocated
+    // with its final size in the call arena, without temporal buffers
+    for (line = msg->payload; line < end; line = eol + 1) {
+        if (!(eol = memchr(line, '\n', end - line))) eol = end;
+        if (eol != line) count++;
+    }
+    if (!count) return 0;
+    if (!(msg->lines = msg_alloc(msg, count * ((msg->len > UINT16_MAX) ? 4 : 2)))) return 1;
+    lines16 = msg->lines;
+    lines32 = msg->lines;
 
-    // Sanity check
-    if (!msg || !payload) return 1;
+    // Split the payload in place, storing where each line starts
+    for (line = msg->payload; line < end; line = eol + 1) {
+        if (!(eol = memchr(line, '\n', end - line))) eol = end;
+        if (!(len = eol - line)) continue;
 
-    for (pch = strtok(body, "\n"); pch; pch = strtok(NULL, "\n")) {
         // fix last ngrep line character
-        if (pch[strlen(pch) - 1] == '.') pch[strlen(pch) - 1] = '\0';
-
-        // Copy the payload line by line (easier to process by the UI)
-        msg->payload[msg->plines++] = strdup(pch);
+        if (line[len - 1] == '.') line[len - 1] = '\0';
+        *eol = '\0';
 
-        if (!strlen(pch)) continue;
-
-        if (sscanf(pch, "X-Call-ID: %[^@\t\n\r]", value) == 1) {
-            msg_set_attribute(msg, SIP_ATTR_XCALLID, value);
-            continue;
-        }
-        if (sscanf(pch, "X-CID: %[^@\t\n\r]", value) == 1) {
-            msg_set_attribute(msg, SIP_ATTR_XCALLID, value);
-            continue;
-        }
-        if (sscanf(pch, "SIP/2.0 %[^\t\n\r]", value)) {
-            if (!msg_get_attribute(msg, SIP_ATTR_METHOD)) {
-                msg_set_attribute(msg, SIP_ATTR_METHOD, value);
-            }
-            continue;
-        }
-        if (sscanf(pch, "CSeq: %s %[^\t\n\r]", rest, value)) {
-            if (!msg_get_attribute(msg, SIP_ATTR_METHOD)) {
-                // ACK Messages are not considered requests
-                if (strcasecmp(value, "ACK")) msg_set_attribute(msg, SIP_ATTR_REQUEST, "1");
-                msg_set_attribute(msg, SIP_ATTR_METHOD, value);
-            }
-            msg_set_attribute(msg, SIP_ATTR_CSEQ, rest);
-            continue;
-        }
-        if (sscanf(pch, "From: %[^:]:%[^\t\n\r>;]", rest, value)) {
-            msg_set_attribute(msg, SIP_ATTR_SIPFROM, value);
-            continue;
-        }
-        if (sscanf(pch, "To: %[^:]:%[^\t\n\r>;]", rest, value)) {
-            msg_set_attribute(msg, SIP_ATTR_SIPTO, value);
-            continue;
-        }
-        if (!strncasecmp(pch, "Content-Type: application/sdp", 29)) {
-            msg_set_attribute(msg, SIP_ATTR_SDP, "1");
-            continue;
+        if (msg->len > UINT16_MAX) {
+            lines32[msg->plines++] = line - msg->payload;
+        } else {
+            lines16[msg->plines++] = line - msg->payload;
         }
     }
-    free(body);
     return 0;
 }
 
+const char *
+msg_get_line(sip_msg_t *msg, int line)
+{
+    if (!msg->lines || line < 0 || line >= msg->plines) return NULL;
+    if (msg->len > UINT16_MAX) return msg->payload + ((uint32_t *) msg->lines)[line];
+    return msg->payload + ((uint16_t *) msg->lines)[line];
+}
+
 void
 msg_set_attribute(sip_msg_t *msg, enum sip_attr_id id, const char *value)
 {
-    sip_attr_set(&msg->attrs, id, value);
+    pthread_mutex_lock(&msg->call->lock);
+    sip_attr_set(&msg->call->arena, &msg->attrs, id, value);
+    pthread_mutex_unlock(&msg->call->lock);
 }
 
-const char *
-msg_get_attribute(sip_msg_t *msg, enum sip_attr_id id)
+/**
+ * @brief Format a packet address and port
+ *
+ * @param family Address family
+ * @param addr Binary address
+ * @param port Port in host byte order
+ * @param out Output buffer (at least INET6_ADDRSTRLEN + 7 bytes)
+ */
+static void
+msg_format_address(int family, const void *addr, u_int16_t port, char *out)
 {
-    if (!msg) return NULL;
-    return sip_attr_get(msg->attrs, id);
+    if (!inet_ntop(family, addr, out, INET6_ADDRSTRLEN)) {
+        strcpy(out, "?");
+    }
+    sprintf(out + strlen(out), ":%u", port);
 }
 
-int
-msg_is_retrans(sip_msg_t *msg) {
-    sip_msg_t *prev = NULL;
-    int i;
+/**
+ * @brief Format a packet attribute and store it in the message
+ *
+ * Time, source and destination are only converted to text the
+ * first time someone requests them.
+ *
+ * @param msg SIP message structure
+ * @param id Attribute id (SIP_ATTR_TIME, SIP_ATTR_SRC or SIP_ATTR_DST)
+ * @return Attribute value
+ */
+static const char *
+msg_format_attribute(sip_msg_t *msg, enum sip_attr_id id)
+{
+    char value[INET6_ADDRSTRLEN + 7];
+    const char *ret;
+    struct tm when;
+    time_t timet;
 
-    // Sanity check
-    if (!msg || !msg->call) return 0;
+    switch (id) {
+    case SIP_ATTR_TIME:
+        timet = (time_t) (msg->pkt.ts / 1000000000);
+        localtime_r(&timet, &when);
+        strftime(value, sizeof(value), "%H:%M:%S", &when);
+        sprintf(value + strlen(value), ".%06d", (int) (msg->pkt.ts % 1000000000 / 1000));
+        break;
+    case SIP_ATTR_SRC:
+        msg_format_address(msg->pkt.family, &msg->pkt.src, msg->pkt.sport, value);
+        break;
+    case SIP_ATTR_DST:
+        msg_format_address(msg->pkt.family, &msg->pkt.dst, msg->pkt.dport, value);
+        break;
+    default:
+        return NULL;
+    }
+
+    // Store the formatted value, another thread may be doing the same
+    if (msg->call) pthread_mutex_lock(&msg->call->lock);
+    if (!(ret = sip_attr_get(&msg->attrs, id))) {
+        msg_set_attribute(msg, id, value);
+        ret = sip_attr_get(&msg->attrs, id);
+    }
+    if (msg->call) pthread_mutex_unlock(&msg->call->lock);
+    return ret;
+}
 
-    // Get previous message
-    prev = call_get_prev_msg(msg->call, msg);
+const char *
+msg_get_attribute(sip_msg_t *msg, enum sip_attr_id id)
+{
+    const char *value;
 
-    // No previous message, this can not be a retransmission
-    if (!prev) return 0;
+    if (!msg) return NULL;
+    if ((value = sip_attr_get(&msg->attrs, id))) return value;
+    // Only the first message of a call stores its Call-ID
+    if (id == SIP_ATTR_CALLID && msg->call && msg->call->msgs && msg->call->msgs != msg)
+        return sip_attr_get(&msg->call->msgs->attrs, id);
+    return msg_format_attribute(msg, id);
+}
 
-    // Not even the same lines in playload
-    if (msg->plines != prev->plines) return 0;
+const char *
+msg_get_header(sip_msg_t *msg, char *out)
+{
+    char date[20], from[INET6_ADDRSTRLEN + 7], to[INET6_ADDRSTRLEN + 7];
+    struct tm when;
+    time_t timet;
 
-    // Check if they have the same payload
-    for (i=0; i < msg->plines; i++) {
-        // If any line of payload is different, this is not a retrans
-        if (strcasecmp(msg->payload[i], prev->payload[i])) {
-            return 0;
-        }
-    }
+    timet = (time_t) (msg->pkt.ts / 1000000000);
+    localtime_r(&timet, &when);
+    strftime(date, sizeof(date), "%Y/%m/%d %T", &when);
+    msg_format_address(msg->pkt.family, &msg->pkt.src, msg->pkt.sport, from);
+    msg_format_address(msg->pkt.family, &msg->pkt.dst, msg->pkt.dport, to);
+    sprintf(out, "%c %s.%06d %s -> %s", (msg->pkt.transport == SIP_TRANSPORT_TCP) ? 'T' : 'U',
+        date, (int) (msg->pkt.ts % 1000000000 / 1000), from, to);
+    return out;
+}
 
-    // All check passed, this package is equal to its previous
-    return 1;
+int
+msg_is_retrans(sip_msg_t *msg) {
+    return msg && msg->retrans > 0;
 }
@@ -33,12 +33,20 @@
 #define __SNGREP_SIP_H
 
 #include <sys/time.h>
+#include <sys/types.h>
+#include <netinet/in.h>
 #include <pthread.h>
+#include "arena.h"
 
 /* Some very used macros */
 #define CALLID(msg) msg_get_attribute(msg, SIP_ATTR_CALLID)
 #define SRC(msg) msg_get_attribute(msg, SIP_ATTR_SRC)
 #define DST(msg) msg_get_attribute(msg, SIP_ATTR_DST)
+//! Number of call attributes formatted from the call summary
+#define SIP_SUMMARY_ATTRS (SIP_ATTR_COUNT - SIP_ATTR_MSGCNT)
+//! Size of formatted call summary attribute values
+#define SIP_SUMMARY_VALUE_LEN 24
+
 
 //! Shorter declaration of sip_call structure
 typedef struct sip_call sip_call_t;
@@ -48,6 +56,16 @@ typedef struct sip_msg sip_msg_t;
 typedef struct sip_attr_hdr sip_attr_hdr_t;
 //! Shorter declaration of sip_attr structure
 typedef struct sip_attr sip_attr_t;
+//! Shorter declaration of sip_packet structure
+typedef struct sip_packet sip_packet_t;
+//! Shorter declaration of sip_store structure
+typedef struct sip_store sip_store_t;
+//! Shorter declaration of sip_call_index structure
+typedef struct sip_call_index sip_call_index_t;
+//! Shorter declaration of sip_call_summary structure
+typedef struct sip_call_summary sip_call_summary_t;
+//! Shorter declaration of sip_dialog structure
+typedef struct sip_dialog sip_dialog_t;
 
 /**
  * @brief Available SIP Attributes
@@ -83,6 +101,101 @@ enum sip_attr_id
     SIP_ATTR_STARTING,
     //! SIP Call message counter
     SIP_ATTR_MSGCNT,
+    //! SIP Call duration (from first to last message)
+    SIP_ATTR_DURATION,
+    //! SIP Call dialog state
+    SIP_ATTR_CALLSTATE,
+    //! SIP Call conversation duration (from answer to release)
+    SIP_ATTR_CONVDUR,
+    //! SIP Call post dial delay (from INVITE to ringing)
+    SIP_ATTR_PDD,
+    //! SIP Call setup time (from INVITE to answer)
+    SIP_ATTR_SETUPTIME,
+    //! SIP Call release cause
+    SIP_ATTR_CAUSE,
+    //! Number of attribute ids
+    SIP_ATTR_COUNT,
+};
+
+/**
+ * @brief Transport protocol of a SIP message
+ */
+enum sip_transport
+{
+    //! Message received over UDP
+    SIP_TRANSPORT_UDP = 0,
+    //! Message received over TCP
+    SIP_TRANSPORT_TCP,
+};
+
+/**
+ * @brief Methods tracked by the dialog state machine
+ */
+enum sip_method_id
+{
+    //! Any other method
+    SIP_METHOD_OTHER = 0,
+    SIP_METHOD_INVITE,
+    SIP_METHOD_ACK,
+    SIP_METHOD_BYE,
+    SIP_METHOD_CANCEL,
+};
+
+/**
+ * @brief States of an INVITE dialog
+ */
+enum sip_dialog_state
+{
+    //! Not an INVITE dialog (or INVITE not seen yet)
+    SIP_DIALOG_NONE = 0,
+    //! INVITE sent, waiting for response
+    SIP_DIALOG_SETUP,
+    //! Provisional response (18x) received
+    SIP_DIALOG_RINGING,
+    //! INVITE answered with 2xx
+    SIP_DIALOG_ANSWERED,
+    //! Answered dialog released with BYE
+    SIP_DIALOG_TERMINATED,
+    //! Dialog cancelled before being answered
+    SIP_DIALOG_CANCELLED,
+    //! INVITE rejected with a final error response
+    SIP_DIALOG_FAILED,
+};
+
+/**
+ * @brief Packet information of a SIP message
+ *
+ * Capture backends fill this structure with the binary data of the
+ * packet headers. Text representations of this data (time, source and
+ * destination) are only built when their attributes are requested,
+ * usually when the message is displayed.
+ */
+struct sip_packet
+{
+    //! Capture timestamp (nanoseconds since Epoch)
+    u_int64_t ts;
+    //! Address family (AF_INET or AF_INET6)
+    int family;
+    //! Source address
+    union
+    {
+        struct in_addr v4;
+        struct in6_addr v6;
+    } src;
+    //! Destination address
+    union
+    {
+        struct in_addr v4;
+        struct in6_addr v6;
+    } dst;
+    //! Source port (host byte order)
+    u_int16_t sport;
+    //! Destination port (host byte order)
+    u_int16_t dport;
+    //! Transport protocol
+    enum sip_transport transport;
+    //! Payload offset in the capture file (0 if it's not stored contiguously)
+    u_int64_t offset;
 };
 
 /**
@@ -102,24 +215,23 @@ struct sip_attr_hdr
     char *name;
     //! Attribute description
     char *desc;
+    //! Values are stored in the interned strings pool
+    int intern;
 };
 
 /**
  * @brief Attribute data structure
  *
- * This structure contains a single attribute value and acts
- * as a linked list for all attributes of a message (or call)
+ * This structure contains all attribute values of a message (or call),
+ * each one in the slot of its attribute id. It's allocated when the
+ * first attribute is set.
  * Right now, all the attributed are stored as strings, which may
  * not be the better option, but will fit our actual needs.
  */
 struct sip_attr
 {
-    //! Attribute header pointer
-    sip_attr_hdr_t *hdr;
-    //! Attribute value
-    const char *value;
-    //! Next attribute in the linked list
-    sip_attr_t *next;
+    //! Attribute values indexed by attribute id
+    const char *value[SIP_ATTR_COUNT];
 };
 
 /**
@@ -129,21 +241,36 @@ struct sip_attr
  * the formats may be no the best, but the simplest for this
  * purpose. It also works as a linked lists of messages in a
  * call.
+ *
+ * Message attributes and payload lines index are allocated in the
+ * arena of its call. Once parsed, payload lines are stored one after
+ * another (null terminated) in the payload buffer, and found through
+ * the lines offset index (see msg_get_line).
  */
 struct sip_msg
 {
-    //! Message attribute list
+    //! Message attributes
     sip_attr_t *attrs;
-    //! Timestamp of current message
-    struct timeval ts;
-    //! Temporal header data before being parsed
-    char *headerptr;
-    //! Temporal payload data before being parsed
-    char *payloadptr;
-    //! FIXME Payload in one struct
-    const char *payload[256];
-    //!! FIXME not required
+    //! Packet information of current message
+    sip_packet_t pkt;
+    //! Payload data (raw before being parsed, split in lines after)
+    char *payload;
+    //! Raw payload copy of parsed messages not in the capture file
+    char *raw;
+    //! Payload length
+    int len;
+    //! Offset of each line in payload (uint32_t if len > UINT16_MAX, uint16_t otherwise)
+    void *lines;
+    //! Number of payload lines
     int plines;
+    //! Response status code (0 for requests)
+    int status;
+    //! CSeq method (request method or method being responded)
+    enum sip_method_id method;
+    //! Payload fingerprint (hash of its lines, case insensitive)
+    u_int64_t fingerprint;
+    //! Retransmissions of the same payload before this one (0 if not a retransmission)
+    int retrans;
     //! Flag to mark if payload data has been parsed
     int parsed;
     //! Message owner
@@ -154,6 +281,51 @@ struct sip_msg
     int color;
 };
 
+/**
+ * @brief Summary of call messages
+ *
+ * Updated each time a message is added to the call, so call list
+ * doesn't need to walk the messages to display them. Summary and
+ * dialog attributes are formatted at the same time.
+ */
+struct sip_call_summary
+{
+    //! Number of messages
+    int msgcnt;
+    //! First and last message timestamps (nanoseconds since Epoch)
+    u_int64_t first, last;
+    //! Status code of the last response (0 if none)
+    int status;
+    //! Timestamp of the last response
+    u_int64_t status_ts;
+    //! Payload bytes of all messages
+    u_int64_t bytes;
+    //! Formatted attributes from SIP_ATTR_MSGCNT on (empty if not set)
+    char values[SIP_SUMMARY_ATTRS][SIP_SUMMARY_VALUE_LEN];
+};
+
+/**
+ * @brief Dialog state of a call
+ *
+ * Updated by the state machine each time a message is added to the
+ * call. Timestamps are 0 until the event happens.
+ */
+struct sip_dialog
+{
+    //! Current dialog state
+    enum sip_dialog_state state;
+    //! First INVITE timestamp
+    u_int64_t invite_ts;
+    //! First ringing response timestamp
+    u_int64_t ringing_ts;
+    //! Answer timestamp
+    u_int64_t answer_ts;
+    //! Release timestamp (BYE, CANCEL or final error response)
+    u_int64_t end_ts;
+    //! Status code of the response that released the dialog (0 if none)
+    int cause;
+};
+
 /**
  * @brief Contains all information of a call and its messages
  *
@@ -163,10 +335,20 @@ struct sip_msg
  */
 struct sip_call
 {
-    //! Call attribute list
+    //! Call-ID of the call (part before '@')
+    const char *callid;
+    //! Call attributes
     sip_attr_t *attrs;
     //! List of messages of this call
     sip_msg_t *msgs;
+    //! Last message of the list
+    sip_msg_t *msgs_last;
+    //! Summary of call messages
+    sip_call_summary_t summary;
+    //! Dialog state of the call
+    sip_dialog_t dialog;
+    //! Memory of messages and their data (payload, lines index and attributes)
+    arena_t arena;
     // Call Lock
     pthread_mutex_t lock;
     //! Calls double linked list
@@ -176,18 +358,57 @@ struct sip_call
 };
 
 /**
- * @brief Create a new message from the readed header and payload
+ * @brief Hash index of calls
  *
- * Allocate required memory for a new SIP message. This function
- * will only store the given information, but wont parse it until
- * needed.
+ * Open addressing table of calls indexed by one attribute of their
+ * first message (Call-ID or X-Call-ID). Calls are never removed from
+ * the index.
+ */
+struct sip_call_index
+{
+    //! Indexed calls
+    sip_call_t **table;
+    //! Table size (power of two)
+    unsigned int size;
+    //! Used slots
+    unsigned int used;
+};
+
+/**
+ * @brief Partial list of calls
  *
- * @param header Raw header text
- * @param payload Raw payload content
+ * Threads loading a capture file in parallel store their calls in
+ * their own list, so they never block each other. Those lists are
+ * periodically merged into the global calls list while the file is
+ * being loaded.
+ */
+struct sip_store
+{
+    //! First and last calls of the list
+    sip_call_t *first, *last;
+    //! Calls of the list indexed by Call-ID
+    sip_call_index_t index;
+};
+
+/**
+ * @brief Create a new message from the packet information and payload
+ *
+ * Allocate required memory for a new SIP message in the call arena.
+ * This function will only store the given information, but wont parse
+ * it until needed. The message must be added to the same call, and it
+ * is released with it.
+ *
+ * If no payload is given, it will be read from the capture file
+ * (see pcapindex.h) when the message is parsed.
+ *
+ * @param call Call the message belongs to
+ * @param pkt Packet information
+ * @param payload Raw payload content (not null terminated) or NULL
+ * @param len Payload length
  * @return a new allocated message
  */
 extern sip_msg_t *
-sip_msg_create(const char *header, const char *payload);
+sip_msg_create(sip_call_t *call, const sip_packet_t *pkt, const char *payload, int len);
 
 /**
  * @brief Create a new call with the given callid (Minimum required data)
@@ -195,28 +416,48 @@ sip_msg_create(const char *header, const char *payload);
  * Allocated required memory for a new SIP Call. The call acts as
  * header structure to all the messages with the same callid.
  *
+ * The call is added to the store of the current thread (if any).
+ * Otherwise it's only added to the global Call-ID index, and it will be
+ * added to the global calls list with its first message.
+ *
  * @param callid Call-ID Header value
  * @return pointer to the sip_call created
  */
 extern sip_call_t *
-sip_call_create(char *callid);
+sip_call_create(const char *callid);
 
 /**
  * @brief Parses Call-ID header of a SIP message payload
  *
- * Mainly used to check if a payload contains a callid.
+ * Mainly used to check if a payload contains a callid. Only payload
+ * headers are scanned.
  *
- * @param payload SIP message payload
+ * @param payload SIP message payload (not null terminated)
+ * @param len Payload length
  * @return callid parsed from Call-ID header
  */
 extern char *
-sip_get_callid(const char* payload);
+sip_get_callid(const char* payload, int len);
+
+/**
+ * @brief Hash the Call-ID header of a SIP message payload
+ *
+ * Only the part of the value before the '@' is hashed, the same part
+ * used to find the call the message belongs to.
+ *
+ * @param payload SIP message payload (not null terminated)
+ * @param len Payload length
+ * @return FNV-1a hash of callid or 0 if payload has no Call-ID
+ */
+extern unsigned int
+sip_get_callid_hash(const char *payload, int len);
 
 /**
  * @brief Loads a new message from raw header/payload
  *
- * Use this function to convert raw data into call and message
- * structures. This is mainly used to load data from a file or
+ * Use this function to convert ngrep output into call and message
+ * structures. The header is converted to packet information and
+ * then loaded using sip_load_packet.
  *
  * @param header Raw ngrep header
  * @param payload Raw ngrep payload
@@ -225,6 +466,87 @@ sip_get_callid(const char* payload);
 extern sip_msg_t *
 sip_load_message(const char *header, const char *payload);
 
+/**
+ * @brief Loads a new message from packet information and payload
+ *
+ * Use this function to convert captured packets into call and message
+ * structures. Payload is copied, so it can point to capture buffers.
+ *
+ * Loading is done in two passes: only the Call-ID and the attributes
+ * displayed in call list (of the first message of each call) are
+ * parsed here. Message payloads are fully parsed when the call is
+ * displayed. If the payload is stored in a capture file (packet has a
+ * payload offset) it is not even copied, it will be read from the file
+ * when required.
+ *
+ * @param pkt Packet information
+ * @param payload SIP payload (not null terminated)
+ * @param len Payload length
+ * @return a SIP msg structure pointer
+ */
+extern sip_msg_t *
+sip_load_packet(const sip_packet_t *pkt, const char *payload, int len);
+
+/**
+ * @brief Set the store for calls loaded by the current thread
+ *
+ * While a store is set, calls are searched and created only in that
+ * store and the sip.ignoreincomplete check is delayed until the store
+ * is merged.
+ *
+ * @param store Partial calls list or NULL to use the global list
+ */
+extern void
+sip_store_set(sip_store_t *store);
+
+/**
+ * @brief Merge partial calls lists into the global calls list
+ *
+ * Calls with the same Call-ID in several stores are joined in one call
+ * keeping its messages in timestamp order. If the call was already
+ * merged from previous stores, messages are appended to it. Otherwise
+ * it's added at the end of the global list sorted by first message
+ * timestamp.
+ *
+ * Stores can be merged several times while loading, as long as their
+ * messages are newer than the ones merged before.
+ *
+ * No other thread must be using the stores while merging.
+ *
+ * @param stores Partial calls lists
+ * @param count Number of stores
+ */
+extern void
+sip_store_merge(sip_store_t *stores, int count);
+
+/**
+ * @brief Discard all calls of a partial calls list
+ *
+ * Used when the calls of a store can not be completely loaded. Calls
+ * and their messages are released and the store is left empty.
+ *
+ * @param discard Partial calls list
+ */
+extern void
+sip_store_clear(sip_store_t *discard);
+
+/**
+ * @brief Parse ngrep header line to get timestamps and ip addresses
+ *
+ * This function will convert the ngrep header line in format:
+ *  U YYYY/MM/DD hh:mm:ss.uuuuuu fff.fff.fff.fff:pppp -> fff.fff.fff.fff:pppp
+ *
+ * to packet information.
+ *
+ * @todo This MUST disappear someday.
+ *
+ * @param header ngrep header generated by -qpt arguments
+ * @param pkt Packet information to be filled
+ * @return 0 on success, 1 on malformed header
+ */
+extern int
+sip_parse_header(const char *header, sip_packet_t *pkt);
+
 /**
  * @brief Getter for calls linked list size
  *
@@ -295,30 +617,48 @@ sip_attr_from_name(const char *name);
  * @brief Sets the given attribute value to an attribute
  *
  * Primitive for setting an attribute value of a given attribute list.
- * This can be used for calls and message attributes.
- *
+ * This can be used for calls and message attributes. The value is
+ * copied and replaces the previous one (if different).
+ *
+ * Attributes are allocated in the given arena, and replaced values
+ * are released with it. Values are published with release stores, so
+ * sip_attr_get can be called without the lock writers hold, and a
+ * replaced value stays valid while its call lives. Without arena,
+ * they're allocated with malloc and replaced values are released
+ * immediately: this is only valid for lists not yet visible to other
+ * threads (messages still without call). Values of attributes
+ * with the intern flag are taken from the interned strings pool, so
+ * equal values share the same pointer.
+ *
+ * @param arena Arena for the attributes memory or NULL
  * @param list Pointer to the attribute list
  * @param id Attribute id
  * @param value Attribute value
  */
 extern void
-sip_attr_set(sip_attr_t **list, enum sip_attr_id id, const char *value);
+sip_attr_set(arena_t *arena, sip_attr_t **list, enum sip_attr_id id, const char *value);
 
 /**
  * @brief Gets the given attribute value to an attribute
  *
  * Primitive for getting an attribute value of a given attribute list.
- * This can be used for calls and message attributes.
+ * This can be used for calls and message attributes. It doesn't need
+ * any lock, see sip_attr_set.
  *
+ * @param list Pointer to the attribute list
+ * @param id Attribute id
+ * @return Attribute value or NULL if not set
  */
 extern const char *
-sip_attr_get(sip_attr_t *list, enum sip_attr_id id);
+sip_attr_get(sip_attr_t **list, enum sip_attr_id id);
 
 /**
  * @brief Append message to the call's message list
  *
  * Creates a relation between this call and the message, appending it
  * to the end of the message list and setting the message owner.
+ * Calls not in a store are added to the global calls list with their
+ * first message.
  *
  * @param call pointer to the call owner of the message
  * @param msg SIP message structure
@@ -329,7 +669,8 @@ call_add_message(sip_call_t *call, sip_msg_t *msg);
 /**
  * @brief Find a call structure in calls linked list given an callid
  *
- *
+ * Only the store of the current thread is searched if it has one.
+ * Calls are searched using their Call-ID index.
  *
  * @param callid Call-ID Header value
  * @return pointer to the sip_call structure found or NULL
@@ -340,8 +681,8 @@ call_find_by_callid(const char *callid);
 /**
  * @brief Find a call structure in calls linked list given an xcallid
  *
- * Find the call that have the xcallid attribute equal tot he given
- * value.
+ * Find the first call that have the xcallid attribute equal tot he
+ * given value. Calls are searched using their X-Call-ID index.
  *
  * @param xcallid X-Call-ID or X-CID Header value
  * @return pointer to the sip_call structure found or NULL
@@ -353,7 +694,7 @@ call_find_by_xcallid(const char *xcallid);
  * @brief Getter for call messages linked list size
  *
  * Return the number of messages stored in this call. All messages
- * share the same Call-ID
+ * share the same Call-ID. The counter is kept in the call summary.
  *
  * @param call SIP call structure
  * @return how many messages are in the call
@@ -361,6 +702,18 @@ call_find_by_xcallid(const char *xcallid);
 extern int
 call_msg_count(sip_call_t *call);
 
+/**
+ * @brief Get the messages generation of the global calls
+ *
+ * The generation changes every time a message is added to any call
+ * of the global list, so it can be used to check for new messages
+ * without locking every call.
+ *
+ * @return current messages generation
+ */
+extern unsigned int
+sip_msgs_generation();
+
 /**
  * @brief Finds the other leg of this call.
  *
@@ -412,6 +765,17 @@ call_get_prev_msg(sip_call_t *call, sip_msg_t *msg);
 extern sip_call_t *
 call_get_next(sip_call_t *cur);
 
+/**
+ * @brief Get next call of the list without applying filters
+ *
+ * Used to walk all stored calls, no matter what is displayed.
+ *
+ * @param cur Current call. Pass NULL to get the first call.
+ * @return Next call in the list or NULL if there is no next call
+ */
+extern sip_call_t *
+sip_calls_next(sip_call_t *cur);
+
 /**
  * @brief Get previous call after applying filters and ignores
  *
@@ -451,33 +815,26 @@ extern const char *
 call_get_attribute(sip_call_t *call, enum sip_attr_id id);
 
 /**
- * @brief Parse ngrep header line to get timestamps and ip addresses
- *
- * This function will convert the ngrep header line in format:
- *  U DD/MM/YY hh:mm:ss.uuuuuu fff.fff.fff.fff:pppp -> fff.fff.fff.fff:pppp
+ * @brief Parse SIP Message payload to fill sip_msg structe
  *
- * to some attributes.
- *
- * @todo This MUST disappear someday.
+ * Parse the payload content to set message attributes and split
+ * the payload buffer in lines (in place).
  *
  * @param msg SIP message structure
- * @param header ngrep header generated by -qpt arguments
- * @return 0 on success, 1 on malformed header
+ * @return 0 on success, 1 otherwise
  */
 extern int
-msg_parse_header(sip_msg_t *msg, const char *header);
+msg_parse_payload(sip_msg_t *msg);
 
 /**
- * @brief Parse SIP Message payload to fill sip_msg structe
- *
- * Parse the payload content to set message attributes.
+ * @brief Get a line of a parsed message payload
  *
  * @param msg SIP message structure
- * @param payload SIP message payload
- * @return 0 in all cases
+ * @param line Line number (starting at 0)
+ * @return null terminated line or NULL if there is no such line
  */
-extern int
-msg_parse_payload(sip_msg_t *msg, const char *payload);
+extern const char *
+msg_get_line(sip_msg_t *msg, int line);
 
 /**
  * @brief Parse internal header and payload
@@ -497,6 +854,9 @@ msg_parse(sip_msg_t *msg);
  *
  * This function acts as wrapper of sip message attributes
  *
+ * Attributes of messages with an owner call are allocated in the call
+ * arena, so the message owner must be set before its attributes.
+ *
  * @param msg SIP message structure
  * @param id Attribute id
  * @param value Attribute value
@@ -508,7 +868,9 @@ msg_set_attribute(sip_msg_t *msg, enum sip_attr_id id, const char *value);
  * @brief Return a message attribute value
  *
  * This function will be used to avoid accessing call structure
- * fields directly.
+ * fields directly. Time, source and destination attributes are
+ * formatted from packet information the first time they are
+ * requested.
  *
  * @param msg SIP message structure
  * @param id Attribute id
@@ -517,11 +879,26 @@ msg_set_attribute(sip_msg_t *msg, enum sip_attr_id id, const char *value);
 extern const char *
 msg_get_attribute(sip_msg_t *msg, enum sip_attr_id id);
 
+/**
+ * @brief Format a header line for the given message
+ *
+ * Build a header in the same format ngrep uses to display
+ * a packet:
+ *  U YYYY/MM/DD hh:mm:ss.uuuuuu src:port -> dst:port
+ *
+ * @param msg SIP message structure
+ * @param out Output buffer (at least 256 bytes)
+ * @return out buffer pointer
+ */
+extern const char *
+msg_get_header(sip_msg_t *msg, char *out);
+
 /**
  * @brief Check if a package is a retransmission
  *
- * This function will compare its payload with the previous message
- * in the dialog, to check if it has the same content.
+ * A message is a retransmission if its payload is the same as the
+ * previous message in the dialog. Payload fingerprints are compared
+ * when the message is added to the call.
  *
  * @param msg SIP message that will be checked
  * @return 1 if the previous message is equal to msg, 0 otherwise
@@ -34,43 +34,155 @@
  * use other transports, uh.
  *
  */
+#include <errno.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
 #include "spcap.h"
 #include "sip.h"
 #include "option.h"
 #include "ui_manager.h"
+#include "tpacket.h"
+#include "pipeline.h"
+#include "ipfrag.h"
+#include "tcpstream.h"
+#include "pcapfile.h"
+#include "pcapindex.h"
+
+//! Milliseconds between call list refreshes while loading a file
+#define LOAD_REFRESH_INTERVAL 250
+//! Packets read between refresh interval checks
+#define LOAD_REFRESH_PACKETS 1024
 
 //! FIXME Link type
 int linktype;
+//! Link layer decoder for current link type
+static int (*link_decoder)(const u_char *packet, int caplen, u_int16_t *proto) = NULL;
 //! FIXME Pointer to the dump file
 pcap_dumper_t *pd = NULL;
+//! Dump file buffer
+static char *dump_buffer = NULL;
+//! Capture file loading progress
+static struct capture_load_stats load_stats;
+//! Lock for capture file loading progress
+static pthread_mutex_t load_lock = PTHREAD_MUTEX_INITIALIZER;
+//! Signaled when file loading must continue after a pause
+static pthread_cond_t load_resumed = PTHREAD_COND_INITIALIZER;
+//! Packets read and bytes read (or file read by libpcap) while loading
+static unsigned long load_packets = 0;
+static size_t load_read = 0;
+static FILE *load_file = NULL;
+//! Function to parse each packet read from the file
+static pcap_handler load_handler = parse_packet;
+//! Calls loaded without loader threads, until they're displayed
+static sip_store_t load_store;
+//! Last time loaded calls were displayed
+static struct timeval load_refresh_time;
 
 #ifndef WITH_NGREP
+//! Online capture handles (used to request libpcap statistics)
+static pcap_t *capture_handles[MAX_CAPTURE_DEVICES];
+static int capture_handle_count = 0;
+//! Statistics from capture backends that manage their own counters
+static struct capture_stats stats;
+//! Lock for capture statistics
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
 
-int
-online_capture(void *pargv)
+//! First four bytes of SIP requests and responses
+static const char *sip_starts[] = {
+    "INVITE", "ACK", "BYE", "CANCEL", "OPTIONS", "REGISTER", "SUBSCRIBE", "NOTIFY",
+    "PUBLISH", "INFO", "REFER", "MESSAGE", "UPDATE", "PRACK", "SIP/2.0", NULL
+};
+
+/**
+ * @brief Build the default capture filter
+ *
+ * Filter only accepts packets from or to the ports configured in
+ * capture.filter.ports (single ports or ranges). If capture.filter.payload
+ * is enabled, UDP payloads must also start with a SIP method or SIP/2.0.
+ *
+ * Non-first IPv4 fragments carry no ports, so they are always accepted
+ * to let the reassembly complete. TCP segments and IPv6 packets can not
+ * be checked by payload and only ports are filtered.
+ *
+ * Ethernet devices also receive VLAN tagged frames, whose headers are
+ * 4 bytes longer, so the same expression is repeated after the vlan
+ * keyword. Other datalinks (like the cooked headers of any device)
+ * don't support it and receive frames without tags.
+ *
+ * @param filter Buffer to store the filter expression
+ * @param len Buffer size
+ * @param vlan Also match VLAN tagged frames
+ */
+static void
+capture_default_filter(char *filter, int len, int vlan)
 {
-    char **argv = (char**) pargv;
-    int argc = 1;
-    char filter_exp[256];
+    char ports[256] = "", *token, *save = NULL, *expr;
+    const char *start;
+    int pos, i, first, last;
+    u_int32_t value;
+
+    if (get_option_value("capture.filter.ports")) {
+        strncpy(ports, get_option_value("capture.filter.ports"), sizeof(ports) - 1);
+    }
+
+    // Accept non-first fragments of any datagram
+    pos = snprintf(filter, len, "(ip[6:2] & 0x1fff != 0) or ((");
+
+    // Add configured ports and port ranges
+    for (i = 0, token = strtok_r(ports, ", ", &save); token; token = strtok_r(NULL, ", ", &save)) {
+        if (sscanf(token, "%d-%d", &first, &last) == 2) {
+            pos += snprintf(filter + pos, len - pos, "%sportrange %d-%d", i++ ? " or " : "", first, last);
+        } else if (sscanf(token, "%d", &first) == 1) {
+            pos += snprintf(filter + pos, len - pos, "%sport %d", i++ ? " or " : "", first);
+        }
+        if (pos >= len) break;
+    }
+    if (!i) pos += snprintf(filter + pos, len - pos, "port 5060");
+
+    // Check the first bytes of UDP payloads
+    if (is_option_enabled("capture.filter.payload") && pos < len) {
+        pos += snprintf(filter + pos, len - pos, ") and (tcp or ip6");
+        for (i = 0; sip_starts[i] && pos < len; i++) {
+            start = sip_starts[i];
+            value = (u_int32_t) start[0] << 24 | (u_int32_t) start[1] << 16 | (u_int32_t) start[2] << 8
+                | (u_int32_t) (start[3] ? start[3] : ' ');
+            pos += snprintf(filter + pos, len - pos, " or udp[8:4] = 0x%08x", value);
+        }
+    }
+    if (pos < len) snprintf(filter + pos, len - pos, "))");
+
+    // Match the same expression in VLAN tagged frames
+    if (vlan && (expr = strdup(filter))) {
+        snprintf(filter, len, "%s or (vlan and (%s))", expr, expr);
+        free(expr);
+    }
+}
+
+/**
+ * @brief Open a capture device and install its filter
+ *
+ * @param dev Device name
+ * @param filter_exp Filter expression (can be empty) or NULL for the
+ *  default filter
+ * @return capture handle or NULL on error
+ */
+static pcap_t *
+capture_open_device(const char *dev, char *filter_exp)
+{
+    //! Default filter for the device datalink
+    char default_exp[2048];
     //! Session handle
     pcap_t *handle;
-    //! Device to sniff on
-    char dev[] = "any";
     //! Error string
     char errbuf[PCAP_ERRBUF_SIZE];
     //! The compiled filter expression
     struct bpf_program fp;
-    //! The filter expression
-    //char *filter_exp = (char *) pargs;
     //! Netmask of our sniffing device
     bpf_u_int32 mask;
     //! The IP of our sniffing device
     bpf_u_int32 net;
-    //! Build the filter options
-    memset(filter_exp, 0, sizeof(filter_exp));
-    while (argv[argc]) {
-        sprintf(filter_exp + strlen(filter_exp), " %s", argv[argc++]);
-    }
 
     if (pcap_lookupnet(dev, &net, &mask, errbuf) == -1) {
         fprintf(stderr, "Can't get netmask for device %s\n", dev);
@@ -80,145 +192,815 @@ online_capture(void *pargv)
     handle = pcap_open_live(dev, BUFSIZ, 1, 1000, errbuf);
     if (handle == NULL) {
         fprintf(stderr, "Couldn't open device %s: %s\n", dev, errbuf);
-        return 2;
+        return NULL;
+    }
+    if (!filter_exp) {
+        capture_default_filter(default_exp, sizeof(default_exp),
+            pcap_datalink(handle) == DLT_EN10MB);
+        filter_exp = default_exp;
     }
     if (pcap_compile(handle, &fp, filter_exp, 0, net) == -1) {
         fprintf(stderr, "Couldn't parse filter %s: %s\n", filter_exp, pcap_geterr(handle));
-        return 2;
+        pcap_close(handle);
+        return NULL;
     }
     if (pcap_setfilter(handle, &fp) == -1) {
         fprintf(stderr, "Couldn't install filter %s: %s\n", filter_exp, pcap_geterr(handle));
+        pcap_freecode(&fp);
+        pcap_close(handle);
+        return NULL;
+    }
+    pcap_freecode(&fp);
+    return handle;
+}
+
+/**
+ * @brief Capture thread of a device
+ *
+ * Pass available packages of the device to the parser pipeline
+ *
+ * @param index Device number in capture handles
+ */
+static void *
+capture_device_loop(void *index)
+{
+    int i = (int) (long) index;
+    pcap_loop(capture_handles[i], -1, pipeline_push, pipeline_input(i));
+    return NULL;
+}
+
+int
+online_capture(void *pargv)
+{
+    char **argv = (char**) pargv;
+    int argc = 1;
+    char filter_exp[2048];
+    //! No filter given, use the default one
+    int deffilter;
+    //! Devices to sniff on
+    char devlist[256] = "any", *devices[MAX_CAPTURE_DEVICES], *dev, *save = NULL;
+    int count = 0, i;
+    //! Session handles
+    pcap_t *handles[MAX_CAPTURE_DEVICES];
+    //! Device capture threads (the first device is captured by this one)
+    pthread_t threads[MAX_CAPTURE_DEVICES];
+    //! Opened devices and started capture threads
+    int opened = 0, started = 0, ret = 2;
+
+    //! Build the filter options
+    memset(filter_exp, 0, sizeof(filter_exp));
+    while (argv[argc]) {
+        snprintf(filter_exp + strlen(filter_exp), sizeof(filter_exp) - strlen(filter_exp),
+            " %s", argv[argc++]);
+    }
+
+    // Only capture SIP packets if no filter has been given
+    deffilter = (argc == 1);
+
+    // Get the list of devices
+    if (get_option_value("capture.device")) {
+        strncpy(devlist, get_option_value("capture.device"), sizeof(devlist) - 1);
+    }
+    for (dev = strtok_r(devlist, ", ", &save); dev && count < MAX_CAPTURE_DEVICES;
+         dev = strtok_r(NULL, ", ", &save)) {
+        devices[count++] = dev;
+    }
+    if (!count) devices[count++] = "any";
+
+    // Start parser threads before any packet is captured
+    if (pipeline_init(get_option_int_value("capture.workers"), count) != 0) {
+        fprintf(stderr, "Couldn't start capture parser threads\n");
         return 2;
     }
+
+    // Use memory mapped ring capture if requested
+    if (is_option_enabled("capture.tpacket")) {
+        // Cooked frames of any device have no VLAN tags
+        if (deffilter) {
+            for (i = 0; i < count && strcmp(devices[i], "any"); i++);
+            capture_default_filter(filter_exp, sizeof(filter_exp), i == count);
+        }
+        return tpacket_capture(filter_exp, (const char **) devices, count);
+    }
+
+    // Open all devices, they must share the datalink type
+    for (i = 0; i < count; i++) {
+        if (!(handles[i] = capture_open_device(devices[i], deffilter ? NULL : filter_exp))) {
+            goto close;
+        }
+        opened++;
+        if (pcap_datalink(handles[i]) != pcap_datalink(handles[0])) {
+            fprintf(stderr, "Device %s datalink differs from device %s\n", devices[i],
+                devices[0]);
+            goto close;
+        }
+    }
+
+    // Get datalink and open temporal file
+    if (capture_init_dump(handles[0]) != 0) {
+        goto close;
+    }
+
+    // Statistics will be requested to these handles
+    memcpy(capture_handles, handles, sizeof(pcap_t *) * count);
+    __atomic_store_n(&capture_handle_count, count, __ATOMIC_RELEASE);
+
+    // Each device is captured by its own thread, the first one by this
+    for (i = 1; i < count; i++) {
+        if (pthread_create(&threads[i], NULL, capture_device_loop, (void *) (long) i)) {
+            fprintf(stderr, "Couldn't start capture thread for device %s\n", devices[i]);
+            goto stop;
+        }
+        started++;
+    }
+    capture_device_loop((void *) 0);
+    ret = 0;
+
+stop:
+    // Stop the rest of capture threads and wait for them
+    for (i = 1; i <= started; i++) {
+        pcap_breakloop(handles[i]);
+    }
+    for (i = 1; i <= started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    __atomic_store_n(&capture_handle_count, 0, __ATOMIC_RELEASE);
+    // Write queued packets before closing the temporal file
+    pipeline_dump_sync();
+
+close:
+    // Close temporal file
+    if (pd) pcap_dump_close(pd);
+    pd = NULL;
+    free(dump_buffer);
+    dump_buffer = NULL;
+    // Close all opened devices
+    for (i = 0; i < opened; i++) {
+        pcap_close(handles[i]);
+    }
+    return ret;
+}
+
+int
+capture_init_dump(pcap_t *handle)
+{
+    // Temporal file
+    FILE *f;
+    // Temporal file buffer size
+    int batch;
+
+    // Get datalink to parse packages correctly
+    if (capture_set_linktype(pcap_datalink(handle)) != 0) {
+        fprintf(stderr, "Unsupported datalink type %s\n",
+            pcap_datalink_val_to_name(pcap_datalink(handle)));
+        return 1;
+    }
+
+    // Open temporal file (if enabled)
     if (!is_option_disabled("sngrep.tmpfile")) {
-        if ((pd = pcap_dump_open(handle, get_option_value("sngrep.tmpfile"))) == NULL) {
+        if (!(f = fopen(get_option_value("sngrep.tmpfile"), "w"))) {
+            fprintf(stderr, "Couldn't open temporal dump file %s: %s\n",
+                get_option_value("sngrep.tmpfile"), strerror(errno));
+            return 1;
+        }
+        // Packets will be written to disk in batches of this size
+        if ((batch = get_option_int_value("capture.dump.batch")) > 0
+            && (dump_buffer = malloc(batch))) {
+            setvbuf(f, dump_buffer, _IOFBF, batch);
+        }
+        if ((pd = pcap_dump_fopen(handle, f)) == NULL) {
             fprintf(stderr, "Couldn't open temporal dump file %s: %s\n",
                 get_option_value("sngrep.tmpfile"), pcap_geterr(handle));
-            return 2;
+            fclose(f);
+            return 1;
         }
     }
+    return 0;
+}
 
-    // Get datalink to parse packages correctly
-    linktype = pcap_datalink(handle);
+void
+capture_add_stats(unsigned long recv, unsigned long drop)
+{
+    pthread_mutex_lock(&stats_lock);
+    stats.recv += recv;
+    stats.drop += drop;
+    pthread_mutex_unlock(&stats_lock);
+}
+
+void
+capture_get_stats(struct capture_stats *cstats)
+{
+    struct pcap_stat ps;
+    int i, count;
 
-    // Parse available packages
-    pcap_loop(handle, -1, parse_packet, "Online");
+    pthread_mutex_lock(&stats_lock);
+    memcpy(cstats, &stats, sizeof(struct capture_stats));
+    pthread_mutex_unlock(&stats_lock);
 
-    // Close temporal file
-    pcap_dump_close(pd);
-    // Close PCAP file
-    pcap_close(handle);
+    // Packets discarded by parser threads
+    cstats->overflow = pipeline_drops();
+    // Packets not stored in temporal file
+    cstats->unsaved = pipeline_dump_drops();
+
+    // Add libpcap counters if we're capturing through it
+    count = __atomic_load_n(&capture_handle_count, __ATOMIC_ACQUIRE);
+    for (i = 0; i < count; i++) {
+        if (pcap_stats(capture_handles[i], &ps) == 0) {
+            cstats->recv += ps.ps_recv;
+            cstats->drop += ps.ps_drop;
+        }
+    }
 }
 #endif
 
+/**
+ * @brief Add calls loaded so far to the global list and refresh the UI
+ *
+ * @param force Refresh even if the refresh interval has not elapsed
+ */
+static void
+load_refresh(int force)
+{
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    if (!force && (now.tv_sec - load_refresh_time.tv_sec) * 1000
+        + (now.tv_usec - load_refresh_time.tv_usec) / 1000 < LOAD_REFRESH_INTERVAL) {
+        return;
+    }
+    load_refresh_time = now;
+
+    // Make parsed calls visible
+    if (load_handler == pipeline_load_push) {
+        pipeline_load_sync();
+    } else {
+        sip_store_merge(&load_store, 1);
+    }
+
+    // Update loading progress
+    pthread_mutex_lock(&load_lock);
+    load_stats.packets = load_packets;
+    load_stats.read = (load_file) ? (size_t) ftell(load_file) : load_read;
+    pthread_mutex_unlock(&load_lock);
+
+    ui_new_msg_refresh(NULL);
+}
+
+/**
+ * @brief Set the error message of the capture file being loaded
+ *
+ * Files are loaded while the interface is running, so errors are
+ * displayed in the call list instead of being printed.
+ */
+static void
+load_error(const char *fmt, ...)
+{
+    va_list ap;
+
+    pthread_mutex_lock(&load_lock);
+    va_start(ap, fmt);
+    vsnprintf(load_stats.error, sizeof(load_stats.error), fmt, ap);
+    va_end(ap);
+    pthread_mutex_unlock(&load_lock);
+}
+
+/**
+ * @brief Mark capture file loading as finished
+ *
+ * @param ret Loading result
+ */
+static void
+load_finish(int ret)
+{
+    pthread_mutex_lock(&load_lock);
+    load_stats.packets = load_packets;
+    load_stats.read = load_read;
+    load_stats.status = (ret == 0) ? CAPTURE_LOAD_DONE : CAPTURE_LOAD_FAILED;
+    gettimeofday(&load_stats.end, NULL);
+    pthread_mutex_unlock(&load_lock);
+    ui_new_msg_refresh(NULL);
+}
+
+/**
+ * @brief Pass a packet read from a capture file to the load handler
+ *
+ * Reading stops while capture is paused.
+ */
+static void
+load_packet(u_char *mode, const struct pcap_pkthdr *header, const u_char *packet)
+{
+    // Wait until capture is resumed
+    if (!is_option_enabled("sip.capture")) {
+        pthread_mutex_lock(&load_lock);
+        while (!is_option_enabled("sip.capture"))
+            pthread_cond_wait(&load_resumed, &load_lock);
+        pthread_mutex_unlock(&load_lock);
+    }
+
+    load_handler(mode, header, packet);
+
+    // Check from time to time if loaded calls must be displayed
+    if (++load_packets % LOAD_REFRESH_PACKETS == 0) {
+        load_refresh(0);
+    }
+}
+
 int
 load_from_file(const char* file)
 {
     // PCAP file handler
     pcap_t *handle;
     // Error text (in case of file open error)
-    char errbuf[PCAP_ERRBUF_SIZE];
+    char errbuf[PCAP_ERRBUF_SIZE] = "";
     // The header that pcap gives us
     struct pcap_pkthdr header;
     // The actual packet
     const u_char *packet;
+    // Capture file information
+    struct stat st;
+    // Number of loader threads
+    int loaders;
+    int ret = 0;
+
+    memset(&load_stats, 0, sizeof(struct capture_load_stats));
+    gettimeofday(&load_stats.start, NULL);
+    if (stat(file, &st) == 0 && S_ISREG(st.st_mode)) {
+        load_stats.size = st.st_size;
+    }
+    load_refresh_time = load_stats.start;
+    load_packets = 0;
+    load_read = 0;
 
-    // Open PCAP file
-    if ((handle = pcap_open_offline(file, errbuf)) == NULL) {
-        fprintf(stderr, "Couldn't open pcap file %s: %s\n", file, errbuf);
+    // Message payloads are read from the file when they're displayed
+    if (pcapindex_open(file) != 0) {
+        load_error("Couldn't open pcap file: %s", strerror(errno));
+        load_finish(1);
         return 1;
     }
 
-    // Get datalink to parse packages correctly
-    linktype = pcap_datalink(handle);
+    // Reopened files are loaded from their index
+    if (pcapindex_load(file, &load_packets) == 0) {
+        load_read = load_stats.size;
+        load_finish(0);
+        return 0;
+    }
 
-    // Loop through packages
-    while ((packet = pcap_next(handle, &header))) {
-        // Parse package
-        parse_packet((u_char*)"Offline", &header, packet);
+    // Parse packets in parallel if more than one thread is available
+    if ((loaders = get_option_int_value("capture.offline.workers")) <= 0) {
+        loaders = sysconf(_SC_NPROCESSORS_ONLN);
     }
-    // Close PCAP file
-    pcap_close(handle);
-    return 0;
+    if (loaders > 1 && pipeline_load_init(loaders) == 0) {
+        load_handler = pipeline_load_push;
+    } else {
+        // Calls are stored apart until they're displayed
+        load_handler = parse_packet;
+        sip_store_set(&load_store);
+    }
+
+    // Read the file in place if we know its format
+    switch (pcapfile_load(file, load_packet, (u_char*)"Offline", &load_read, errbuf)) {
+        case PCAPFILE_OK:
+            break;
+        case PCAPFILE_ERROR:
+            load_error("%s", errbuf);
+            ret = 1;
+            break;
+        default:
+            // Open PCAP file
+            if ((handle = pcap_open_offline(file, errbuf)) == NULL) {
+                load_error("Couldn't open pcap file: %s", errbuf);
+                ret = 1;
+                break;
+            }
+
+            // Get datalink to parse packages correctly
+            if (capture_set_linktype(pcap_datalink(handle)) != 0) {
+                load_error("Unsupported datalink type %s",
+                    pcap_datalink_val_to_name(pcap_datalink(handle)));
+                pcap_close(handle);
+                ret = 1;
+                break;
+            }
+
+            // Loop through packages
+            load_file = pcap_file(handle);
+            while ((packet = pcap_next(handle, &header))) {
+                // Parse package
+                load_packet((u_char*)"Offline", &header, packet);
+            }
+            load_file = NULL;
+            load_read = load_stats.size;
+            // Close PCAP file
+            pcap_close(handle);
+    }
+
+    // Wait until all packets have been parsed
+    if (load_handler == pipeline_load_push) {
+        pipeline_load_finish();
+    } else {
+        sip_store_merge(&load_store, 1);
+        sip_store_set(NULL);
+    }
+
+    load_finish(ret);
+
+    // Store loaded calls for next time
+    if (ret == 0) {
+        pcapindex_save(file, load_packets);
+    }
+    return ret;
+}
+
+void
+capture_get_load_stats(struct capture_load_stats *lstats)
+{
+    pthread_mutex_lock(&load_lock);
+    memcpy(lstats, &load_stats, sizeof(struct capture_load_stats));
+    pthread_mutex_unlock(&load_lock);
+}
+
+void
+capture_load_resume()
+{
+    pthread_mutex_lock(&load_lock);
+    pthread_cond_broadcast(&load_resumed);
+    pthread_mutex_unlock(&load_lock);
 }
 
 void
 parse_packet(u_char *mode, const struct pcap_pkthdr *header, const u_char *packet)
 {
-    // Datalink Header size
-    int size_link;
-    // Ethernet header data
-    struct ether_header *eptr;
-    // Ethernet header type
-    u_short ether_type;
+    // Store this packet in temporal file (fragments included)
+    capture_dump_packet(header, packet);
+    // Parse this packet
+    capture_load_packet(mode, header, packet);
+}
+
+/**
+ * @brief Get network protocol from the IP version of the packet
+ *
+ * Used for link types that don't include the network protocol.
+ */
+static int
+link_ip_version(const u_char *packet, int caplen, u_int16_t *proto)
+{
+    if (caplen < 1) return -1;
+    switch (packet[0] >> 4) {
+        case 4:
+            *proto = ETHERTYPE_IP;
+            return 0;
+        case 6:
+            *proto = ETHERTYPE_IPV6;
+            return 0;
+    }
+    return -1;
+}
+
+/**
+ * @brief Decode Ethernet headers (including 802.1Q and QinQ tags)
+ */
+static int
+link_ethernet(const u_char *packet, int caplen, u_int16_t *proto)
+{
+    int size_link = SIZE_ETHERNET, tags = 0;
+
+    if (caplen < SIZE_ETHERNET) return -1;
+    *proto = ntohs(((const struct ether_header *) packet)->ether_type);
+
+    // Skip all VLAN tags, the last one contains the network protocol
+    while (*proto == ETHERTYPE_VLAN || *proto == 0x88a8 || *proto == 0x9100) {
+        if (++tags > MAX_VLAN_TAGS || caplen < size_link + SIZE_VLAN) return -1;
+        *proto = ntohs(*(const u_int16_t *) (packet + size_link + 2));
+        size_link += SIZE_VLAN;
+    }
+    return size_link;
+}
+
+/**
+ * @brief Decode Linux cooked headers
+ */
+static int
+link_linux_sll(const u_char *packet, int caplen, u_int16_t *proto)
+{
+    if (caplen < SLL_HDR_LEN) return -1;
+    *proto = ntohs(*(const u_int16_t *) (packet + 14));
+    return SLL_HDR_LEN;
+}
+
+/**
+ * @brief Decode Linux cooked v2 headers
+ */
+static int
+link_linux_sll2(const u_char *packet, int caplen, u_int16_t *proto)
+{
+    if (caplen < SLL2_HDR_LEN) return -1;
+    *proto = ntohs(*(const u_int16_t *) packet);
+    return SLL2_HDR_LEN;
+}
+
+/**
+ * @brief Decode BSD loopback headers
+ *
+ * Address family is stored in the byte order of the capturing host and
+ * IPv6 value changes between systems, so IP version is checked instead.
+ */
+static int
+link_null(const u_char *packet, int caplen, u_int16_t *proto)
+{
+    if (link_ip_version(packet + 4, caplen - 4, proto) != 0) return -1;
+    return 4;
+}
+
+/**
+ * @brief Supported datalinks and their decoders
+ */
+static struct
+{
+    int linktype;
+    int (*decoder)(const u_char *packet, int caplen, u_int16_t *proto);
+} link_decoders[] = {
+    { DLT_EN10MB, link_ethernet },
+    { DLT_LINUX_SLL, link_linux_sll },
+#ifdef DLT_LINUX_SLL2
+    { DLT_LINUX_SLL2, link_linux_sll2 },
+#else
+    { 276, link_linux_sll2 },
+#endif
+    { DLT_NULL, link_null },
+#ifdef DLT_LOOP
+    { DLT_LOOP, link_null },
+#endif
+    { DLT_RAW, link_ip_version },
+#ifdef DLT_IPV4
+    { DLT_IPV4, link_ip_version },
+#endif
+#ifdef DLT_IPV6
+    { DLT_IPV6, link_ip_version },
+#endif
+};
+
+int
+capture_set_linktype(int type)
+{
+    unsigned int i;
+
+    for (i = 0; i < sizeof(link_decoders) / sizeof(link_decoders[0]); i++) {
+        if (link_decoders[i].linktype == type) {
+            linktype = type;
+            link_decoder = link_decoders[i].decoder;
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * @brief Decode IPv4 header and get its transport data
+ *
+ * @param net IPv4 header
+ * @param caplen Captured bytes from the IPv4 header
+ * @param pkt Filled with packet addresses
+ * @param proto Filled with transport protocol
+ * @param size Filled with transport data size
+ * @return transport header or NULL if not available yet
+ */
+static const u_char *
+capture_ip4_transport(const u_char *net, int caplen, sip_packet_t *pkt, int *proto, int *size)
+{
     // IP header data
-    struct nread_ip *ip;
+    const struct nread_ip *ip = (const struct nread_ip *) net;
     // IP header size
     int size_ip;
+    // Transport header and data (maybe reassembled)
+    const u_char *transport;
+
+    if (caplen < (int) sizeof(struct nread_ip)) return NULL;
+    size_ip = IP_HL(ip) * 4;
+    if (size_ip < (int) sizeof(struct nread_ip) || size_ip > caplen) return NULL;
+
+    // Only interested in UDP and TCP packets
+    if (ip->ip_p != IPPROTO_UDP && ip->ip_p != IPPROTO_TCP) return NULL;
+
+    if (ntohs(ip->ip_off) & (IP_MF | IP_OFFMASK)) {
+        // Wait until all fragments of this datagram are received
+        if (!(transport = ipfrag_add(ip, caplen, pkt->ts, size)))
+            return NULL;
+    } else {
+        transport = net + size_ip;
+        *size = caplen - size_ip;
+        // Ignore link layer padding
+        if (*size > ntohs(ip->ip_len) - size_ip)
+            *size = ntohs(ip->ip_len) - size_ip;
+    }
+
+    pkt->family = AF_INET;
+    pkt->src.v4 = ip->ip_src;
+    pkt->dst.v4 = ip->ip_dst;
+    *proto = ip->ip_p;
+    return transport;
+}
+
+/**
+ * @brief Decode IPv6 header and get its transport data
+ *
+ * Extension headers are skipped until an upper layer header is found.
+ * Fragmented IPv6 datagrams are not reassembled.
+ *
+ * @param net IPv6 header
+ * @param caplen Captured bytes from the IPv6 header
+ * @param pkt Filled with packet addresses
+ * @param proto Filled with transport protocol
+ * @param size Filled with transport data size
+ * @return transport header or NULL if not available
+ */
+static const u_char *
+capture_ip6_transport(const u_char *net, int caplen, sip_packet_t *pkt, int *proto, int *size)
+{
+    // IPv6 header data
+    const struct nread_ip6 *ip6 = (const struct nread_ip6 *) net;
+    // Current extension header
+    const struct nread_ip6_ext *ext;
+    // Current header offset and size
+    int offset = SIZE_IP6, size_ext;
+    // Next header protocol
+    int nxt;
+
+    if (caplen < SIZE_IP6) return NULL;
+
+    // Ignore link layer padding
+    if (caplen > SIZE_IP6 + ntohs(ip6->ip6_plen))
+        caplen = SIZE_IP6 + ntohs(ip6->ip6_plen);
+
+    for (nxt = ip6->ip6_nxt; nxt != IPPROTO_UDP && nxt != IPPROTO_TCP; nxt = ext->ip6e_nxt) {
+        if (caplen < offset + (int) sizeof(struct nread_ip6_ext)) return NULL;
+        ext = (const struct nread_ip6_ext *) (net + offset);
+
+        switch (nxt) {
+            case IPPROTO_HOPOPTS:
+            case IPPROTO_ROUTING:
+            case IPPROTO_DSTOPTS:
+                size_ext = (ext->ip6e_len + 1) * 8;
+                break;
+            case IPPROTO_AH:
+                size_ext = (ext->ip6e_len + 2) * 4;
+                break;
+            case IPPROTO_FRAGMENT:
+                // Only atomic fragments (offset 0 without more fragments)
+                if (caplen < offset + (int) sizeof(struct nread_ip6_frag)
+                    || ntohs(((const struct nread_ip6_frag *) ext)->ip6f_offlg)
+                       & (IP6F_OFF_MASK | IP6F_MORE_FRAG))
+                    return NULL;
+                size_ext = sizeof(struct nread_ip6_frag);
+                break;
+            default:
+                // Not an UDP or TCP packet
+                return NULL;
+        }
+        offset += size_ext;
+    }
+
+    if (offset > caplen) return NULL;
+
+    pkt->family = AF_INET6;
+    pkt->src.v6 = ip6->ip6_src;
+    pkt->dst.v6 = ip6->ip6_dst;
+    *proto = nxt;
+    *size = caplen - offset;
+    return net + offset;
+}
+
+const u_char *
+capture_packet_payload(const struct pcap_pkthdr *header, const u_char *packet,
+                       sip_packet_t *pkt, int *size)
+{
+    // Datalink Header size
+    int size_link;
+    // Network protocol (as ethertype)
+    u_int16_t proto;
+    // Transport protocol
+    int ip_proto;
+    // Transport header and data (maybe reassembled)
+    const u_char *transport;
+    int size_transport;
     // UDP header data
     struct nread_udp *udp;
-    // XXX Fake header (Like the one from ngrep)
-    char msg_header[256];
-    // Packet payload data
-    u_char *msg_payload;
+    // TCP header data
+    struct nread_tcp *tcp;
     // Packet payload size
     int size_payload;
-    // Parsed message data
-    sip_msg_t *msg;
 
-    // Get link header size from datalink type
-    if (linktype == DLT_EN10MB) {
-        eptr = (struct ether_header *) packet;
-        if ((ether_type = ntohs(eptr->ether_type)) != ETHERTYPE_IP) return;
-        size_link = SIZE_ETHERNET;
-    } else if (linktype == DLT_LINUX_SLL) {
-        size_link = SLL_HDR_LEN;
-    } else if (linktype == DLT_NULL) {
-        size_link = DLT_RAW;
+    // Skip link layer headers
+    if (!link_decoder || (size_link = link_decoder(packet, header->caplen, &proto)) < 0)
+        return NULL;
+
+    // Fill packet information
+    memset(pkt, 0, sizeof(sip_packet_t));
+    pkt->ts = (u_int64_t) header->ts.tv_sec * 1000000000 + (u_int64_t) header->ts.tv_usec * 1000;
+
+    // Get transport header
+    if (proto == ETHERTYPE_IP) {
+        transport = capture_ip4_transport(packet + size_link, (int) header->caplen - size_link,
+            pkt, &ip_proto, &size_transport);
+    } else if (proto == ETHERTYPE_IPV6) {
+        transport = capture_ip6_transport(packet + size_link, (int) header->caplen - size_link,
+            pkt, &ip_proto, &size_transport);
     } else {
-        // Something we are not prepared to parse :(
-        fprintf(stderr, "Error handing linktype %d\n", linktype);
-        return;
+        return NULL;
     }
+    if (!transport) return NULL;
 
-    // Get IP header
-    ip = (struct nread_ip*) (packet + size_link);
-    size_ip = IP_HL(ip) * 4;
+    if (ip_proto == IPPROTO_TCP) {
+        // Get TCP header
+        tcp = (struct nread_tcp*) transport;
+        if (size_transport < SIZE_TCP || TH_OFF(tcp) < 5 || TH_OFF(tcp) * 4 > size_transport)
+            return NULL;
+        pkt->sport = ntohs(tcp->th_sport);
+        pkt->dport = ntohs(tcp->th_dport);
+        pkt->transport = SIP_TRANSPORT_TCP;
+
+        // Add segment to its stream and get the first complete message
+        return tcpstream_add(pkt, tcp, transport + TH_OFF(tcp) * 4,
+            size_transport - TH_OFF(tcp) * 4, size);
+    }
 
-    // Only interested in UDP packets
-    if (ip->ip_p != IPPROTO_UDP) return;
+    if (size_transport < SIZE_UDP) return NULL;
 
     // Get UDP header
-    udp = (struct nread_udp*) (packet + size_link + size_ip);
+    udp = (struct nread_udp*) transport;
 
-    // Get package payload
-    msg_payload = (u_char *) (packet + size_link + size_ip + SIZE_UDP);
+    // Get package payload size
     size_payload = htons(udp->udp_hlen) - SIZE_UDP;
-    msg_payload[size_payload] = '\0';
 
-    // XXX Process timestamp
-    struct timeval ut_tv = header->ts;
-    time_t t = (time_t) ut_tv.tv_sec;
+    // Never read beyond the captured data
+    if (size_payload > size_transport - SIZE_UDP)
+        size_payload = size_transport - SIZE_UDP;
+    if (size_payload <= 0) return NULL;
+
+    pkt->sport = ntohs(udp->udp_sport);
+    pkt->dport = ntohs(udp->udp_dport);
+    pkt->transport = SIP_TRANSPORT_UDP;
+
+    *size = size_payload;
+    return transport + SIZE_UDP;
+}
+
+const u_char *
+capture_next_payload(const sip_packet_t *pkt, int *size)
+{
+    // Only TCP segments can contain more than one message
+    if (pkt->transport != SIP_TRANSPORT_TCP) return NULL;
+    return tcpstream_next(size);
+}
+
+int
+capture_load_packet(u_char *mode, const struct pcap_pkthdr *header, const u_char *packet)
+{
+    // Packet information
+    sip_packet_t pkt;
+    // Packet payload data
+    const u_char *payload;
+    // Packet payload size
+    int size;
+
+    // Get package payload
+    if (!(payload = capture_packet_payload(header, packet, &pkt, &size)))
+        return 1;
 
-    // XXX Get current time
-    char timestr[200];
-    struct tm *time = localtime(&t);
-    strftime(timestr, sizeof(timestr), "%Y/%m/%d %T", time);
+    // Parse all messages of this packet
+    for (; payload; payload = capture_next_payload(&pkt, &size)) {
+        pkt.offset = pcapfile_offset(payload);
+        capture_load_payload(mode, &pkt, payload, size);
+    }
+    return 0;
+}
 
-    // XXX Build a header string
-    memset(msg_header, 0, sizeof(msg_header));
-    sprintf(msg_header, "U %s.%06ld ",  timestr, ut_tv.tv_usec);
-    sprintf(msg_header + strlen(msg_header), "%s:%u ",inet_ntoa(ip->ip_src), htons(udp->udp_sport));
-    sprintf(msg_header + strlen(msg_header), "-> %s:%u", inet_ntoa(ip->ip_dst), htons(udp->udp_dport));
+void
+capture_load_payload(u_char *mode, const sip_packet_t *pkt, const u_char *payload, int size)
+{
+    // Parsed message data
+    sip_msg_t *msg;
 
-    // Parse this header and payload
-    if ((msg = sip_load_message(msg_header, (const char*) msg_payload)) && !strcasecmp((const char*)mode, "Online") ) {
+    // Parse this packet information and payload
+    if ((msg = sip_load_packet(pkt, (const char *) payload, size))
+        && !strcasecmp((const char*) mode, "Online")) {
         ui_new_msg_refresh(msg);
     }
+}
 
+void
+capture_dump_packet(const struct pcap_pkthdr *header, const u_char *packet)
+{
     // Store this package in temporal file
     if (pd) {
         pcap_dump((u_char*)pd, header, packet);
+    }
+}
+
+void
+capture_flush_dump()
+{
+    // Write buffered packages to disk
+    if (pd) {
         pcap_dump_flush(pd);
     }
 }
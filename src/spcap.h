@@ -42,13 +42,28 @@
 #include <arpa/inet.h>
 #include <netinet/if_ether.h>
 #include <time.h>
+#include "sip.h"
 
 //! Ethernet headers are always exactly 14 bytes
 #define SIZE_ETHERNET 14
 //! Linux cooked packages headers are 16 bytes
 #define SLL_HDR_LEN 16
+//! Linux cooked v2 packages headers are 20 bytes
+#define SLL2_HDR_LEN 20
+//! VLAN tags are 4 bytes
+#define SIZE_VLAN 4
+//! Maximum stacked VLAN tags we will skip
+#define MAX_VLAN_TAGS 4
+//! IPv6 headers are always exactly 40 bytes
+#define SIZE_IP6 40
 //! UDP  headers are always exactly 8 bytes
 #define SIZE_UDP 8
+//! TCP headers are at least 20 bytes
+#define SIZE_TCP 20
+//! Maximum captured bytes of a single packet
+#define MAX_CAPTURE_LEN 65535
+//! Maximum number of devices captured at the same time
+#define MAX_CAPTURE_DEVICES 16
 
 /**
  * @brief IP data structure
@@ -86,6 +101,52 @@ struct nread_ip
 #define IP_HL(ip)               (((ip)->ip_vhl) & 0x0f)
 #define IP_V(ip)                (((ip)->ip_vhl) >> 4)
 
+/**
+ * @brief IPv6 data structure
+ */
+struct nread_ip6
+{
+    //! version, traffic class, flow label
+    u_int32_t ip6_flow;
+    //! payload length
+    u_int16_t ip6_plen;
+    //! next header
+    u_int8_t ip6_nxt;
+    //! hop limit
+    u_int8_t ip6_hlim;
+    //! source and dest addresses
+    struct in6_addr ip6_src, ip6_dst;
+};
+
+/**
+ * @brief IPv6 extension header
+ */
+struct nread_ip6_ext
+{
+    //! next header
+    u_int8_t ip6e_nxt;
+    //! header length (in 8 bytes units, not including the first 8)
+    u_int8_t ip6e_len;
+};
+
+/**
+ * @brief IPv6 fragment extension header
+ */
+struct nread_ip6_frag
+{
+    //! next header
+    u_int8_t ip6f_nxt;
+    //! reserved
+    u_int8_t ip6f_reserved;
+    //! offset, reserved, and more fragments flag
+    u_int16_t ip6f_offlg;
+    //! identification
+    u_int32_t ip6f_ident;
+};
+
+#define IP6F_OFF_MASK 0xfff8
+#define IP6F_MORE_FRAG 0x0001
+
 /**
  * @brief UDP data structure
  */
@@ -101,6 +162,89 @@ struct nread_udp
     u_short udp_chksum;
 };
 
+/**
+ * @brief TCP data structure
+ */
+struct nread_tcp
+{
+    //! source port
+    u_short th_sport;
+    //! destination port
+    u_short th_dport;
+    //! sequence number
+    u_int32_t th_seq;
+    //! acknowledgement number
+    u_int32_t th_ack;
+    //! data offset, rsvd
+    u_int8_t th_offx2;
+    //! flags
+    u_int8_t th_flags;
+#define TH_FIN  0x01
+#define TH_SYN  0x02
+#define TH_RST  0x04
+    //! window
+    u_short th_win;
+    //! checksum
+    u_short th_sum;
+    //! urgent pointer
+    u_short th_urp;
+};
+
+#define TH_OFF(th)              (((th)->th_offx2 & 0xf0) >> 4)
+
+/**
+ * @brief Capture statistics
+ *
+ * Counters reported by the online capture backend. They are displayed
+ * in the call list so the user knows if some packets were lost.
+ */
+struct capture_stats
+{
+    //! Packets received by the capture backend
+    unsigned long recv;
+    //! Packets dropped by the kernel (socket buffer or ring full)
+    unsigned long drop;
+    //! Packets discarded because parser threads could not keep up
+    unsigned long overflow;
+    //! Packets not stored in temporal file because the writer could not keep up
+    unsigned long unsaved;
+};
+
+/**
+ * @brief Capture file loading status
+ */
+enum capture_load_status
+{
+    //! File is being loaded
+    CAPTURE_LOAD_RUNNING = 0,
+    //! All packets have been loaded
+    CAPTURE_LOAD_DONE,
+    //! File could not be loaded
+    CAPTURE_LOAD_FAILED
+};
+
+/**
+ * @brief Capture file loading progress
+ *
+ * Files are loaded while the call list is displayed, so this progress
+ * is shown in its header.
+ */
+struct capture_load_stats
+{
+    //! Loading status
+    int status;
+    //! Bytes read from the file
+    size_t read;
+    //! File size (0 if unknown)
+    size_t size;
+    //! Packets read from the file
+    unsigned long packets;
+    //! Loading start and end times
+    struct timeval start, end;
+    //! Error message if the file could not be loaded
+    char error[PCAP_ERRBUF_SIZE];
+};
+
 #ifndef WITH_NGREP
 /**
  * @brief Capture in background using libpcap functions
@@ -109,21 +253,76 @@ struct nread_udp
  * pass them to the UI layer. We only use this if ngrep is not available
  * for capturing, becuause it has a lot more options.
  *
+ * If no filter is given, a filter that only accepts SIP packets is
+ * built from capture.filter options.
+ *
+ * Each device listed in capture.device is captured by its own thread
+ * and handle. All of them must have the same datalink type.
+ *
  * @param pargv Filters for libpcap
  * @return 0 on spawn success, 1 otherwise
  */
 extern int
 online_capture(void *pargv);
 
+/**
+ * @brief Prepare parsing and dumping for a capture handle
+ *
+ * Store the datalink type of the given handle and open the temporal
+ * dump file (if enabled) using its link information.
+ *
+ * @param handle LIBPCAP capture handler (can be a dead handler)
+ * @return 0 on success, 1 if the dump file can not be opened
+ */
+extern int
+capture_init_dump(pcap_t *handle);
+
+/**
+ * @brief Add the given counters to capture statistics
+ *
+ * Used by capture backends that read the kernel counters by
+ * themselves.
+ *
+ * @param recv Received packets since last update
+ * @param drop Dropped packets since last update
+ */
+extern void
+capture_add_stats(unsigned long recv, unsigned long drop);
+
+/**
+ * @brief Get current online capture statistics
+ *
+ * @param stats Structure to be filled with current counters
+ */
+extern void
+capture_get_stats(struct capture_stats *stats);
+
 #endif
 
+/**
+ * @brief Select the link layer decoder for a datalink type
+ *
+ * Packets are decoded using the function selected here, so this must
+ * be called before parsing any packet of a capture.
+ *
+ * @param linktype Datalink type (DLT_*) from libpcap
+ * @return 0 if the datalink is supported, 1 otherwise
+ */
+extern int
+capture_set_linktype(int linktype);
+
 /**
  * @brief Read from pcap file and fill sngrep sctuctures
  *
- * This function will use libpcap files and previous structures to
- * parse the pcap file.
+ * This function will use previous structures to parse the pcap file.
+ * pcap and pcapng files are read in place (see pcapfile.h), other
+ * formats are read using libpcap.
  * This program is only focused in VoIP calls so we only consider
- * TCP/UDP packets with Ethernet or Linux coocked headers
+ * TCP/UDP packets over IPv4 or IPv6
+ *
+ * This can be used as a background thread: loaded calls are added to
+ * the calls list and displayed periodically while reading the file,
+ * and reading stops while capture is paused.
  *
  * @param file Full path to PCAP file
  * @return 0 if load has been successfull, 1 otherwise
@@ -132,6 +331,23 @@ online_capture(void *pargv);
 extern int
 load_from_file(const char* file);
 
+/**
+ * @brief Get current capture file loading progress
+ *
+ * @param stats Structure to be filled with current progress
+ */
+extern void
+capture_get_load_stats(struct capture_load_stats *stats);
+
+/**
+ * @brief Resume capture file loading
+ *
+ * File loading waits while the sip.capture option is disabled. This
+ * must be invoked after enabling it again.
+ */
+extern void
+capture_load_resume();
+
 /**
  * @brief Read the next package and parse SIP messages
  *
@@ -144,4 +360,81 @@ load_from_file(const char* file);
 extern void
 parse_packet(u_char *mode, const struct pcap_pkthdr *header, const u_char *packet);
 
+/**
+ * @brief Get the payload of a captured packet
+ *
+ * Decode link (using the decoder selected by capture_set_linktype),
+ * IPv4 or IPv6 and UDP/TCP headers of the packet to locate its
+ * payload. The returned pointer points inside the packet data, that is
+ * never modified, or to reassembly buffers (for fragmented datagrams
+ * and TCP streams).
+ *
+ * TCP segments can contain more than one SIP message, so the rest of
+ * them must be requested using capture_next_payload.
+ *
+ * @param header Packet header from libpcap
+ * @param packet Packet data
+ * @param pkt Filled with packet timestamp, addresses and ports
+ * @param size Filled with payload size
+ * @return pointer to packet payload or NULL if there is no payload
+ */
+extern const u_char *
+capture_packet_payload(const struct pcap_pkthdr *header, const u_char *packet,
+                       sip_packet_t *pkt, int *size);
+
+/**
+ * @brief Get the next payload of the last decoded packet
+ *
+ * @param pkt Packet information filled by capture_packet_payload
+ * @param size Filled with payload size
+ * @return pointer to next payload or NULL if there are no more
+ */
+extern const u_char *
+capture_next_payload(const sip_packet_t *pkt, int *size);
+
+/**
+ * @brief Add a decoded payload to the SIP storage layer
+ *
+ * @param mode Capture mode (Online or Offline)
+ * @param pkt Packet information
+ * @param payload Packet payload
+ * @param size Payload size
+ */
+extern void
+capture_load_payload(u_char *mode, const sip_packet_t *pkt, const u_char *payload, int size);
+
+/**
+ * @brief Add the packet payload to the SIP storage layer
+ *
+ * This is the parsing part of parse_packet, without storing the
+ * packet in the temporal file. It can be invoked from multiple
+ * threads as long as packets of the same dialog are always parsed
+ * by the same thread.
+ *
+ * @param mode Capture mode (Online or Offline)
+ * @param header Packet header from libpcap
+ * @param packet Packet data
+ * @return 0 if the packet has a payload, 1 otherwise
+ */
+extern int
+capture_load_packet(u_char *mode, const struct pcap_pkthdr *header, const u_char *packet);
+
+/**
+ * @brief Store a packet in the temporal file (if any)
+ *
+ * Packet is stored in the file buffer, it won't be written to disk
+ * until the buffer is full or capture_flush_dump is called.
+ *
+ * @param header Packet header from libpcap
+ * @param packet Packet data
+ */
+extern void
+capture_dump_packet(const struct pcap_pkthdr *header, const u_char *packet);
+
+/**
+ * @brief Write buffered packets of the temporal file (if any)
+ */
+extern void
+capture_flush_dump();
+
 #endif
@@ -0,0 +1,609 @@
+/**************************************************************************
+ **
+ ** sngrep - SIP callflow viewer using ngrep
+ **
+ ** Copyright (C) 2013 Ivan Alonso (Kaian)
+ ** Copyright (C) 2013 Irontec SL. All rights reserved.
+ **
+ ** This program is free software: you can redistribute it and/or modify
+ ** it under the terms of the GNU General Public License as published by
+ ** the Free Software Foundation, either version 3 of the License, or
+ ** (at your option) any later version.
+ **
+ ** This program is distributed in the hope that it will be useful,
+ ** but WITHOUT ANY WARRANTY; without even the implied warranty of
+ ** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ ** GNU General Public License for more details.
+ **
+ ** You should have received a copy of the GNU General Public License
+ ** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ **
+ ****************************************************************************/
+#ifdef WITH_LIBPCAP
+/**
+ * @file tcpstream.c
+ * @author Ivan Alonso [aka Kaian] <kaian@irontec.com>
+ *
+ * @brief Source of functions defined in tcpstream.h
+ *
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include "tcpstream.h"
+#include "option.h"
+
+//! Smallest stream buffer size
+#define TCP_BUFFER_MIN 2048
+//! Number of stream buffer sizes (from 2KB to 128KB)
+#define TCP_BUFFER_CLASSES 7
+
+//! Shorter declaration of tcpflow structure
+typedef struct tcpflow tcpflow_t;
+
+/**
+ * @brief One direction of a TCP connection
+ */
+struct tcpflow
+{
+    //! Address family
+    int family;
+    //! Source and destination addresses
+    struct in6_addr src, dst;
+    //! Source and destination ports
+    u_int16_t sport, dport;
+    //! Next expected sequence number
+    u_int32_t seq;
+    //! Stream is positioned at the start of a SIP message
+    int sync;
+    //! Buffered stream data (partial message)
+    u_char *data;
+    //! Buffered bytes
+    int len;
+    //! Buffer size class
+    int class;
+    //! Last activity timestamp
+    u_int64_t ts;
+    //! Table bucket of this flow
+    unsigned int bucket;
+    //! Next flow in the same bucket (or in the unused list)
+    tcpflow_t *hnext;
+    //! Flows list ordered by last activity
+    tcpflow_t *prev, *next;
+};
+
+//! Preallocated flows
+static tcpflow_t *pool = NULL;
+//! Unused flows
+static tcpflow_t *unused = NULL;
+//! Hash table buckets
+static tcpflow_t **buckets = NULL;
+//! Number of buckets - 1
+static unsigned int bucket_mask;
+//! Least and most recently used flows
+static tcpflow_t *oldest = NULL, *newest = NULL;
+//! Unused buffers of each size class
+static u_char *buffers[TCP_BUFFER_CLASSES];
+//! Bytes allocated for stream buffers
+static size_t memory = 0;
+//! Configured limits
+static size_t max_memory;
+static u_int64_t timeout;
+//! Reassembly counters
+static struct tcpstream_stats stats;
+
+//! Flow of the last added segment
+static tcpflow_t *cur_flow = NULL;
+//! Data not yet splitted into messages
+static const u_char *cur_data, *cur_end;
+//! Data points to flow buffer (instead of segment data)
+static int cur_buffered;
+//! Last added segment closes the flow
+static int cur_close;
+
+/**
+ * @brief Allocate the flow pool and hash table
+ *
+ * @return 0 on success, 1 otherwise
+ */
+static int
+tcpstream_init()
+{
+    int i, max;
+    unsigned int nbuckets = 16;
+
+    if ((max = get_option_int_value("capture.tcp.max")) < 1) max = 1;
+    max_memory = get_option_int_value("capture.tcp.memory");
+    timeout = (u_int64_t) get_option_int_value("capture.tcp.timeout") * 1000000000;
+
+    // Twice buckets than flows keeps chains short
+    while (nbuckets < (unsigned int) max * 2)
+        nbuckets <<= 1;
+
+    if (!(pool = malloc(sizeof(tcpflow_t) * max))) return 1;
+    if (!(buckets = calloc(nbuckets, sizeof(tcpflow_t *)))) {
+        free(pool);
+        pool = NULL;
+        return 1;
+    }
+    bucket_mask = nbuckets - 1;
+
+    // All flows are unused
+    for (i = 0; i < max; i++) {
+        pool[i].hnext = unused;
+        unused = &pool[i];
+    }
+    return 0;
+}
+
+/**
+ * @brief Get table bucket of a flow
+ */
+static unsigned int
+tcpstream_hash(const sip_packet_t *pkt)
+{
+    const u_int32_t *src = (const u_int32_t *) &pkt->src, *dst = (const u_int32_t *) &pkt->dst;
+    unsigned int hash;
+    int i, words = (pkt->family == AF_INET) ? 1 : 4;
+
+    hash = ((unsigned int) pkt->sport << 16 | pkt->dport) * 2654435761U;
+    for (i = 0; i < words; i++) {
+        hash ^= src[i] * 2246822519U;
+        hash ^= dst[i] * 3266489917U;
+        hash = (hash << 13) | (hash >> 19);
+    }
+    return (hash ^ (hash >> 16)) & bucket_mask;
+}
+
+/**
+ * @brief Check if a flow matches packet addresses and ports
+ */
+static int
+tcpstream_match(const tcpflow_t *flow, const sip_packet_t *pkt)
+{
+    size_t alen = (pkt->family == AF_INET) ? sizeof(struct in_addr) : sizeof(struct in6_addr);
+
+    return flow->family == pkt->family && flow->sport == pkt->sport && flow->dport == pkt->dport
+        && !memcmp(&flow->src, &pkt->src, alen) && !memcmp(&flow->dst, &pkt->dst, alen);
+}
+
+/**
+ * @brief Get the size class for a buffer of the given size
+ *
+ * @return size class or -1 if size is too big
+ */
+static int
+tcpstream_class(int size)
+{
+    int class = 0;
+
+    while (class < TCP_BUFFER_CLASSES && (TCP_BUFFER_MIN << class) < size)
+        class++;
+    return (class < TCP_BUFFER_CLASSES) ? class : -1;
+}
+
+/**
+ * @brief Free all unused buffers
+ *
+ * @return 1 if any buffer has been freed, 0 otherwise
+ */
+static int
+tcpstream_trim()
+{
+    u_char *buffer;
+    int class, freed = 0;
+
+    for (class = 0; class < TCP_BUFFER_CLASSES; class++) {
+        while ((buffer = buffers[class])) {
+            buffers[class] = *(u_char **) buffer;
+            free(buffer);
+            memory -= TCP_BUFFER_MIN << class;
+            freed = 1;
+        }
+    }
+    return freed;
+}
+
+/**
+ * @brief Return a buffer to the unused list of its class
+ */
+static void
+tcpstream_put_buffer(u_char *buffer, int class)
+{
+    *(u_char **) buffer = buffers[class];
+    buffers[class] = buffer;
+}
+
+/**
+ * @brief Remove a flow from the table and release its buffer
+ */
+static void
+tcpstream_release(tcpflow_t *flow)
+{
+    tcpflow_t **cur;
+
+    // Remove from its bucket
+    for (cur = &buckets[flow->bucket]; *cur; cur = &(*cur)->hnext) {
+        if (*cur == flow) {
+            *cur = flow->hnext;
+            break;
+        }
+    }
+
+    // Remove from usage list
+    if (flow->prev) flow->prev->next = flow->next;
+    else oldest = flow->next;
+    if (flow->next) flow->next->prev = flow->prev;
+    else newest = flow->prev;
+
+    // Return buffer to the pool
+    if (flow->data) tcpstream_put_buffer(flow->data, flow->class);
+    flow->data = NULL;
+
+    flow->hnext = unused;
+    unused = flow;
+    stats.flows--;
+}
+
+/**
+ * @brief Discard the least recently used flow
+ */
+static void
+tcpstream_evict()
+{
+    tcpstream_release(oldest);
+    stats.evicted++;
+}
+
+/**
+ * @brief Get a buffer from the pool
+ *
+ * If there is no unused buffer of the requested class, a new one is
+ * allocated. Unused buffers of other classes and least recently used
+ * flows are released if required to keep memory under the limit.
+ *
+ * @param class Buffer size class
+ * @param keep Flow that must not be evicted
+ * @return buffer or NULL if it can not be allocated
+ */
+static u_char *
+tcpstream_get_buffer(int class, tcpflow_t *keep)
+{
+    u_char *buffer;
+    size_t size = TCP_BUFFER_MIN << class;
+
+    if ((buffer = buffers[class])) {
+        buffers[class] = *(u_char **) buffer;
+        return buffer;
+    }
+
+    while (memory + size > max_memory) {
+        if (tcpstream_trim()) continue;
+        if (!oldest || oldest == keep) return NULL;
+        tcpstream_evict();
+    }
+
+    if (!(buffer = malloc(size))) return NULL;
+    memory += size;
+    return buffer;
+}
+
+/**
+ * @brief Append data to flow buffer
+ *
+ * @return 0 on success, 1 if data can not be buffered
+ */
+static int
+tcpstream_store(tcpflow_t *flow, const u_char *data, int len)
+{
+    u_char *buffer;
+    int class;
+
+    // Get a bigger buffer if required
+    if (!flow->data || flow->len + len > (TCP_BUFFER_MIN << flow->class)) {
+        if ((class = tcpstream_class(flow->len + len)) < 0) return 1;
+        if (!(buffer = tcpstream_get_buffer(class, flow))) return 1;
+        if (flow->data) {
+            memcpy(buffer, flow->data, flow->len);
+            tcpstream_put_buffer(flow->data, flow->class);
+        }
+        flow->data = buffer;
+        flow->class = class;
+    }
+
+    memcpy(flow->data + flow->len, data, len);
+    flow->len += len;
+    return 0;
+}
+
+/**
+ * @brief Discard buffered data of a flow
+ *
+ * Flow will look for the start of next message.
+ */
+static void
+tcpstream_reset(tcpflow_t *flow)
+{
+    if (flow->data) tcpstream_put_buffer(flow->data, flow->class);
+    flow->data = NULL;
+    flow->len = 0;
+    flow->sync = 0;
+}
+
+/**
+ * @brief Find the flow of a packet or create a new one
+ *
+ * @param pkt Packet information
+ * @param seq Sequence number of packet data (for new flows)
+ * @param create Create the flow if not found
+ * @return flow or NULL if it can not be created
+ */
+static tcpflow_t *
+tcpstream_get(const sip_packet_t *pkt, u_int32_t seq, int create)
+{
+    tcpflow_t *flow;
+    unsigned int bucket = tcpstream_hash(pkt);
+
+    for (flow = buckets[bucket]; flow; flow = flow->hnext) {
+        if (tcpstream_match(flow, pkt)) return flow;
+    }
+
+    if (!create) return NULL;
+
+    // Make room for this flow
+    if (!unused) {
+        if (!oldest) return NULL;
+        tcpstream_evict();
+    }
+
+    flow = unused;
+    unused = flow->hnext;
+    memset(flow, 0, sizeof(tcpflow_t));
+    flow->family = pkt->family;
+    memcpy(&flow->src, &pkt->src, sizeof(flow->src));
+    memcpy(&flow->dst, &pkt->dst, sizeof(flow->dst));
+    flow->sport = pkt->sport;
+    flow->dport = pkt->dport;
+    flow->seq = seq;
+
+    // Add to its bucket
+    flow->bucket = bucket;
+    flow->hnext = buckets[bucket];
+    buckets[bucket] = flow;
+
+    // Add to the end of usage list
+    flow->prev = newest;
+    if (newest) newest->next = flow;
+    else oldest = flow;
+    newest = flow;
+    stats.flows++;
+    return flow;
+}
+
+/**
+ * @brief Mark the flow as most recently used
+ */
+static void
+tcpstream_touch(tcpflow_t *flow, u_int64_t ts)
+{
+    flow->ts = ts;
+    if (flow == newest) return;
+
+    // Remove from its position
+    if (flow->prev) flow->prev->next = flow->next;
+    else oldest = flow->next;
+    flow->next->prev = flow->prev;
+
+    // Add to the end
+    flow->prev = newest;
+    flow->next = NULL;
+    newest->next = flow;
+    newest = flow;
+}
+
+/**
+ * @brief Check if data starts with a SIP request or response line
+ */
+static int
+tcpstream_is_start(const u_char *data, int len)
+{
+    int i;
+
+    if (len >= 8 && !strncmp((const char *) data, "SIP/2.0 ", 8)) return 1;
+
+    // Request methods are uppercase tokens followed by a space
+    for (i = 0; i < len && isupper(data[i]); i++)
+        ;
+    return (i >= 3 && i < len && data[i] == ' ');
+}
+
+/**
+ * @brief Get the size of the SIP message at the start of data
+ *
+ * Message size is the size of its headers plus the value of its
+ * Content-Length header (0 if not present).
+ *
+ * @return message size, -1 if message is not complete or 0 if it's
+ * not a valid message
+ */
+static int
+tcpstream_msglen(const u_char *data, int len)
+{
+    const u_char *line = data, *end = data + len, *eol, *value;
+    int hlen, clen = 0;
+
+    for (;;) {
+        if (!(eol = memchr(line, '\n', end - line))) {
+            // Headers never end
+            return (len > MAX_CAPTURE_LEN) ? 0 : -1;
+        }
+
+        // Empty line marks the end of headers
+        if (eol == line || (eol == line + 1 && *line == '\r')) {
+            hlen = eol + 1 - data;
+            if (hlen + clen > MAX_CAPTURE_LEN) return 0;
+            return (hlen + clen <= len) ? hlen + clen : -1;
+        }
+
+        // Check Content-Length header (long and compact forms)
+        value = NULL;
+        if (eol - line > 14 && !strncasecmp((const char *) line, "Content-Length", 14)) {
+            value = line + 14;
+        } else if ((*line == 'l' || *line == 'L') && (line[1] == ':' || line[1] == ' ')) {
+            value = line + 1;
+        }
+        if (value) {
+            while (value < eol && (*value == ' ' || *value == '\t'))
+                value++;
+            if (value < eol && *value == ':') {
+                for (value++; value < eol && (*value == ' ' || *value == '\t'); value++)
+                    ;
+                for (clen = 0; value < eol && isdigit(*value) && clen <= MAX_CAPTURE_LEN; value++)
+                    clen = clen * 10 + (*value - '0');
+            }
+        }
+        line = eol + 1;
+    }
+}
+
+const u_char *
+tcpstream_add(const sip_packet_t *pkt, const struct nread_tcp *tcp, const u_char *data, int len,
+              int *size)
+{
+    tcpflow_t *flow;
+    u_int32_t seq = ntohl(tcp->th_seq);
+    u_int32_t next = seq + len;
+    int32_t diff;
+
+    // Allocate table the first time
+    if (!pool && tcpstream_init() != 0) return NULL;
+
+    // Release idle flows
+    while (oldest && oldest->ts + timeout < pkt->ts) {
+        tcpstream_release(oldest);
+        stats.expired++;
+    }
+
+    // A new connection replaces any previous flow with the same addresses
+    if (tcp->th_flags & TH_SYN) {
+        if ((flow = tcpstream_get(pkt, seq, 0))) tcpstream_release(flow);
+        return NULL;
+    }
+
+    // Only segments with data create new flows
+    if (!(flow = tcpstream_get(pkt, seq, len > 0))) return NULL;
+    tcpstream_touch(flow, pkt->ts);
+
+    // Compare with expected sequence number
+    diff = (int32_t) (seq - flow->seq);
+    if (diff < 0) {
+        // Skip retransmitted data
+        if (-diff >= len) {
+            len = 0;
+        } else {
+            data -= diff;
+            len += diff;
+        }
+    } else if (diff > 0) {
+        // Some data is missing, look for the next message start
+        tcpstream_reset(flow);
+        stats.gaps++;
+    }
+    if (len > 0) flow->seq = next;
+
+    // Split messages from segment data if there is nothing buffered
+    cur_flow = flow;
+    cur_close = tcp->th_flags & (TH_FIN | TH_RST);
+    cur_buffered = 0;
+    cur_data = data;
+    cur_end = data + len;
+
+    // Otherwise append segment to the buffered data
+    if (flow->len) {
+        if (tcpstream_store(flow, data, len) == 0) {
+            cur_buffered = 1;
+            cur_data = flow->data;
+            cur_end = flow->data + flow->len;
+        } else {
+            tcpstream_reset(flow);
+            stats.gaps++;
+        }
+    }
+
+    return tcpstream_next(size);
+}
+
+const u_char *
+tcpstream_next(int *size)
+{
+    tcpflow_t *flow = cur_flow;
+    const u_char *msg, *eol;
+    int msglen, rest;
+
+    if (!flow) return NULL;
+
+    while (cur_data < cur_end) {
+        // Skip keep-alives between messages
+        if (*cur_data == '\r' || *cur_data == '\n') {
+            cur_data++;
+            continue;
+        }
+        if (flow->sync) break;
+
+        // Wait for a full line to look for a message start
+        if (!(eol = memchr(cur_data, '\n', cur_end - cur_data))) break;
+        if (tcpstream_is_start(cur_data, eol - cur_data)) {
+            flow->sync = 1;
+            break;
+        }
+        // Discard this line
+        cur_data = eol + 1;
+    }
+
+    if (flow->sync && cur_data < cur_end) {
+        msglen = tcpstream_msglen(cur_data, cur_end - cur_data);
+        if (msglen > 0) {
+            msg = cur_data;
+            cur_data += msglen;
+            stats.messages++;
+            *size = msglen;
+            return msg;
+        }
+        if (msglen == 0) {
+            // Not a valid message, look for the next one
+            flow->sync = 0;
+            cur_data = cur_end;
+            stats.gaps++;
+        }
+    }
+
+    // No more complete messages, keep the rest for next segments
+    cur_flow = NULL;
+    if (cur_close) {
+        tcpstream_release(flow);
+        return NULL;
+    }
+
+    rest = cur_end - cur_data;
+    if (cur_buffered) {
+        memmove(flow->data, cur_data, rest);
+        flow->len = rest;
+        if (!rest) {
+            tcpstream_put_buffer(flow->data, flow->class);
+            flow->data = NULL;
+        }
+    } else if (rest && tcpstream_store(flow, cur_data, rest) != 0) {
+        tcpstream_reset(flow);
+        stats.gaps++;
+    }
+    return NULL;
+}
+
+void
+tcpstream_get_stats(struct tcpstream_stats *tstats)
+{
+    memcpy(tstats, &stats, sizeof(struct tcpstream_stats));
+}
+
+#endif
@@ -0,0 +1,111 @@
+/**************************************************************************
+ **
+ ** sngrep - SIP callflow viewer using ngrep
+ **
+ ** Copyright (C) 2013 Ivan Alonso (Kaian)
+ ** Copyright (C) 2013 Irontec SL. All rights reserved.
+ **
+ ** This program is free software: you can redistribute it and/or modify
+ ** it under the terms of the GNU General Public License as published by
+ ** the Free Software Foundation, either version 3 of the License, or
+ ** (at your option) any later version.
+ **
+ ** This program is distributed in the hope that it will be useful,
+ ** but WITHOUT ANY WARRANTY; without even the implied warranty of
+ ** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ ** GNU General Public License for more details.
+ **
+ ** You should have received a copy of the GNU General Public License
+ ** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ **
+ ****************************************************************************/
+/**
+ * @file tcpstream.h
+ * @author Ivan Alonso [aka Kaian] <kaian@irontec.com>
+ *
+ * @brief Functions to extract SIP messages from TCP streams
+ *
+ * Each direction of a TCP connection is a flow, indexed by its source and
+ * destination addresses and ports. Segments are appended to the flow in
+ * sequence order and SIP messages are split using their Content-Length
+ * header, so a segment can contain several messages and a message can
+ * span several segments.
+ *
+ * Segments containing only complete messages are never copied. Partial
+ * messages are stored in buffers taken from a pool shared by all flows.
+ *
+ * Memory used is limited using the following options:
+ *
+ *  - capture.tcp.max      Maximum flows being reassembled
+ *  - capture.tcp.memory   Maximum bytes of buffered stream data
+ *  - capture.tcp.timeout  Seconds before an idle flow is released
+ *
+ * When any limit is reached, the least recently used flow is discarded.
+ *
+ * The flows table is process-global and not thread-safe: all segments
+ * must be added by the same thread. Payloads are only decoded by the
+ * pipeline dispatcher thread in online mode, or by the file reader
+ * thread in offline mode, never by both in the same process.
+ */
+#ifndef __SNGREP_TCPSTREAM_H
+#define __SNGREP_TCPSTREAM_H
+
+#include "spcap.h"
+
+/**
+ * @brief Stream reassembly counters
+ */
+struct tcpstream_stats
+{
+    //! Flows being reassembled
+    unsigned long flows;
+    //! SIP messages extracted from streams
+    unsigned long messages;
+    //! Flows released after being idle
+    unsigned long expired;
+    //! Flows discarded to keep the table within its limits
+    unsigned long evicted;
+    //! Stream data discarded (lost segments or malformed messages)
+    unsigned long gaps;
+};
+
+/**
+ * @brief Add a TCP segment to its flow
+ *
+ * Returns the first complete SIP message of the flow, if any. Following
+ * messages must be requested using tcpstream_next until it returns NULL.
+ * Returned messages are only valid until the next call to any of these
+ * functions.
+ *
+ * @param pkt Packet information (addresses, ports and timestamp)
+ * @param tcp TCP header of the segment
+ * @param data Segment data
+ * @param len Segment data size
+ * @param size Filled with message size
+ * @return pointer to a SIP message or NULL
+ */
+extern const u_char *
+tcpstream_add(const sip_packet_t *pkt, const struct nread_tcp *tcp, const u_char *data, int len,
+              int *size);
+
+/**
+ * @brief Get next complete SIP message from the last added segment
+ *
+ * @param size Filled with message size
+ * @return pointer to a SIP message or NULL
+ */
+extern const u_char *
+tcpstream_next(int *size);
+
+/**
+ * @brief Get current stream reassembly counters
+ *
+ * This can be called from any thread. Counters are copied without
+ * lock, so they may be slightly outdated.
+ *
+ * @param stats Structure to be filled with current counters
+ */
+extern void
+tcpstream_get_stats(struct tcpstream_stats *stats);
+
+#endif
@@ -0,0 +1,456 @@
+/**************************************************************************
+ **
+ ** sngrep - SIP callflow viewer using ngrep
+ **
+ ** Copyright (C) 2013 Ivan Alonso (Kaian)
+ ** Copyright (C) 2013 Irontec SL. All rights reserved.
+ **
+ ** This program is free software: you can redistribute it and/or modify
+ ** it under the terms of the GNU General Public License as published by
+ ** the Free Software Foundation, either version 3 of the License, or
+ ** (at your option) any later version.
+ **
+ ** This program is distributed in the hope that it will be useful,
+ ** but WITHOUT ANY WARRANTY; without even the implied warranty of
+ ** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ ** GNU General Public License for more details.
+ **
+ ** You should have received a copy of the GNU General Public License
+ ** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ **
+ ****************************************************************************/
+#if defined(WITH_LIBPCAP) && !defined(WITH_NGREP)
+/**
+ * @file tpacket.c
+ * @author Ivan Alonso [aka Kaian] <kaian@irontec.com>
+ *
+ * @brief Source of functions defined in tpacket.h
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <net/if.h>
+#include <linux/if_packet.h>
+#include <linux/if_ether.h>
+#include <linux/filter.h>
+#include "tpacket.h"
+#include "pipeline.h"
+#include "option.h"
+
+#ifdef TPACKET3_HDRLEN
+
+//! Default frame size hint for the ring request
+#define TPACKET_FRAME_SIZE 2048
+//! Kernel statistics are read after this number of blocks
+#define TPACKET_STATS_BLOCKS 64
+
+//! Loopback interface index
+static int lo_ifindex = 0;
+//! Filter run in userspace when the kernel can not run it (or NULL)
+static struct bpf_program *user_filter = NULL;
+//! Device capture threads must stop
+static int tpacket_stop = 0;
+
+/**
+ * @brief Read and accumulate kernel ring statistics
+ *
+ * PACKET_STATISTICS counters are reset after each read, so we
+ * add them to the global capture statistics.
+ *
+ * @param fd Packet socket descriptor
+ */
+static void
+tpacket_update_stats(int fd)
+{
+    struct tpacket_stats_v3 tstats;
+    socklen_t len = sizeof(tstats);
+
+    if (getsockopt(fd, SOL_PACKET, PACKET_STATISTICS, &tstats, &len) == 0) {
+        capture_add_stats(tstats.tp_packets, tstats.tp_drops);
+    }
+}
+
+/**
+ * @brief Capture ring of a device
+ */
+struct tpacket_ring
+{
+    //! Packet socket
+    int fd;
+    //! Ring request
+    struct tpacket_req3 req;
+    //! Mapped ring
+    u_char *map;
+    //! Pipeline input for this device
+    u_char *input;
+    //! Cooked socket (frames without link header)
+    int cooked;
+};
+
+/**
+ * @brief Linux cooked header
+ *
+ * Cooked sockets don't receive the link header of the frames, so this
+ * header is built from the link information and stored in place just
+ * before the frame network header, as libpcap does.
+ */
+struct tpacket_sll_header
+{
+    u_int16_t pkttype;
+    u_int16_t hatype;
+    u_int16_t halen;
+    u_int8_t addr[8];
+    u_int16_t protocol;
+};
+
+/**
+ * @brief Parse all frames of a ring block
+ *
+ * Frames are passed to the parser pipeline pointing directly to the
+ * ring memory. The block is not returned to the kernel here.
+ * Like libpcap does, outgoing loopback frames are skipped because
+ * they will be received again as incoming.
+ *
+ * @param block Block descriptor filled by the kernel
+ * @param tp Ring of the block
+ */
+static void
+tpacket_walk_block(struct tpacket_block_desc *block, struct tpacket_ring *tp)
+{
+    struct tpacket3_hdr *frame;
+    struct sockaddr_ll *sll;
+    struct tpacket_sll_header *cooked;
+    struct pcap_pkthdr header;
+    u_char *data;
+    unsigned int i;
+
+    frame = (struct tpacket3_hdr *) ((u_char *) block + block->hdr.bh1.offset_to_first_pkt);
+    for (i = 0; i < block->hdr.bh1.num_pkts; i++) {
+        // Link information is stored after the frame header
+        sll = (struct sockaddr_ll *) ((u_char *) frame
+            + TPACKET_ALIGN(sizeof(struct tpacket3_hdr)));
+        if (sll->sll_pkttype == PACKET_OUTGOING && sll->sll_ifindex == lo_ifindex) {
+            frame = (struct tpacket3_hdr *) ((u_char *) frame + frame->tp_next_offset);
+            continue;
+        }
+
+        // Build libpcap header from frame information
+        header.ts.tv_sec = frame->tp_sec;
+        header.ts.tv_usec = frame->tp_nsec / 1000;
+        header.caplen = frame->tp_snaplen;
+        header.len = frame->tp_len;
+        data = (u_char *) frame + frame->tp_mac;
+
+        // Kernel leaves room for the cooked header before network header
+        if (tp->cooked) {
+            data -= SLL_HDR_LEN;
+            cooked = (struct tpacket_sll_header *) data;
+            cooked->pkttype = htons(sll->sll_pkttype);
+            cooked->hatype = htons(sll->sll_hatype);
+            cooked->halen = htons(sll->sll_halen);
+            memcpy(cooked->addr, sll->sll_addr, sizeof(cooked->addr));
+            cooked->protocol = sll->sll_protocol;
+            header.caplen += SLL_HDR_LEN;
+            header.len += SLL_HDR_LEN;
+        }
+
+        // Pass the frame to parser threads
+        if (!user_filter || pcap_offline_filter(user_filter, &header, data)) {
+            pipeline_push(tp->input, &header, data);
+        }
+
+        // Move to the next frame in this block
+        frame = (struct tpacket3_hdr *) ((u_char *) frame + frame->tp_next_offset);
+    }
+}
+
+/**
+ * @brief Unmap the ring and close the packet socket of a device
+ */
+static void
+tpacket_close(struct tpacket_ring *tp)
+{
+    if (tp->map != MAP_FAILED) {
+        munmap(tp->map, (size_t) tp->req.tp_block_size * tp->req.tp_block_nr);
+        tp->map = MAP_FAILED;
+    }
+    close(tp->fd);
+}
+
+/**
+ * @brief Adapt a filter compiled for Linux cooked headers to cooked sockets
+ *
+ * The kernel runs the filter of cooked sockets on the network header,
+ * without the cooked header the filter has been compiled for. As libpcap
+ * does, loads from cooked header fields are replaced with the ancillary
+ * data loads of the kernel and the rest of loads are moved back.
+ *
+ * @param prog Filter instructions (modified in place)
+ * @return 0 on success, 1 if the kernel can not run this filter
+ */
+static int
+tpacket_cooked_filter(struct sock_fprog *prog)
+{
+    struct sock_filter *insn;
+    unsigned int i;
+
+    for (i = 0; i < prog->len; i++) {
+        insn = &prog->filter[i];
+        // Only packet data loads are modified
+        if (BPF_CLASS(insn->code) != BPF_LD && BPF_CLASS(insn->code) != BPF_LDX) continue;
+        if (BPF_MODE(insn->code) != BPF_ABS && BPF_MODE(insn->code) != BPF_IND
+            && BPF_MODE(insn->code) != BPF_MSH) continue;
+
+        if (insn->k >= SLL_HDR_LEN) {
+            insn->k -= SLL_HDR_LEN;
+        } else if (insn->k == 0) {
+            insn->k = SKF_AD_OFF + SKF_AD_PKTTYPE;
+        } else if (insn->k == 14) {
+            insn->k = SKF_AD_OFF + SKF_AD_PROTOCOL;
+        } else {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Open a packet socket for a device and map its ring
+ *
+ * @param tp Ring structure with the requested geometry and socket type
+ * @param device Device name (any for all devices)
+ * @param prog Compiled filter (or NULL)
+ * @return 0 on success, 2 on error
+ */
+static int
+tpacket_open(struct tpacket_ring *tp, const char *device, struct sock_fprog *prog)
+{
+    //! Bind to the device
+    struct sockaddr_ll sll;
+    int version = TPACKET_V3;
+
+    tp->map = MAP_FAILED;
+    memset(&sll, 0, sizeof(sll));
+    sll.sll_family = AF_PACKET;
+    sll.sll_protocol = htons(ETH_P_ALL);
+    if (strcmp(device, "any") && !(sll.sll_ifindex = if_nametoindex(device))) {
+        fprintf(stderr, "Couldn't find device %s\n", device);
+        return 2;
+    }
+
+    if ((tp->fd = socket(AF_PACKET, tp->cooked ? SOCK_DGRAM : SOCK_RAW, htons(ETH_P_ALL))) == -1) {
+        fprintf(stderr, "Couldn't open packet socket: %s\n", strerror(errno));
+        return 2;
+    }
+
+    if (setsockopt(tp->fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) == -1) {
+        fprintf(stderr, "Couldn't set TPACKET_V3: %s\n", strerror(errno));
+        goto error;
+    }
+
+    // Attach the filter before mapping the ring
+    if (prog && setsockopt(tp->fd, SOL_SOCKET, SO_ATTACH_FILTER, prog, sizeof(*prog)) == -1) {
+        fprintf(stderr, "Couldn't install filter on %s: %s\n", device, strerror(errno));
+        goto error;
+    }
+
+    if (setsockopt(tp->fd, SOL_PACKET, PACKET_RX_RING, &tp->req, sizeof(tp->req)) == -1) {
+        fprintf(stderr, "Couldn't create TPACKET ring: %s\n", strerror(errno));
+        goto error;
+    }
+
+    tp->map = mmap(NULL, (size_t) tp->req.tp_block_size * tp->req.tp_block_nr,
+        PROT_READ | PROT_WRITE, MAP_SHARED, tp->fd, 0);
+    if (tp->map == MAP_FAILED) {
+        fprintf(stderr, "Couldn't map TPACKET ring: %s\n", strerror(errno));
+        goto error;
+    }
+
+    if (bind(tp->fd, (struct sockaddr *) &sll, sizeof(sll)) == -1) {
+        fprintf(stderr, "Couldn't bind packet socket to %s: %s\n", device, strerror(errno));
+        goto error;
+    }
+    return 0;
+
+error:
+    tpacket_close(tp);
+    return 2;
+}
+
+/**
+ * @brief Capture thread of a device ring
+ *
+ * Walk each block released by the kernel and give it back once all
+ * its frames have been passed to the parser pipeline.
+ *
+ * @param arg Ring structure
+ */
+static void *
+tpacket_loop(void *arg)
+{
+    struct tpacket_ring *tp = (struct tpacket_ring *) arg;
+    //! Ring block currently being read
+    struct tpacket_block_desc *block;
+    unsigned int blocknum = 0, walked = 0;
+    struct pollfd pfd;
+
+    pfd.fd = tp->fd;
+    pfd.events = POLLIN | POLLERR;
+
+    while (!__atomic_load_n(&tpacket_stop, __ATOMIC_ACQUIRE)) {
+        block = (struct tpacket_block_desc *) (tp->map
+            + (size_t) blocknum * tp->req.tp_block_size);
+
+        // Wait until kernel releases this block
+        if (!(block->hdr.bh1.block_status & TP_STATUS_USER)) {
+            pfd.revents = 0;
+            poll(&pfd, 1, 1000);
+            tpacket_update_stats(tp->fd);
+            continue;
+        }
+
+        // Parse the whole batch of frames
+        tpacket_walk_block(block, tp);
+
+        // Give the block back to the kernel
+        __sync_synchronize();
+        block->hdr.bh1.block_status = TP_STATUS_KERNEL;
+        blocknum = (blocknum + 1) % tp->req.tp_block_nr;
+
+        // Kernel never stops filling blocks under load, read drops anyway
+        if (++walked % TPACKET_STATS_BLOCKS == 0) {
+            tpacket_update_stats(tp->fd);
+        }
+    }
+
+    return NULL;
+}
+
+int
+tpacket_capture(const char *filter_exp, const char **devices, int count)
+{
+    //! Rings of each device
+    static struct tpacket_ring rings[MAX_CAPTURE_DEVICES];
+    //! The compiled filter expression (kept if run in userspace)
+    static struct bpf_program fp;
+    //! Ring request
+    struct tpacket_req3 req;
+    //! Dead handle for filter compilation and dump file
+    pcap_t *dead;
+    struct sock_fprog prog, *pprog = NULL;
+    //! Device capture threads
+    pthread_t threads[MAX_CAPTURE_DEVICES];
+    int i, opened = 0, started = 0, compiled = 0, cooked = 0;
+
+    // Get ring geometry from configuration
+    memset(&req, 0, sizeof(req));
+    req.tp_block_size = get_option_int_value("capture.tpacket.blocksize");
+    req.tp_block_nr = get_option_int_value("capture.tpacket.blocks");
+    req.tp_retire_blk_tov = get_option_int_value("capture.tpacket.timeout");
+    req.tp_frame_size = TPACKET_FRAME_SIZE;
+
+    // Block size must be a multiple of page size and hold full frames
+    if (req.tp_block_size < (unsigned int) getpagesize()
+        || req.tp_block_size % getpagesize() || req.tp_block_nr == 0) {
+        fprintf(stderr, "Invalid TPACKET ring geometry %u x %u\n", req.tp_block_nr,
+            req.tp_block_size);
+        return 2;
+    }
+    req.tp_frame_nr = (req.tp_block_size / req.tp_frame_size) * req.tp_block_nr;
+
+    if (count < 1 || count > MAX_CAPTURE_DEVICES) return 2;
+
+    // Capturing on any device receives frames of different link types,
+    // so frames are received without link header as libpcap does
+    for (i = 0; i < count; i++) {
+        if (!strcmp(devices[i], "any")) cooked = 1;
+    }
+
+    if (!(dead = pcap_open_dead(cooked ? DLT_LINUX_SLL : DLT_EN10MB, MAX_CAPTURE_LEN))) {
+        return 2;
+    }
+
+    // Compile the filter once for all devices
+    if (filter_exp && strlen(filter_exp)) {
+        if (pcap_compile(dead, &fp, (char *) filter_exp, 1, PCAP_NETMASK_UNKNOWN) == -1) {
+            fprintf(stderr, "Couldn't parse filter %s: %s\n", filter_exp, pcap_geterr(dead));
+            goto error;
+        }
+        compiled = 1;
+        prog.len = fp.bf_len;
+        prog.filter = (struct sock_filter *) fp.bf_insns;
+        pprog = &prog;
+
+        // Run the filter in userspace if the kernel can not run it
+        if (cooked) {
+            if (!(prog.filter = malloc(sizeof(struct sock_filter) * prog.len))) goto error;
+            memcpy(prog.filter, fp.bf_insns, sizeof(struct sock_filter) * prog.len);
+            if (tpacket_cooked_filter(&prog) != 0) {
+                free(prog.filter);
+                pprog = NULL;
+                user_filter = &fp;
+            }
+        }
+    }
+
+    // Create a ring for each device
+    for (opened = 0; opened < count; opened++) {
+        rings[opened].req = req;
+        rings[opened].input = pipeline_input(opened);
+        rings[opened].cooked = cooked;
+        if (tpacket_open(&rings[opened], devices[opened], pprog) != 0) goto error;
+    }
+    if (pprog && cooked) free(prog.filter);
+    if (pprog) pcap_freecode(&fp);
+    pprog = NULL;
+    compiled = (user_filter != NULL);
+
+    // Get datalink and open temporal file
+    if (capture_init_dump(dead) != 0) goto error;
+
+    // Outgoing frames on this interface will be ignored
+    lo_ifindex = if_nametoindex("lo");
+
+    // Each device ring is read by its own thread, the first one by this
+    for (started = 1; started < count; started++) {
+        if (pthread_create(&threads[started], NULL, tpacket_loop, &rings[started])) {
+            fprintf(stderr, "Couldn't start capture thread for device %s\n", devices[started]);
+            goto error;
+        }
+    }
+    tpacket_loop(&rings[0]);
+
+error:
+    // Stop started capture threads before releasing their rings
+    __atomic_store_n(&tpacket_stop, 1, __ATOMIC_RELEASE);
+    for (i = 1; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    for (i = 0; i < opened; i++) {
+        tpacket_close(&rings[i]);
+    }
+    if (pprog && cooked) free(prog.filter);
+    if (compiled) pcap_freecode(&fp);
+    user_filter = NULL;
+    pcap_close(dead);
+    return 2;
+}
+
+#else
+
+int
+tpacket_capture(const char *filter_exp, const char **devices, int count)
+{
+    fprintf(stderr, "TPACKET_V3 capture is not supported in this system\n");
+    return 2;
+}
+
+#endif
+#endif
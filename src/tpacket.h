@@ -0,0 +1,67 @@
+/**************************************************************************
+ **
+ ** sngrep - SIP callflow viewer using ngrep
+ **
+ ** Copyright (C) 2013 Ivan Alonso (Kaian)
+ ** Copyright (C) 2013 Irontec SL. All rights reserved.
+ **
+ ** This program is free software: you can redistribute it and/or modify
+ ** it under the terms of the GNU General Public License as published by
+ ** the Free Software Foundation, either version 3 of the License, or
+ ** (at your option) any later version.
+ **
+ ** This program is distributed in the hope that it will be useful,
+ ** but WITHOUT ANY WARRANTY; without even the implied warranty of
+ ** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ ** GNU General Public License for more details.
+ **
+ ** You should have received a copy of the GNU General Public License
+ ** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ **
+ ****************************************************************************/
+/**
+ * @file tpacket.h
+ * @author Ivan Alonso [aka Kaian] <kaian@irontec.com>
+ *
+ * @brief Functions to capture using AF_PACKET TPACKET_V3 rings
+ *
+ * This is an alternative online capture backend for Linux. Instead of
+ * letting libpcap copy each packet through the socket buffer, the kernel
+ * fills a memory mapped ring of blocks and we walk the frames of each
+ * block in place, passing them to the parser pipeline without any
+ * intermediate copy.
+ *
+ * Each captured device gets its own ring. Ring geometry can be
+ * configured using the following options:
+ *
+ *  - capture.tpacket           Enable this backend (on/off)
+ *  - capture.tpacket.blocksize Size in bytes of each ring block
+ *  - capture.tpacket.blocks    Number of blocks in the ring
+ *  - capture.tpacket.timeout   Milliseconds before a non full block is
+ *                              handed to userspace
+ */
+#ifndef __SNGREP_TPACKET_H
+#define __SNGREP_TPACKET_H
+
+#include "spcap.h"
+
+/**
+ * @brief Capture in background using TPACKET_V3 rings
+ *
+ * Open a packet socket bound to each device (any binds to all
+ * interfaces), attach the compiled filter expression and map its
+ * receive ring. Each ring is read by its own thread: every block
+ * released by the kernel is walked frame by frame and returned to the
+ * kernel once all its frames have been parsed.
+ *
+ * This function only returns on error.
+ *
+ * @param filter_exp libpcap filter expression (can be empty)
+ * @param devices Device names
+ * @param count Number of devices
+ * @return 2 on error
+ */
+extern int
+tpacket_capture(const char *filter_exp, const char **devices, int count);
+
+#endif
@@ -105,6 +105,23 @@ call_flow_info(PANEL *panel)
     return (call_flow_info_t*) panel_userptr(panel);
 }
 
+/**
+ * @brief Free the columns of the displayed group
+ *
+ * @param info Call flow panel information
+ */
+static void
+call_flow_columns_clear(call_flow_info_t *info)
+{
+    call_flow_column_t *column;
+
+    while ((column = info->columns)) {
+        info->columns = column->next;
+        free(column);
+    }
+    info->colmsgs = 0;
+}
+
 void
 call_flow_destroy(PANEL *panel)
 {
@@ -112,7 +129,11 @@ call_flow_destroy(PANEL *panel)
     // Hide the panel
     hide_panel(panel);
     // Free the panel information
-    if ((info = call_flow_info(panel))) free(info);
+    if ((info = call_flow_info(panel))) {
+        call_flow_columns_clear(info);
+        call_group_destroy(info->group);
+        free(info);
+    }
     // Delete panel window
     delwin(panel_window(panel));
     // Delete panel
@@ -120,26 +141,27 @@ call_flow_destroy(PANEL *panel)
 }
 
 int
-call_flow_redraw_required(PANEL *panel, sip_msg_t *msg)
+call_flow_redraw_required(PANEL *panel)
 {
-    int i;
     // Get panel information
     call_flow_info_t *info;
+    sip_msg_t *msg;
+    int msgcnt;
 
     // Check we have panel info
-    if (!(info = call_flow_info(panel))) return -1;
+    if (!(info = call_flow_info(panel)) || !info->group) return -1;
 
-    // Check if the owner of the message is in the displayed group
-    for (i = 0; i < info->group->callcnt; i++) {
-        if (info->group->calls[i] == msg->call) {
-            if (!msg->parsed) msg_parse(msg);
-            call_flow_column_add(panel, CALLID(msg), SRC(msg));
-            call_flow_column_add(panel, CALLID(msg), DST(msg));
-            return 0;
-        }
-    }
+    // Nothing to redraw if the displayed group has no new messages
+    if ((msgcnt = call_group_msg_count(info->group)) == info->colmsgs) return -1;
 
-    return -1;
+    // Add the columns of new messages
+    for (; info->colmsgs < msgcnt; info->colmsgs++) {
+        if (!(msg = call_group_get_msg(info->group, info->colmsgs))) break;
+        if (!msg->parsed) msg_parse(msg);
+        call_flow_column_add(panel, CALLID(msg), SRC(msg));
+        call_flow_column_add(panel, CALLID(msg), DST(msg));
+    }
+    return 0;
 }
 
 int
@@ -230,6 +252,7 @@ call_flow_draw_columns(PANEL *panel)
             call_flow_column_add(panel, CALLID(msg), SRC(msg));
             call_flow_column_add(panel, CALLID(msg), DST(msg));
         }
+        info->colmsgs = call_group_msg_count(info->group);
     }
 
     // Draw vertical columns lines
@@ -287,6 +310,10 @@ call_flow_draw_message(PANEL *panel, sip_msg_t *msg, int cline)
     int msglen = strlen(method);
     if (msglen > 24) msglen = 24;
 
+    // Messages merged in the middle of the timeline may not have columns yet
+    call_flow_column_add(panel, msg_callid, msg_src);
+    call_flow_column_add(panel, msg_callid, msg_dst);
+
     // Get origin and destiny column
     call_flow_column_t *column1 = call_flow_column_get(panel, msg_callid, msg_src);
     call_flow_column_t *column2 = call_flow_column_get(panel, msg_callid, msg_dst);
@@ -325,8 +352,8 @@ call_flow_draw_message(PANEL *panel, sip_msg_t *msg, int cline)
         }
         if (msg->color == -1) {
             if ((prev = call_get_prev_msg(msg->call, msg))) {
-                if (strcmp(msg_get_attribute(msg, SIP_ATTR_CSEQ),
-                    msg_get_attribute(prev, SIP_ATTR_CSEQ))) {
+                // CSeq values are interned, equal values share pointer
+                if (msg_get_attribute(msg, SIP_ATTR_CSEQ) != msg_get_attribute(prev, SIP_ATTR_CSEQ)) {
                     info->group->color = msg->call->color = (info->group->color++ % 7) + 1;
                 }
             }
@@ -340,7 +367,7 @@ call_flow_draw_message(PANEL *panel, sip_msg_t *msg, int cline)
     mvwprintw(win, cline, startpos + distance / 2 - msglen / 2 + 2, "%.26s", method);
     mvwhline(win, cline + 1, startpos + 2, ACS_HLINE, distance);
     // Write the arrow at the end of the message (two arros if this is a retrans)
-    if (!strcasecmp(msg_src, column1->addr)) {
+    if (msg_src == column1->addr) {
         mvwaddch(win, cline + 1, endpos - 2, ACS_RARROW);
         if (msg_is_retrans(msg)) {
             mvwaddch(win, cline + 1, endpos - 3, ACS_RARROW);
@@ -370,6 +397,7 @@ call_flow_draw_raw(PANEL *panel, sip_msg_t *msg)
     call_flow_info_t *info;
     WINDOW *win, *raw_win;
     int raw_width, raw_height, raw_line, raw_char, column, line, height, width;
+    const char *payload_line;
 
     // Get panel information
     info = call_flow_info(panel);
@@ -418,8 +446,9 @@ call_flow_draw_raw(PANEL *panel, sip_msg_t *msg)
 
     // Print msg payload
     for (line = 0, raw_line = 0; raw_line < msg->plines; raw_line++) {
+        payload_line = msg_get_line(msg, raw_line);
         // Add character by character
-        for (column = 0, raw_char = 0; raw_char < strlen(msg->payload[raw_line]); raw_char++) {
+        for (column = 0, raw_char = 0; payload_line[raw_char]; raw_char++) {
             // Wrap at the end of the window
             if (column == raw_width) {
                 line++;
@@ -428,7 +457,7 @@ call_flow_draw_raw(PANEL *panel, sip_msg_t *msg)
             // Don't write out of the window
             if (line >= raw_height) break;
             // Put next character in position
-            mvwaddch(raw_win, line, column++, msg->payload[raw_line][raw_char]);
+            mvwaddch(raw_win, line, column++, payload_line[raw_char]);
         }
         // Done with this payload line, go to the next one
         line++;
@@ -466,14 +495,8 @@ call_flow_handle_key(PANEL *panel, int key)
         }
         break;
     case KEY_UP:
-        // FIXME We start searching from the fist one
-        // FIXME This wont work well with a lot of msg
-        while ((next = call_group_get_next_msg(info->group, next))) {
-            if (next == info->cur_msg) break;
-            prev = next;
-        }
         // We're at the first message already
-        if (!prev) break;
+        if (!(prev = call_group_get_prev_msg(info->group, info->cur_msg))) break;
         info->cur_msg = prev;
         info->cur_line -= 2;
         if (info->cur_line <= 0) {
@@ -494,16 +517,13 @@ call_flow_handle_key(PANEL *panel, int key)
     case 'x':
         wclear(panel_window(panel));
         // KEY_X , Display current call flow
+        if (!(group = call_group_create())) break;
+        call_group_add(group, info->group->calls[0]);
         if (info->group->callcnt == 1) {
-            group = call_group_create();
-            call_group_add(group, info->group->calls[0]);
             call_group_add(group, call_get_xcall(info->group->calls[0]));
-            call_flow_set_group(group);
-        } else {
-            group = call_group_create();
-            call_group_add(group, info->group->calls[0]);
-            call_flow_set_group(group);
         }
+        call_flow_set_group(group);
+        call_group_destroy(group);
         break;
     case 'r':
         // KEY_R, display current call in raw mode
@@ -615,15 +635,24 @@ call_flow_set_group(sip_call_group_t *group)
 {
     PANEL *panel;
     call_flow_info_t *info;
+    sip_call_group_t *copy;
+    int i;
 
     if (!(panel = ui_get_panel(ui_find_by_type(DETAILS_PANEL)))) return -1;
 
     if (!(info = call_flow_info(panel))) return -1;
 
-    info->group = group;
-    info->cur_msg = info->first_msg = call_group_get_next_msg(group, NULL);
+    // Panel displays its own copy of the group
+    if (!(copy = call_group_create())) return -1;
+    for (i = 0; i < group->callcnt; i++) {
+        call_group_add(copy, group->calls[i]);
+    }
+    call_group_destroy(info->group);
+    call_flow_columns_clear(info);
+
+    info->group = copy;
+    info->cur_msg = info->first_msg = call_group_get_next_msg(copy, NULL);
     info->cur_line = 1;
-    info->columns = NULL;
 
     return 0;
 }
@@ -641,7 +670,7 @@ call_flow_column_add(PANEL *panel, const char *callid, const char *addr)
 
     column = info->columns;
     while (column) {
-        if (!strcasecmp(addr, column->addr) && column->colpos != 0 && !column->callid2) {
+        if (addr == column->addr && column->colpos != 0 && !column->callid2) {
             column->callid2 = callid;
             return;
         }
@@ -667,9 +696,10 @@ call_flow_column_get(PANEL *panel, const char *callid, const char *addr)
 
     if (!(info = call_flow_info(panel))) return NULL;
 
+    // Addresses are interned, so they can be compared by pointer
     columns = info->columns;
     while (columns) {
-        if (!strcasecmp(addr, columns->addr)) {
+        if (addr == columns->addr) {
             if (is_option_enabled("cf.splitcallid")) return columns;
             if (columns->callid && !strcasecmp(callid, columns->callid)) return columns;
             if (columns->callid2 && !strcasecmp(callid, columns->callid2)) return columns;
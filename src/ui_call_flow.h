@@ -65,6 +65,8 @@ struct call_flow_info
     int raw_width;
     int cur_line;
     call_flow_column_t *columns;
+    //! Group messages whose columns have been added
+    int colmsgs;
 };
 
 /**
@@ -93,15 +95,14 @@ call_flow_destroy(PANEL *panel);
 /**
  * @brief Check if the panel requires to be redrawn
  *
- * During online mode, this function will be invoked if this is the topmost
- * panel every time a new message has been readed.
+ * This function will be invoked from the UI thread if this is the topmost
+ * panel and new messages have been readed since last check.
  *
  * @param panel Ncurses panel pointer
- * @param msg New readed message
  * @return 0 if the panel needs to be redrawn, -1 otherwise
  */
 extern int
-call_flow_redraw_required(PANEL *panel, sip_msg_t *msg);
+call_flow_redraw_required(PANEL *panel);
 
 /**
  * @brief Draw the Call flow extended panel
@@ -156,6 +157,9 @@ call_flow_help(PANEL *panel);
  * This function will access the panel information and will set the
  * group call pointer to the processed calls.
  *
+ * The panel keeps a copy of the given group, that is freed when the
+ * panel is destroyed, so the caller still owns the given group.
+ *
  * @param group Call group pointer to be set in the internal info struct
  */
 extern int
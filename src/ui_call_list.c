@@ -35,6 +35,11 @@
 #include "ui_call_list.h"
 #include "ui_call_flow.h"
 #include "ui_call_raw.h"
+#ifdef WITH_LIBPCAP
+#include "spcap.h"
+#include "ipfrag.h"
+#include "tcpstream.h"
+#endif
 
 PANEL *
 call_list_create()
@@ -124,14 +129,17 @@ call_list_destroy(PANEL *panel)
     hide_panel(panel);
 
     // Free its status data
-    if ((info = (call_list_info_t*) panel_userptr(panel))) free(info);
+    if ((info = (call_list_info_t*) panel_userptr(panel))) {
+        call_group_destroy(info->group);
+        free(info);
+    }
 
     // Finally free the panel memory
     del_panel(panel);
 }
 
 int
-call_list_redraw_required(PANEL *panel, sip_msg_t *msg)
+call_list_redraw_required(PANEL *panel)
 {
     //@todo alway redraw this screen on new messages
     return 0;
@@ -144,6 +152,18 @@ call_list_draw(PANEL *panel)
     struct sip_call *call;
     int callcnt;
     const char *call_attr, *ouraddr;
+#if defined(WITH_LIBPCAP) && !defined(WITH_NGREP)
+    struct capture_stats stats;
+    struct ipfrag_stats fstats;
+    struct tcpstream_stats tstats;
+    char counters[256];
+#endif
+#ifdef WITH_LIBPCAP
+    struct capture_load_stats lstats;
+    struct timeval now;
+    char progress[256];
+    long elapsed, eta;
+#endif
 
     // Get panel info
     call_list_info_t *info = (call_list_info_t*) panel_userptr(panel);
@@ -156,6 +176,52 @@ call_list_draw(PANEL *panel)
     // Print in the header if we're actually capturing
     mvwprintw(win, 3, 23, "%s", is_option_enabled("sip.capture")?"          ":" (Paused)");
 
+#if defined(WITH_LIBPCAP) && !defined(WITH_NGREP)
+    // Print capture drops in online mode
+    if (!strcasecmp(get_option_value("sngrep.mode"), "Online")) {
+        capture_get_stats(&stats);
+        sprintf(counters, "Dropped: %lu/%lu  Overflow: %lu  Unsaved: %lu", stats.drop,
+            stats.recv, stats.overflow, stats.unsaved);
+        if (width > 41) mvwprintw(win, 3, 40, "%-*.*s", width - 41, width - 41, counters);
+        // Clear previous (longer) values before printing current ones
+        tcpstream_get_stats(&tstats);
+        sprintf(counters, "TCP Flows: %lu  Evicted: %lu", tstats.flows, tstats.evicted);
+        mvwprintw(win, 4, 2, "%-37.37s", counters);
+        ipfrag_get_stats(&fstats);
+        sprintf(counters, "Reassembled: %lu  Expired: %lu  Evicted: %lu",
+            fstats.reassembled, fstats.expired, fstats.evicted);
+        if (width > 41) mvwprintw(win, 4, 40, "%-*.*s", width - 41, width - 41, counters);
+    }
+#endif
+
+#ifdef WITH_LIBPCAP
+    // Print capture file loading progress in offline mode
+    if (!strcasecmp(get_option_value("sngrep.mode"), "Offline") && width > 41) {
+        capture_get_load_stats(&lstats);
+        if (lstats.status == CAPTURE_LOAD_RUNNING) gettimeofday(&now, NULL);
+        else now = lstats.end;
+        elapsed = (now.tv_sec - lstats.start.tv_sec) * 1000
+            + (now.tv_usec - lstats.start.tv_usec) / 1000;
+        if (elapsed <= 0) elapsed = 1;
+
+        if (lstats.status == CAPTURE_LOAD_FAILED) {
+            sprintf(progress, "Error loading file: %.200s", lstats.error);
+        } else if (lstats.status == CAPTURE_LOAD_DONE) {
+            sprintf(progress, "Loaded: %lu packets (%.1f MB) in %.1fs", lstats.packets,
+                lstats.read / 1048576.0, elapsed / 1000.0);
+        } else {
+            sprintf(progress, "Loading: %lu pkts/s", lstats.packets * 1000 / elapsed);
+            if (lstats.size && lstats.read) {
+                eta = (lstats.size - lstats.read) / 1000 * elapsed / lstats.read;
+                sprintf(progress + strlen(progress), "  %.1f/%.1f MB (%d%%)  ETA: %ld:%02ld",
+                    lstats.read / 1048576.0, lstats.size / 1048576.0,
+                    (int) (lstats.read * 100 / lstats.size), eta / 60, eta % 60);
+            }
+        }
+        mvwprintw(win, 3, 40, "%-*.*s", width - 41, width - 41, progress);
+    }
+#endif
+
     // Get available calls counter (we'll use it here a couple of times)
     if (!(callcnt = sip_calls_count())) return 0;
 
@@ -290,6 +356,7 @@ call_list_handle_key(PANEL *panel, int key)
             call_group_add(group, info->cur_call);
         }
         call_flow_set_group(group);
+        if (group != info->group) call_group_destroy(group);
         wait_for_input(next_panel);
         break;
     case 'x':
@@ -304,6 +371,7 @@ call_list_handle_key(PANEL *panel, int key)
             call_group_add(group, call_get_xcall(info->cur_call));
         }
         call_flow_set_group(group);
+        if (group != info->group) call_group_destroy(group);
         wait_for_input(next_panel);
         break;
     case 'r':
@@ -511,7 +579,7 @@ call_list_filter_update(PANEL *panel)
     // Initialize structures
     info->first_call = info->cur_call = NULL;
     info->first_line = info->cur_line = 0;
-    info->group->callcnt = 0;
+    call_group_clear(info->group);
 
     // Get Window dimensions
     getmaxyx(win, height, width);
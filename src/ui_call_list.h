@@ -105,15 +105,14 @@ call_list_destroy(PANEL *panel);
 /**
  * @brief Check if the panel requires to be redrawn
  *
- * During online mode, this function will be invoked if this is the topmost
- * panel every time a new message has been readed.
+ * This function will be invoked from the UI thread if this is the topmost
+ * panel and new messages have been readed since last check.
  *
  * @param panel Ncurses panel pointer
- * @param msg New readed message
  * @return 0 if the panel needs to be redrawn, -1 otherwise
  */
 extern int
-call_list_redraw_required(PANEL *panel, sip_msg_t *msg);
+call_list_redraw_required(PANEL *panel);
 
 /**
  * @brief Draw the Call list panel
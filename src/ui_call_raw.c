@@ -62,19 +62,30 @@ call_raw_create()
 }
 
 int
-call_raw_redraw_required(PANEL *panel, sip_msg_t *msg)
+call_raw_redraw_required(PANEL *panel)
 {
     call_raw_info_t *info;
+    int msgcnt;
+
     // Get panel info
     if (!(info = (call_raw_info_t*) panel_userptr(panel))) return -1;
     // Check if we're displaying a group
     if (!info->group) return -1;
-    // If this message belongs to one of the printed calls
-    if (call_group_exists(info->group, msg->call)) {
-        call_raw_print_msg(panel, msg_parse(msg));
-        return 0;
+    // Check if the group has new messages
+    if ((msgcnt = call_group_msg_count(info->group)) == info->msgcnt) return -1;
+
+    // New messages have been merged before the printed ones, print all again
+    if (info->msgcnt && call_group_get_msg(info->group, info->msgcnt - 1) != info->last) {
+        info->msgcnt = info->padline = 0;
+        wclear(info->pad);
+    }
+
+    // Print new messages at the end of the pad
+    for (; info->msgcnt < msgcnt; info->msgcnt++) {
+        info->last = call_group_get_msg(info->group, info->msgcnt);
+        call_raw_print_msg(panel, msg_parse(info->last));
     }
-    return -1;
+    return 0;
 }
 
 int
@@ -95,6 +106,10 @@ call_raw_print_msg(PANEL *panel, sip_msg_t *msg)
 
     // Variables for drawing each message character
     int raw_line, raw_char, column;
+    // Payload line being drawn
+    const char *payload_line;
+    // Message header line
+    char header[256];
 
     // Get panel information
     call_raw_info_t *info = (call_raw_info_t*) panel_userptr(panel);
@@ -147,19 +162,20 @@ call_raw_print_msg(PANEL *panel, sip_msg_t *msg)
 
     // Print msg header
     wattron(pad, A_BOLD);
-    mvwprintw(pad, line++, 0, "%s", msg->headerptr);
+    mvwprintw(pad, line++, 0, "%s", msg_get_header(msg, header));
     wattroff(pad, A_BOLD);
 
     // Print msg payload
     for (raw_line = 0; raw_line < msg->plines; raw_line++) {
+        payload_line = msg_get_line(msg, raw_line);
         // Add character by character
-        for (column = 0, raw_char = 0; raw_char < strlen(msg->payload[raw_line]); raw_char++) {
+        for (column = 0, raw_char = 0; payload_line[raw_char]; raw_char++) {
             // Wrap at the end of the window
             if (column == COLS) {
                 line++;
                 column = 0;
             }
-            mvwaddch(pad, line, column++, msg->payload[raw_line][raw_char]);
+            mvwaddch(pad, line, column++, payload_line[raw_char]);
         }
         // Increase line after writting it
         line++;
@@ -245,11 +261,16 @@ call_raw_set_group(sip_call_group_t *group)
 
     // Initialize internal pad
     info->padline = info->scroll = 0;
+    info->msgcnt = 0;
+    info->last = NULL;
     wclear(info->pad);
 
    // Print the call group messages into the pad
-    while ((msg = call_group_get_next_msg(info->group, msg)))
+    while ((msg = call_group_get_next_msg(info->group, msg))) {
         call_raw_print_msg(panel, msg);
+        info->last = msg;
+        info->msgcnt++;
+    }
 
     return 0;
 }
@@ -45,6 +45,10 @@ typedef struct call_raw_info call_raw_info_t;
 struct call_raw_info
 {
     sip_call_group_t *group;
+    //! Group messages printed in the pad
+    int msgcnt;
+    //! Last printed message
+    sip_msg_t *last;
     WINDOW *pad;
     int padline;
     int scroll;
@@ -66,15 +70,14 @@ call_raw_create();
 /**
  * @brief Check if the panel requires to be redrawn
  *
- * During online mode, this function will be invoked if this is the topmost
- * panel every time a new message has been readed.
+ * This function will be invoked from the UI thread if this is the topmost
+ * panel and new messages have been readed since last check.
  *
  * @param panel Ncurses panel pointer
- * @param msg New readed message
  * @return 0 if the panel needs to be redrawn, -1 otherwise
  */
 extern int
-call_raw_redraw_required(PANEL *panel, sip_msg_t *msg);
+call_raw_redraw_required(PANEL *panel);
 
 /**
  * @brief Draw the Call Raw panel
@@ -34,6 +34,9 @@
 #include "ui_filter.h"
 #include "ui_save_pcap.h"
 #include "ui_save_raw.h"
+#ifdef WITH_LIBPCAP
+#include "spcap.h"
+#endif
 
 /**
  * @brief Warranty thread-safe ui refresh
@@ -43,6 +46,9 @@
  */
 pthread_mutex_t refresh_lock;
 
+//! New messages have been readed since last check
+static int refresh_pending = 0;
+
 /**
  * @brief Available panel windows list
  *
@@ -51,7 +57,7 @@ pthread_mutex_t refresh_lock;
  *
  * XXX If the panel count increase a lot, it will be required to
  *     load panels as modules and provide a way to register
- *     themselfs into the panel pool dynamically.
+ *     themselves into the panel pool dynamically.
  */
 static ui_t panel_pool[] = {
     {
@@ -70,7 +76,8 @@ static ui_t panel_pool[] = {
         .redraw_required = call_flow_redraw_required,
         .draw = call_flow_draw,
         .handle_key = call_flow_handle_key,
-        .help = call_flow_help },
+        .help = call_flow_help,
+        .destroy = call_flow_destroy },
     {
         .type = RAW_PANEL,
         .panel = NULL,
@@ -161,7 +168,7 @@ ui_get_panel(ui_t *ui)
 }
 
 int
-ui_redraw_required(ui_t *ui, sip_msg_t *msg)
+ui_redraw_required(ui_t *ui)
 {
     int ret = 0;
     //! Sanity check, this should not happen
@@ -169,7 +176,7 @@ ui_redraw_required(ui_t *ui, sip_msg_t *msg)
     pthread_mutex_lock(&ui->lock);
     // Request the panel to draw on the scren
     if (ui->redraw_required) {
-        ret = ui->redraw_required(ui_get_panel(ui), msg);
+        ret = ui->redraw_required(ui_get_panel(ui));
     }
     pthread_mutex_unlock(&ui->lock);
     // If no redraw capabilities, never redraw
@@ -251,6 +258,7 @@ wait_for_input(ui_t *ui)
 {
     ui_t *replace;
     WINDOW *win;
+    int c;
 
     // Keep getting keys until panel is destroyed
     while (ui_get_panel(ui)) {
@@ -270,8 +278,15 @@ wait_for_input(ui_t *ui)
         win = panel_window(ui_get_panel(ui));
         keypad(win, TRUE);
 
-        // Get pressed key
-        int c = wgetch(win);
+        // Get pressed key, checking for new messages meanwhile
+        wtimeout(win, UI_REFRESH_INTERVAL);
+        while ((c = wgetch(win)) == ERR) {
+            if (__atomic_exchange_n(&refresh_pending, 0, __ATOMIC_ACQ_REL)
+                && ui_redraw_required(ui) == 0) break;
+        }
+
+        // Only redraw the panel with new messages
+        if (c == ERR) continue;
 
         // Check if current panel has custom bindings for that key
         if ((c = ui_handle_key(ui, c)) == 0) continue;
@@ -298,6 +313,10 @@ wait_for_input(ui_t *ui)
         case 'p':
             // Toggle capture option
             toggle_option("sip.capture");
+#ifdef WITH_LIBPCAP
+            // Continue loading the capture file (if paused)
+            if (is_option_enabled("sip.capture")) capture_load_resume();
+#endif
             break;
         case 'h':
         case 265: /* KEY_F1 */
@@ -353,18 +372,8 @@ toggle_color(int on)
 void
 ui_new_msg_refresh(sip_msg_t *msg)
 {
-    PANEL *panel;
-
-    pthread_mutex_lock(&refresh_lock);
-    // Get the topmost panel
-    if ((panel = panel_below(NULL))) {
-        // Get ui information for that panel
-        if (ui_redraw_required(ui_find_by_panel(panel), msg) == 0) {
-            // If ui needs to be update, redraw it
-            ui_draw_panel(ui_find_by_panel(panel));
-        }
-    }
-    pthread_mutex_unlock(&refresh_lock);
+    // UI thread will redraw the topmost panel if required
+    __atomic_store_n(&refresh_pending, 1, __ATOMIC_RELEASE);
 }
 
 void
@@ -387,9 +396,9 @@ title_foot_box(WINDOW *win)
 int
 ui_set_replace(ui_t *original, ui_t *replace)
 {
-    pthread_mutex_lock(&refresh_lock);
     if (!original || !replace) return -1;
+    pthread_mutex_lock(&refresh_lock);
     original->replace = replace;
-    return 0;
     pthread_mutex_unlock(&refresh_lock);
+    return 0;
 }
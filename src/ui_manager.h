@@ -41,6 +41,9 @@
 #include "sip.h"
 #include "group.h"
 
+//! Milliseconds between checks for new messages while waiting for input
+#define UI_REFRESH_INTERVAL 200
+
 //! Shorter declaration of ui structure
 typedef struct ui ui_t;
 
@@ -65,9 +68,9 @@ struct ui
     //! Request the panel to redraw its data
     int
     (*draw)(PANEL*);
-    //! Check if the panel request redraw with given msg
+    //! Check if the panel request redraw after new messages
     int
-    (*redraw_required)(PANEL *, sip_msg_t *);
+    (*redraw_required)(PANEL *);
     //! Handle a custom keybind on this panel
     int
     (*handle_key)(PANEL*, int key);
@@ -181,18 +184,17 @@ extern PANEL *
 ui_get_panel(ui_t *ui);
 
 /**
- * @brief Check if the given msg makes the UI redraw
+ * @brief Check if new messages make the UI redraw
  *
- * This function is ivoked every time a new package is readed
- * in online mode. Check if the ui needs to be redrawn with the
- * message to avioid not needed work.
+ * This function is invoked from the UI thread when new messages
+ * have been readed. Check if the ui needs to be redrawn to avoid
+ * not needed work.
  *
  * @param ui UI structure
- * @param msg las readed message
  * @return 0 in case of redraw required, -1 otherwise
  */
 extern int
-ui_redraw_required(ui_t *ui, sip_msg_t *msg);
+ui_redraw_required(ui_t *ui);
 
 /**
  * @brief Redrawn current ui
@@ -274,14 +276,19 @@ extern void
 title_foot_box(WINDOW *win);
 
 /**
- * @brief Update topmost panel with the newest readed message
+ * @brief Notify the UI about new readed messages
+ *
+ * This function is invoked asynchronously from capture, parser and
+ * loader threads (or the ngrep exec thread). It only flags that there
+ * are new messages: ncurses and panels data are only used from the UI
+ * thread, that checks this flag every UI_REFRESH_INTERVAL milliseconds
+ * while waiting for user input and redraws the topmost panel if
+ * required.
  *
- * This function is invocked asynchronously from the
- * ngrep exec thread to notify a new message of the giving
- * callid. If the UI is displaying this call or it's
- * extended one, the topmost panel will be redraw again
+ * While loading a capture file, this is invoked periodically
+ * without message.
  *
- * @param msg Last readed message in Online mode
+ * @param msg Last readed message (or NULL)
  */
 extern void
 ui_new_msg_refresh(sip_msg_t *msg);
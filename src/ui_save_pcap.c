@@ -34,6 +34,9 @@
 #include <form.h>
 #include "ui_save_pcap.h"
 #include "option.h"
+#ifdef WITH_LIBPCAP
+#include "pipeline.h"
+#endif
 
 PANEL *
 save_create()
@@ -228,6 +231,11 @@ save_to_file(PANEL *panel)
     memset(field_value, 0, sizeof(field_value));
     sscanf(field_buffer(info->fields[FLD_SAVE_FILE], 0), "%[^ ]", field_value);
 
+#if defined(WITH_LIBPCAP) && !defined(WITH_NGREP)
+    // Make sure all captured packets are in the temporal file
+    pipeline_dump_sync();
+#endif
+
     fd_from = open(get_option_value("sngrep.tmpfile"), O_RDONLY);
     if (fd_from < 0) {
         save_error_message(panel, "Unable to open sngrep tempfile");
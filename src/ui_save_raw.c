@@ -220,6 +220,7 @@ int
 save_raw_to_file(PANEL *panel)
 {
     char field_value[48];
+    char header[256];
     FILE *f;
     sip_msg_t *msg = NULL;
     int i;
@@ -240,9 +241,9 @@ save_raw_to_file(PANEL *panel)
 
     // Print the call group messages into the pad
     while ((msg = call_group_get_next_msg(info->group, msg))) {
-        fprintf(f, "%s\n", msg->headerptr);
+        fprintf(f, "%s\n", msg_get_header(msg, header));
         for (i=0; i < msg->plines; i++) {
-            fprintf(f, "%s\n", msg->payload[i]);
+            fprintf(f, "%s\n", msg_get_line(msg, i));
         }
         fprintf(f, "\n");
     }